@@ -0,0 +1,442 @@
+#!/usr/bin/env bun
+// Benchmark harness on top of the counters.
+//
+//   bun bench.ts suites/*.bench.ts --save base.json
+//   bun bench.ts suites/*.bench.ts --compare base.json --threshold 1
+//
+// Benchmark files register suites with `suite()` and `bench()`. Every
+// sample calls the function enough times to run for `minCycles`, samples
+// outside the Tukey fences of the cycle counts are dropped, and the means
+// come with a 95% confidence interval. Comparisons use instructions, which
+// barely move between runs of the same code, unlike time or cycles.
+//
+// Benchmarks of code that uses the counters itself, such as the suite of
+// this library in self.bench.ts, set `sampled`: their samples read an
+// `open()` session around each batch instead of nesting in `run()`.
+
+import { readFileSync, writeFileSync } from "fs";
+import { resolve } from "path";
+import {
+  count,
+  currentCpu,
+  init,
+  open,
+  run,
+  runMany,
+  type Session,
+} from "./index";
+
+export interface BenchOptions {
+  /** Cycles one sample should at least take. Defaults to 100000. */
+  minCycles?: number;
+  /** Number of samples. Defaults to 200. */
+  samples?: number;
+  /** Samples run before measuring. Defaults to 10. */
+  warmup?: number;
+  /** Drop samples outside the Tukey fences. Defaults to true. */
+  rejectOutliers?: boolean;
+  /**
+   * Sample the counters of an `open()` session before and after each
+   * batch instead of measuring it with `run()`. Needed when the function
+   * calls `start()`/`stop()` or `run()` itself, which don't nest. The
+   * results then include the time per call.
+   */
+  sampled?: boolean;
+  /** Called before the benchmark is calibrated and measured. */
+  setup?: () => void;
+  /** Called after the benchmark was measured. */
+  teardown?: () => void;
+}
+
+export interface Estimate {
+  /** Per call. */
+  mean: number;
+  median: number;
+  stddev: number;
+  /** 95% confidence interval of the mean. */
+  ci: [number, number];
+}
+
+export interface BenchResult {
+  suite: string;
+  name: string;
+  /** Calls per sample. */
+  batch: number;
+  /** Samples kept. */
+  samples: number;
+  /** Samples dropped as outliers. */
+  rejected: number;
+  cycles: Estimate;
+  instructions: Estimate;
+  /** Nanoseconds per call, for `sampled` benchmarks. */
+  ns?: Estimate;
+}
+
+interface Benchmark {
+  name: string;
+  fn: () => void;
+  options?: BenchOptions;
+}
+
+interface Suite {
+  name: string;
+  benchmarks: Benchmark[];
+}
+
+const suites: Suite[] = [];
+var current: Suite | null = null;
+
+/** Register a suite. `bench()` calls inside `define` belong to it. */
+export function suite(name: string, define: () => void) {
+  const previous = current;
+  current = { name, benchmarks: [] };
+  suites.push(current);
+  try {
+    define();
+  } finally {
+    current = previous;
+  }
+}
+
+/** Register a benchmark in the current suite, or in "default". */
+export function bench(name: string, fn: () => void, options?: BenchOptions) {
+  let target = current || suites.find((s) => s.name === "default");
+  if (!target) {
+    target = { name: "default", benchmarks: [] };
+    suites.push(target);
+  }
+  target.benchmarks.push({ name, fn, options });
+}
+
+// two-sided 95% Student t quantiles for 1..30 degrees of freedom
+const T95 = [
+  12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+  2.201, 2.179, 2.16, 2.145, 2.131, 2.12, 2.11, 2.101, 2.093, 2.086, 2.08,
+  2.074, 2.069, 2.064, 2.06, 2.056, 2.052, 2.048, 2.045, 2.042,
+];
+
+function t95(df: number) {
+  return df < 1 ? NaN : df <= T95.length ? T95[df - 1] : 1.96;
+}
+
+function quantile(sorted: Float64Array, q: number) {
+  const pos = (sorted.length - 1) * q;
+  const lo = Math.floor(pos);
+  const hi = Math.ceil(pos);
+  return sorted[lo] + (sorted[hi] - sorted[lo]) * (pos - lo);
+}
+
+export function estimate(values: Float64Array): Estimate {
+  const n = values.length;
+  const sorted = values.slice().sort();
+  let sum = 0;
+  for (const value of values) sum += value;
+  const mean = sum / n;
+  let variance = 0;
+  for (const value of values) variance += (value - mean) ** 2;
+  const stddev = n > 1 ? Math.sqrt(variance / (n - 1)) : 0;
+  const half = (t95(n - 1) * stddev) / Math.sqrt(n);
+  return {
+    mean,
+    median: quantile(sorted, 0.5),
+    stddev,
+    ci: [mean - half, mean + half],
+  };
+}
+
+/** Indices of the values inside the Tukey fences, 1.5 IQR past the quartiles. */
+function inliers(values: Float64Array): number[] {
+  const sorted = values.slice().sort();
+  const q1 = quantile(sorted, 0.25);
+  const q3 = quantile(sorted, 0.75);
+  const lo = q1 - 1.5 * (q3 - q1);
+  const hi = q3 + 1.5 * (q3 - q1);
+  const kept: number[] = [];
+  for (let i = 0; i < values.length; i++) {
+    if (values[i] >= lo && values[i] <= hi) kept.push(i);
+  }
+  return kept;
+}
+
+/** Smallest power of 2 of calls that takes `minCycles`. */
+function calibrate(fn: () => void, minCycles: number) {
+  let batch = 1;
+  for (;;) {
+    const n = batch;
+    run(() => {
+      for (let i = 0; i < n; i++) fn();
+    });
+    if (count.cycles >= minCycles || batch >= 1 << 24) return batch;
+    batch *= 2;
+  }
+}
+
+/** Keep the samples inside the Tukey fences of `cycles`, if asked to. */
+function summarize(
+  suiteName: string,
+  benchmark: Benchmark,
+  batch: number,
+  cycles: Float64Array,
+  instructions: Float64Array,
+  ns?: Float64Array
+): BenchResult {
+  let kept = [...cycles.keys()];
+  if (benchmark.options?.rejectOutliers ?? true) kept = inliers(cycles);
+  const pick = (values: Float64Array) =>
+    Float64Array.from(kept, (i) => values[i]);
+
+  const result: BenchResult = {
+    suite: suiteName,
+    name: benchmark.name,
+    batch,
+    samples: kept.length,
+    rejected: cycles.length - kept.length,
+    cycles: estimate(pick(cycles)),
+    instructions: estimate(pick(instructions)),
+  };
+  if (ns) result.ns = estimate(pick(ns));
+  return result;
+}
+
+/**
+ * Read `session` around `batch` calls of `fn`.
+ * @returns The nanoseconds the calls took. The counts are `after - before`.
+ */
+function sampleBatch(
+  fn: () => void,
+  batch: number,
+  session: Session,
+  before: BigUint64Array,
+  after: BigUint64Array
+) {
+  session.sample(before);
+  const begin = Bun.nanoseconds();
+  for (let i = 0; i < batch; i++) fn();
+  const end = Bun.nanoseconds();
+  session.sample(after);
+  return end - begin;
+}
+
+function measureSampled(
+  suiteName: string,
+  benchmark: Benchmark
+): BenchResult {
+  const options = benchmark.options;
+  const fn = benchmark.fn;
+  const samples = options?.samples ?? 200;
+  const minCycles = options?.minCycles ?? 100_000;
+  const session = open();
+  const before = new BigUint64Array(session.countersBuffer.length);
+  const after = new BigUint64Array(session.countersBuffer.length);
+  const delta = (offset: number) => Number(after[offset] - before[offset]);
+
+  let batch = 1;
+  for (;;) {
+    sampleBatch(fn, batch, session, before, after);
+    if (delta(count.cyclesOffset) >= minCycles || batch >= 1 << 24) break;
+    batch *= 2;
+  }
+  for (let i = 0; i < (options?.warmup ?? 10); i++) {
+    sampleBatch(fn, batch, session, before, after);
+  }
+
+  const cycles = new Float64Array(samples);
+  const instructions = new Float64Array(samples);
+  const ns = new Float64Array(samples);
+  for (let i = 0; i < samples; i++) {
+    ns[i] = sampleBatch(fn, batch, session, before, after) / batch;
+    cycles[i] = delta(count.cyclesOffset) / batch;
+    instructions[i] = delta(count.instructionsOffset) / batch;
+  }
+  return summarize(suiteName, benchmark, batch, cycles, instructions, ns);
+}
+
+function measure(suiteName: string, benchmark: Benchmark): BenchResult {
+  const options = benchmark.options;
+  const fn = benchmark.fn;
+  const samples = options?.samples ?? 200;
+  const batch = calibrate(fn, options?.minCycles ?? 100_000);
+  const body = () => {
+    for (let i = 0; i < batch; i++) fn();
+  };
+
+  const { sampleValues } = runMany(body, samples, {
+    warmup: options?.warmup ?? 10,
+  });
+  const stride = sampleValues.length / samples;
+  const cycles = new Float64Array(samples);
+  const instructions = new Float64Array(samples);
+  for (let i = 0; i < samples; i++) {
+    cycles[i] = sampleValues[i * stride + count.cyclesOffset] / batch;
+    instructions[i] =
+      sampleValues[i * stride + count.instructionsOffset] / batch;
+  }
+
+  return summarize(suiteName, benchmark, batch, cycles, instructions);
+}
+
+/** Run every registered benchmark whose "suite/name" matches `filter`. */
+export function runSuites(filter?: RegExp): BenchResult[] {
+  init(["cycles", "instructions"]);
+  if (count.cyclesOffset < 0 || count.instructionsOffset < 0) {
+    throw new Error("Cycles and instructions must both be counted");
+  }
+  const results: BenchResult[] = [];
+  for (const s of suites) {
+    for (const benchmark of s.benchmarks) {
+      if (filter && !filter.test(`${s.name}/${benchmark.name}`)) continue;
+      const options = benchmark.options;
+      options?.setup?.();
+      try {
+        results.push(
+          options?.sampled
+            ? measureSampled(s.name, benchmark)
+            : measure(s.name, benchmark)
+        );
+      } finally {
+        options?.teardown?.();
+      }
+    }
+  }
+  return results;
+}
+
+export interface Baseline {
+  version: 1;
+  /** Commit the baseline was taken at, if known. */
+  commit: string | null;
+  /** PMC database name of the CPU, such as "a14". */
+  cpu: string;
+  results: Record<
+    string,
+    { cycles: Estimate; instructions: Estimate; ns?: Estimate }
+  >;
+}
+
+export function toBaseline(results: BenchResult[], commit?: string): Baseline {
+  const baseline: Baseline = {
+    version: 1,
+    commit: commit ?? null,
+    cpu: currentCpu().name,
+    results: {},
+  };
+  for (const result of results) {
+    baseline.results[`${result.suite}/${result.name}`] = {
+      cycles: result.cycles,
+      instructions: result.instructions,
+      ...(result.ns ? { ns: result.ns } : {}),
+    };
+  }
+  return baseline;
+}
+
+export interface Comparison {
+  name: string;
+  baseline: number;
+  current: number;
+  /** Relative change of the mean instructions per call. */
+  change: number;
+  /** `change` is above the threshold. */
+  regression: boolean;
+  /** The confidence intervals of the two means don't overlap. */
+  significant: boolean;
+}
+
+/**
+ * Compare instructions per call with a baseline.
+ *
+ * @param threshold Relative increase that counts as a regression. Defaults
+ * to 0.01.
+ */
+export function compareBaselines(
+  baseline: Baseline,
+  current: Baseline,
+  threshold = 0.01
+): Comparison[] {
+  const out: Comparison[] = [];
+  for (const name in current.results) {
+    const before = baseline.results[name]?.instructions;
+    if (!before) continue;
+    const after = current.results[name].instructions;
+    const change = (after.mean - before.mean) / before.mean;
+    out.push({
+      name,
+      baseline: before.mean,
+      current: after.mean,
+      change,
+      regression: change > threshold,
+      significant: after.ci[0] > before.ci[1] || after.ci[1] < before.ci[0],
+    });
+  }
+  return out;
+}
+
+function gitCommit(): string | undefined {
+  const proc = Bun.spawnSync(["git", "rev-parse", "HEAD"]);
+  return proc.success ? proc.stdout.toString().trim() : undefined;
+}
+
+function format(value: number) {
+  return value.toLocaleString("en-US", { maximumFractionDigits: 1 });
+}
+
+async function main(argv: string[]) {
+  const files: string[] = [];
+  let save: string | undefined;
+  let compare: string | undefined;
+  let threshold = 1;
+  let filter: RegExp | undefined;
+  for (let i = 0; i < argv.length; i++) {
+    const arg = argv[i];
+    if (arg === "--save") save = argv[++i];
+    else if (arg === "--compare") compare = argv[++i];
+    else if (arg === "--threshold") threshold = Number(argv[++i]);
+    else if (arg === "--filter") filter = new RegExp(argv[++i]);
+    else files.push(arg);
+  }
+  if (!files.length) {
+    console.error(
+      "usage: bun bench.ts <files...> [--save file] [--compare file]" +
+        " [--threshold percent] [--filter regex]"
+    );
+    process.exit(2);
+  }
+
+  for (const file of files) await import(resolve(file));
+  const results = runSuites(filter);
+  for (const r of results) {
+    const { instructions: ins, cycles, ns } = r;
+    console.log(
+      `${r.suite}/${r.name}: ${format(ins.mean)} instructions ` +
+        `±${format(ins.ci[1] - ins.mean)}, ${format(cycles.mean)} cycles ` +
+        `±${format(cycles.ci[1] - cycles.mean)}` +
+        (ns ? `, ${format(ns.mean)} ns ±${format(ns.ci[1] - ns.mean)}` : "") +
+        ` (${r.samples} × ${r.batch} calls, ${r.rejected} outliers)`
+    );
+  }
+
+  const baseline = toBaseline(results, gitCommit());
+  if (save) writeFileSync(save, JSON.stringify(baseline, null, 2) + "\n");
+
+  if (compare) {
+    const before: Baseline = JSON.parse(readFileSync(compare, "utf8"));
+    if (before.cpu !== baseline.cpu) {
+      console.warn(`Baseline is from "${before.cpu}", not "${baseline.cpu}"`);
+    }
+    let failed = false;
+    for (const c of compareBaselines(before, baseline, threshold / 100)) {
+      const sign = c.change >= 0 ? "+" : "";
+      console.log(
+        `${c.regression ? "REGRESSION" : "ok"} ${c.name}: ` +
+          `${format(c.baseline)} -> ${format(c.current)} instructions ` +
+          `(${sign}${(c.change * 100).toFixed(2)}%)`
+      );
+      failed ||= c.regression;
+    }
+    if (failed) process.exit(1);
+  }
+}
+
+if (import.meta.main) {
+  await main(process.argv.slice(2));
+}
@@ -0,0 +1,404 @@
+// =============================================================================
+// Node-API binding
+// The entry points of counters.c (or counters.linux.c) for Node, without
+// bun:ffi. Calls return an integer status like the hot entry points of the
+// library do, the message of the last failure is kept for lastError().
+// stop() writes into a result block that JavaScript registers once with
+// results(), so the hot calls take no arguments and return a small integer.
+//
+// Node-API has no fast API calls, those are internal to V8 and change with
+// every Node release. A Node-API call costs a few tens of nanoseconds more
+// than a Bun FFI call, which the overhead calibration subtracts like the
+// cost of the syscalls.
+//
+// Every worker_threads environment loads the addon again, with its own
+// result block and error, so that state is instance data of the env.
+// =============================================================================
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <node_api.h>
+
+typedef uint32_t u32;
+typedef int32_t i32;
+typedef uint64_t u64;
+
+const char *performance_counters_init(const char *events);
+void performance_counters_set_max_groups(u32 count);
+u32 performance_counters_counter_count();
+u32 performance_counters_event_count();
+const char *performance_counters_event_name(u32 i);
+const char *performance_counters_event_db_name(u32 i);
+const char *performance_counters_event_alias(u32 i);
+u32 performance_counters_event_mode(u32 i);
+i32 performance_counters_event_slot(u32 i);
+i32 performance_counters_event_status(u32 i);
+const char *performance_counters_error_desc(i32 code);
+u32 performance_counters_retain();
+const char *performance_counters_release();
+const char *performance_counters_open();
+const char *performance_counters_sample(u64 *values);
+const char *performance_counters_close();
+i32 performance_counters_start();
+i32 performance_counters_start_inline();
+u32 performance_counters_inline_available();
+void performance_counters_set_overhead(const u64 *values, u32 inline_reads);
+u32 performance_counters_result_slots();
+u32 performance_counters_result_header_slots();
+void performance_counters_result_init(void *r);
+i32 performance_counters_stop_result(void *r);
+i32 performance_counters_stop_inline_result(void *r);
+const char *performance_counters_last_error();
+
+/// What the binding's calls return.
+typedef enum {
+  STATUS_OK = 0,
+  STATUS_FAILED = 1,           ///< The library failed, see lastError().
+  STATUS_NO_RESULTS = 2,       ///< results() was not called since init().
+  STATUS_INVALID_ARGUMENT = 3, ///< Wrong argument type or size.
+} binding_status;
+
+/// What the binding keeps for one env.
+typedef struct {
+  /// Message of the last failure, a string owned by the library.
+  const char *last_error;
+  /// Result block registered with results(), kept alive by `results_ref`.
+  void *results_ptr;
+  napi_ref results_ref;
+} binding_state;
+
+static inline binding_state *state_of(napi_env env) {
+  void *state = NULL;
+  napi_get_instance_data(env, &state);
+  return state;
+}
+
+static void state_finalize(napi_env env, void *data, void *hint) {
+  binding_state *state = data;
+  if (state->results_ref)
+    napi_delete_reference(env, state->results_ref);
+  free(state);
+}
+
+static napi_value int_value(napi_env env, i32 value) {
+  napi_value out;
+  napi_create_int32(env, value, &out);
+  return out;
+}
+
+static napi_value string_value(napi_env env, const char *str) {
+  napi_value out;
+  if (!str) {
+    napi_get_null(env, &out);
+    return out;
+  }
+  napi_create_string_utf8(env, str, NAPI_AUTO_LENGTH, &out);
+  return out;
+}
+
+static inline i32 status_of(napi_env env, const char *err) {
+  if (!err || !*err)
+    return STATUS_OK;
+  state_of(env)->last_error = err;
+  return STATUS_FAILED;
+}
+
+/// Status of a hot entry point, which keeps its own message.
+static inline i32 hot_status(napi_env env, i32 status) {
+  if (!status)
+    return STATUS_OK;
+  state_of(env)->last_error = performance_counters_last_error();
+  return STATUS_FAILED;
+}
+
+static inline napi_value fail(napi_env env, i32 status, const char *err) {
+  state_of(env)->last_error = err;
+  return int_value(env, status);
+}
+
+/// Read up to `n` arguments, the missing ones are undefined.
+static void get_args(napi_env env, napi_callback_info info, napi_value *args,
+                     size_t n) {
+  size_t argc = n;
+  napi_get_cb_info(env, info, &argc, args, NULL, NULL);
+  for (size_t i = argc; i < n; i++)
+    napi_get_undefined(env, args + i);
+}
+
+static u32 u32_arg(napi_env env, napi_value value) {
+  u32 out = 0;
+  napi_get_value_uint32(env, value, &out);
+  return out;
+}
+
+// -----------------------------------------------------------------------------
+// Configuration
+// -----------------------------------------------------------------------------
+
+/// init(events?: string, maxGroups?: number): status
+static napi_value js_init(napi_env env, napi_callback_info info) {
+  napi_value args[2];
+  get_args(env, info, args, 2);
+  char spec[1024];
+  size_t len = 0;
+  napi_valuetype type;
+  napi_typeof(env, args[0], &type);
+  if (type == napi_string) {
+    if (napi_get_value_string_utf8(env, args[0], spec, sizeof(spec), &len) !=
+            napi_ok ||
+        len == sizeof(spec) - 1)
+      return fail(env, STATUS_INVALID_ARGUMENT, "Event list is too long");
+  } else {
+    spec[0] = '\0';
+  }
+  napi_typeof(env, args[1], &type);
+  performance_counters_set_max_groups(type == napi_number
+                                          ? u32_arg(env, args[1])
+                                          : 1);
+
+  i32 status =
+      status_of(env, performance_counters_init(spec[0] ? spec : NULL));
+  if (status == STATUS_OK) {
+    // the layout of a result block depends on the events
+    binding_state *state = state_of(env);
+    if (state->results_ref)
+      napi_delete_reference(env, state->results_ref);
+    state->results_ref = NULL;
+    state->results_ptr = NULL;
+  }
+  return int_value(env, status);
+}
+
+/// counterCount(): number
+static napi_value js_counter_count(napi_env env, napi_callback_info info) {
+  return int_value(env, (i32)performance_counters_counter_count());
+}
+
+/// eventCount(): number
+static napi_value js_event_count(napi_env env, napi_callback_info info) {
+  return int_value(env, (i32)performance_counters_event_count());
+}
+
+/// event(i): { name, event, alias, mode, slot, status }
+static napi_value js_event(napi_env env, napi_callback_info info) {
+  napi_value args[1], out;
+  get_args(env, info, args, 1);
+  u32 i = u32_arg(env, args[0]);
+  napi_create_object(env, &out);
+  napi_set_named_property(
+      env, out, "name", string_value(env, performance_counters_event_name(i)));
+  napi_set_named_property(
+      env, out, "event",
+      string_value(env, performance_counters_event_db_name(i)));
+  napi_set_named_property(
+      env, out, "alias",
+      string_value(env, performance_counters_event_alias(i)));
+  napi_set_named_property(
+      env, out, "mode",
+      int_value(env, (i32)performance_counters_event_mode(i)));
+  napi_set_named_property(env, out, "slot",
+                          int_value(env, performance_counters_event_slot(i)));
+  napi_set_named_property(env, out, "status",
+                          int_value(env, performance_counters_event_status(i)));
+  return out;
+}
+
+/// errorDesc(code): string
+static napi_value js_error_desc(napi_env env, napi_callback_info info) {
+  napi_value args[1];
+  get_args(env, info, args, 1);
+  i32 code = 0;
+  napi_get_value_int32(env, args[0], &code);
+  return string_value(env, performance_counters_error_desc(code));
+}
+
+/// setOverhead(values: BigUint64Array | null, inline: boolean): status
+static napi_value js_set_overhead(napi_env env, napi_callback_info info) {
+  napi_value args[2];
+  get_args(env, info, args, 2);
+  bool inline_reads = false;
+  napi_get_value_bool(env, args[1], &inline_reads);
+
+  bool is_array = false;
+  napi_is_typedarray(env, args[0], &is_array);
+  if (!is_array) {
+    performance_counters_set_overhead(NULL, inline_reads);
+    return int_value(env, STATUS_OK);
+  }
+  napi_typedarray_type type;
+  size_t length = 0;
+  void *data = NULL;
+  napi_get_typedarray_info(env, args[0], &type, &length, &data, NULL, NULL);
+  if (type != napi_biguint64_array ||
+      length < performance_counters_counter_count())
+    return fail(env, STATUS_INVALID_ARGUMENT, "Expected a BigUint64Array");
+  performance_counters_set_overhead(data, inline_reads);
+  return int_value(env, STATUS_OK);
+}
+
+/// lastError(): string | null, the message of the last failed call.
+static napi_value js_last_error(napi_env env, napi_callback_info info) {
+  return string_value(env, state_of(env)->last_error);
+}
+
+// -----------------------------------------------------------------------------
+// Results
+// -----------------------------------------------------------------------------
+
+/// resultSlots(): number, the size of a result block in 8 byte slots.
+static napi_value js_result_slots(napi_env env, napi_callback_info info) {
+  return int_value(env, (i32)performance_counters_result_slots());
+}
+
+/// resultHeaderSlots(): number
+static napi_value js_result_header_slots(napi_env env,
+                                         napi_callback_info info) {
+  return int_value(env, (i32)performance_counters_result_header_slots());
+}
+
+/// results(buffer: ArrayBuffer): status, the block stop() writes into.
+static napi_value js_results(napi_env env, napi_callback_info info) {
+  napi_value args[1];
+  get_args(env, info, args, 1);
+  bool is_buffer = false;
+  napi_is_arraybuffer(env, args[0], &is_buffer);
+  if (!is_buffer)
+    return fail(env, STATUS_INVALID_ARGUMENT, "Expected an ArrayBuffer");
+  void *data = NULL;
+  size_t length = 0;
+  napi_get_arraybuffer_info(env, args[0], &data, &length);
+  if (length < (size_t)performance_counters_result_slots() * sizeof(u64))
+    return fail(env, STATUS_INVALID_ARGUMENT, "Result block is too small");
+
+  binding_state *state = state_of(env);
+  if (state->results_ref)
+    napi_delete_reference(env, state->results_ref);
+  napi_create_reference(env, args[0], 1, &state->results_ref);
+  state->results_ptr = data;
+  performance_counters_result_init(data);
+  return int_value(env, STATUS_OK);
+}
+
+// -----------------------------------------------------------------------------
+// Counting
+// -----------------------------------------------------------------------------
+
+/// start(): status
+static napi_value js_start(napi_env env, napi_callback_info info) {
+  return int_value(env, hot_status(env, performance_counters_start()));
+}
+
+/// stop(): status, the counts are in the result block.
+static napi_value js_stop(napi_env env, napi_callback_info info) {
+  void *results = state_of(env)->results_ptr;
+  if (!results)
+    return fail(env, STATUS_NO_RESULTS, "No result block, call results()");
+  return int_value(env,
+                   hot_status(env, performance_counters_stop_result(results)));
+}
+
+/// startInline(): status
+static napi_value js_start_inline(napi_env env, napi_callback_info info) {
+  return int_value(env, hot_status(env, performance_counters_start_inline()));
+}
+
+/// stopInline(): status
+static napi_value js_stop_inline(napi_env env, napi_callback_info info) {
+  void *results = state_of(env)->results_ptr;
+  if (!results)
+    return fail(env, STATUS_NO_RESULTS, "No result block, call results()");
+  return int_value(
+      env, hot_status(env, performance_counters_stop_inline_result(results)));
+}
+
+/// inlineAvailable(): boolean
+static napi_value js_inline_available(napi_env env, napi_callback_info info) {
+  napi_value out;
+  napi_get_boolean(env, performance_counters_inline_available(), &out);
+  return out;
+}
+
+/// open(): status
+static napi_value js_open(napi_env env, napi_callback_info info) {
+  return int_value(env, status_of(env, performance_counters_open()));
+}
+
+/// sample(out: BigUint64Array): status
+static napi_value js_sample(napi_env env, napi_callback_info info) {
+  napi_value args[1];
+  get_args(env, info, args, 1);
+  bool is_array = false;
+  napi_is_typedarray(env, args[0], &is_array);
+  napi_typedarray_type type;
+  size_t length = 0;
+  void *data = NULL;
+  if (is_array)
+    napi_get_typedarray_info(env, args[0], &type, &length, &data, NULL, NULL);
+  if (!is_array || type != napi_biguint64_array ||
+      length < performance_counters_counter_count())
+    return fail(env, STATUS_INVALID_ARGUMENT, "Expected a BigUint64Array");
+  return int_value(env, status_of(env, performance_counters_sample(data)));
+}
+
+/// close(): status
+static napi_value js_close(napi_env env, napi_callback_info info) {
+  return int_value(env, status_of(env, performance_counters_close()));
+}
+
+/// retain(): number of users
+static napi_value js_retain(napi_env env, napi_callback_info info) {
+  return int_value(env, (i32)performance_counters_retain());
+}
+
+/// release(): status
+static napi_value js_release(napi_env env, napi_callback_info info) {
+  return int_value(env, status_of(env, performance_counters_release()));
+}
+
+static napi_value module_init(napi_env env, napi_value exports) {
+  binding_state *state = calloc(1, sizeof(binding_state));
+  if (!state ||
+      napi_set_instance_data(env, state, state_finalize, NULL) != napi_ok) {
+    free(state);
+    napi_throw_error(env, NULL, "Failed to allocate the binding state");
+    return NULL;
+  }
+  const napi_property_descriptor methods[] = {
+      {"init", NULL, js_init, NULL, NULL, NULL, napi_default, NULL},
+      {"counterCount", NULL, js_counter_count, NULL, NULL, NULL, napi_default,
+       NULL},
+      {"eventCount", NULL, js_event_count, NULL, NULL, NULL, napi_default,
+       NULL},
+      {"event", NULL, js_event, NULL, NULL, NULL, napi_default, NULL},
+      {"errorDesc", NULL, js_error_desc, NULL, NULL, NULL, napi_default, NULL},
+      {"setOverhead", NULL, js_set_overhead, NULL, NULL, NULL, napi_default,
+       NULL},
+      {"lastError", NULL, js_last_error, NULL, NULL, NULL, napi_default, NULL},
+      {"resultSlots", NULL, js_result_slots, NULL, NULL, NULL, napi_default,
+       NULL},
+      {"resultHeaderSlots", NULL, js_result_header_slots, NULL, NULL, NULL,
+       napi_default, NULL},
+      {"results", NULL, js_results, NULL, NULL, NULL, napi_default, NULL},
+      {"start", NULL, js_start, NULL, NULL, NULL, napi_default, NULL},
+      {"stop", NULL, js_stop, NULL, NULL, NULL, napi_default, NULL},
+      {"startInline", NULL, js_start_inline, NULL, NULL, NULL, napi_default,
+       NULL},
+      {"stopInline", NULL, js_stop_inline, NULL, NULL, NULL, napi_default,
+       NULL},
+      {"inlineAvailable", NULL, js_inline_available, NULL, NULL, NULL,
+       napi_default, NULL},
+      {"open", NULL, js_open, NULL, NULL, NULL, napi_default, NULL},
+      {"sample", NULL, js_sample, NULL, NULL, NULL, napi_default, NULL},
+      {"close", NULL, js_close, NULL, NULL, NULL, napi_default, NULL},
+      {"retain", NULL, js_retain, NULL, NULL, NULL, napi_default, NULL},
+      {"release", NULL, js_release, NULL, NULL, NULL, napi_default, NULL},
+  };
+  napi_define_properties(env, exports, sizeof(methods) / sizeof(methods[0]),
+                         methods);
+  return exports;
+}
+
+NAPI_MODULE(NODE_GYP_MODULE_NAME, module_init)
@@ -0,0 +1,14 @@
+{
+  "targets": [
+    {
+      "target_name": "counters",
+      "sources": ["binding.c"],
+      "conditions": [
+        ["OS=='mac'", {"sources": ["counters.c"]}],
+        ["OS=='linux'", {"sources": ["counters.linux.c"], "libraries": ["-lm"]}]
+      ],
+      "cflags": ["-O3", "-std=gnu11"],
+      "xcode_settings": {"OTHER_CFLAGS": ["-O3", "-std=gnu11"]}
+    }
+  ]
+}
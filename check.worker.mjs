@@ -0,0 +1,67 @@
+// Node worker_threads check for the binding: every worker loads its own
+// instance of the addon, and its result block and last error must stay its
+// own while the others measure. Build the binding first, then
+//
+//   node check.worker.mjs [event ...]
+//
+// with events that this machine can count, the defaults otherwise.
+
+import { Worker, isMainThread, parentPort, workerData } from "worker_threads";
+import { close, count, init, lastError, run } from "./node.mjs";
+
+const WORKERS = 4;
+const RUNS = 10000;
+
+function func() {
+  var j = 0;
+  for (let i = 0; i < 9999; i++) {
+    j = i + 1;
+  }
+  return j;
+}
+
+function measure(events) {
+  const { events: configured } = init(events);
+  const { name } = configured.find((event) => event.scheduled);
+  let zero = 0;
+  for (let i = 0; i < RUNS; i++) {
+    run(func);
+    // another env's stop() must not have written into this block
+    if (!count.raw.get(name)) zero++;
+  }
+  return { zero, error: lastError() };
+}
+
+if (isMainThread) {
+  const events = process.argv.slice(2);
+  const failures = [];
+  const workers = Array.from({ length: WORKERS }, (_, id) => {
+    const worker = new Worker(new URL(import.meta.url), {
+      workerData: { id, events: events.length ? events : undefined },
+    });
+    return new Promise((resolve, reject) => {
+      worker.once("message", (result) => {
+        if (result.zero) failures.push(`worker ${id}: ${result.zero} empty runs`);
+        if (result.error) failures.push(`worker ${id}: ${result.error}`);
+        resolve();
+      });
+      worker.once("error", reject);
+    });
+  });
+  // the main env measures too, and keeps measuring after the workers exit
+  const main = measure(events.length ? events : undefined);
+  await Promise.all(workers);
+  const after = measure(undefined);
+  if (main.zero || after.zero) failures.push("main: empty runs");
+  close();
+
+  if (failures.length) {
+    console.error(failures.join("\n"));
+    process.exit(1);
+  }
+  console.log(`${WORKERS} workers and the main thread measured on their own`);
+} else {
+  const result = measure(workerData.events);
+  close();
+  parentPort.postMessage(result);
+}
@@ -14,8 +14,8 @@
 //
 //
 // Demo 2 (profile a select process):
-// Replace step 3 with: set `target_pid` and `total_profile_time`.
-// Use main2() as the entry function.
+// Replace step 3 with: call performance_counters_profile_process() with the
+// target pid and the profile time.
 //
 //
 // References:
@@ -47,15 +47,26 @@
 // Released into the public domain (unlicense.org).
 // =============================================================================
 
+#include <errno.h>
+#include <math.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 
 #include <dlfcn.h>          // for dlopen() and dlsym()
+#include <fcntl.h>          // for open()
+#include <libproc.h>        // for proc_pid_rusage(), proc_pidinfo()
+#include <setjmp.h>         // for sigsetjmp()
+#include <signal.h>         // for sigaction()
 #include <mach/mach_time.h> // for mach_absolute_time()
+#include <pthread.h>        // for pthread_threadid_np(), QoS classes
 #include <sys/kdebug.h>     // for kdebug trace decode
+#include <sys/stat.h>       // for fstat()
 #include <sys/sysctl.h>     // for sysctl()
 #include <unistd.h>         // for usleep()
 
@@ -234,6 +245,37 @@ static int (*kpc_force_all_ctrs_set)(int val);
 /// @details sysctl get(kpc.force_all_ctrs)
 static int (*kpc_force_all_ctrs_get)(int *val_out);
 
+/// Get the sampling periods of the counters.
+/// @param classes See `class mask constants` above.
+/// @param period Buffer to receive one period per counter, fixed counters
+///               first, should not smaller than kpc_get_counter_count().
+/// @return 0 for success.
+/// @details sysctl get(kpc.period)
+static int (*kpc_get_period)(u32 classes, u64 *period);
+
+/// Set the sampling periods of the counters. A counter with a period fires
+/// a PMI every `period` events, which runs the kperf action set with
+/// kpc_set_actionid(). 0 disables the interrupt of that counter.
+/// @param classes See `class mask constants` above.
+/// @param period One period per counter, fixed counters first.
+/// @return 0 for success.
+/// @details sysctl set(kpc.period)
+static int (*kpc_set_period)(u32 classes, u64 *period);
+
+/// Get the kperf action ids run by the PMI of the counters.
+/// @param classes See `class mask constants` above.
+/// @param actionid Buffer to receive one action id per counter.
+/// @return 0 for success.
+/// @details sysctl get(kpc.actionid)
+static int (*kpc_get_actionid)(u32 classes, u32 *actionid);
+
+/// Set the kperf action ids run by the PMI of the counters.
+/// @param classes See `class mask constants` above.
+/// @param actionid One action id per counter, 0 for none.
+/// @return 0 for success.
+/// @details sysctl set(kpc.actionid)
+static int (*kpc_set_actionid)(u32 classes, u32 *actionid);
+
 /// Set number of actions, should be `KPERF_ACTION_MAX`.
 /// @details sysctl set(kperf.action.count)
 static int (*kperf_action_count_set)(u32 count);
@@ -589,6 +631,10 @@ static const lib_symbol lib_symbols_kperf[] = {
     lib_symbol_def(kpc_get_thread_counters),
     lib_symbol_def(kpc_force_all_ctrs_set),
     lib_symbol_def(kpc_force_all_ctrs_get),
+    lib_symbol_def(kpc_get_period),
+    lib_symbol_def(kpc_set_period),
+    lib_symbol_def(kpc_get_actionid),
+    lib_symbol_def(kpc_set_actionid),
     lib_symbol_def(kperf_action_count_set),
     lib_symbol_def(kperf_action_count_get),
     lib_symbol_def(kperf_action_samplers_set),
@@ -667,7 +713,6 @@ static void lib_deinit(void) {
   }
 }
 
-static bool lib_init(void) {
 #define return_err()                                                           \
   do {                                                                         \
     lib_deinit();                                                              \
@@ -676,6 +721,9 @@ static bool lib_init(void) {
     return false;                                                              \
   } while (false)
 
+/// Load kperf. kperfdata is only needed to resolve events, which a cached
+/// config skips, so it is loaded separately by lib_init_data().
+static bool lib_init(void) {
   if (lib_inited)
     return !lib_has_err;
 
@@ -686,12 +734,6 @@ static bool lib_init(void) {
              "Failed to load kperf.framework, message: %s.", dlerror());
     return_err();
   }
-  lib_handle_kperfdata = dlopen(lib_path_kperfdata, RTLD_LAZY);
-  if (!lib_handle_kperfdata) {
-    snprintf(lib_err_msg, sizeof(lib_err_msg),
-             "Failed to load kperfdata.framework, message: %s.", dlerror());
-    return_err();
-  }
 
   // load symbol address from dynamic library
   for (usize i = 0; i < lib_nelems(lib_symbols_kperf); i++) {
@@ -703,6 +745,25 @@ static bool lib_init(void) {
       return_err();
     }
   }
+
+  lib_inited = true;
+  lib_has_err = false;
+  return true;
+}
+
+/// Load kperfdata, and kperf if it isn't loaded yet.
+static bool lib_init_data(void) {
+  if (!lib_init())
+    return false;
+  if (lib_handle_kperfdata)
+    return true;
+
+  lib_handle_kperfdata = dlopen(lib_path_kperfdata, RTLD_LAZY);
+  if (!lib_handle_kperfdata) {
+    snprintf(lib_err_msg, sizeof(lib_err_msg),
+             "Failed to load kperfdata.framework, message: %s.", dlerror());
+    return_err();
+  }
   for (usize i = 0; i < lib_nelems(lib_symbols_kperfdata); i++) {
     const lib_symbol *symbol = &lib_symbols_kperfdata[i];
     *symbol->impl = dlsym(lib_handle_kperfdata, symbol->name);
@@ -712,13 +773,10 @@ static bool lib_init(void) {
       return_err();
     }
   }
-
-  lib_inited = true;
-  lib_has_err = false;
   return true;
+}
 
 #undef return_err
-}
 
 // -----------------------------------------------------------------------------
 // kdebug private structs
@@ -764,6 +822,9 @@ typedef struct {
 /* only trace at most 4 types of events, at the code granularity */
 #define KDBG_VALCHECK 0x00200000U
 
+/* bits for kd_ctrl_page.flags */
+#define KDBG_WRAPPED 0x008 /* the trace buffer wrapped, records were lost */
+
 typedef struct {
   unsigned int type;
   unsigned int value1;
@@ -938,554 +999,3636 @@ static void profile_func(void) {
 
 // prepare buffer and config
 u32 classes = 0;
-usize reg_count = 0;
-kpc_config_t regs[KPC_MAX_COUNTERS] = {0};
 usize counter_map[KPC_MAX_COUNTERS] = {0};
-u64 counters_0[KPC_MAX_COUNTERS] = {0};
-u64 counters_1[KPC_MAX_COUNTERS] = {0};
-kpep_config *cfg;
+// start() and stop() baselines are per thread, so workers measuring at the
+// same time don't overwrite each other's
+_Thread_local u64 counters_0[KPC_MAX_COUNTERS] = {0};
+_Thread_local u64 counters_1[KPC_MAX_COUNTERS] = {0};
 kpep_db *db;
 
-const usize ev_count = sizeof(profile_events) / sizeof(profile_events[0]);
+/// Most counter groups init() splits the events into.
+#define COUNTER_GROUP_MAX 8
 
-kpep_event *ev_arr[ev_count] = {0};
+/// Events that can be counted together. When more events are requested
+/// than there are counters, init() splits them into groups and
+/// performance_counters_start() programs the next group each time.
+typedef struct {
+  kpep_config *cfg;
+  u32 classes;
+  usize reg_count;
+  kpc_config_t regs[KPC_MAX_COUNTERS];
+  usize event_count; ///< Events added to `cfg`.
+} counter_group;
+
+static counter_group groups[COUNTER_GROUP_MAX];
+static u32 group_count = 0;
+static u32 max_groups = 1;
+
+/// Group that is programmed in the kernel.
+static u32 active_group = 0;
+
+/// Group of each values buffer slot, -1 for the events on fixed counters,
+/// which every group counts.
+static i32 slot_group[KPC_MAX_COUNTERS];
 
-const char *performance_counters_init();
-const char *performance_counters_init() {
+/// Privilege levels an event counts in, from a ":u" or ":k" name suffix.
+typedef enum {
+  EVENT_MODE_ALL = 0,
+  EVENT_MODE_USER = 1,
+  EVENT_MODE_KERNEL = 2,
+} event_mode;
+
+/// One event passed to performance_counters_init().
+typedef struct {
+  const char *name;   ///< Requested name, points into `ev_spec`.
+  const char *base;   ///< `name` without its mode suffix.
+  u32 mode;           ///< event_mode.
+  const char *alias;  ///< Matching `profile_events` alias, or NULL.
+  kpep_event *ev;     ///< Resolved event, or NULL if not found.
+  int status;         ///< kpep_config_error_code from resolving/adding it.
+  i32 slot;           ///< Index in the values buffer, -1 if not counted.
+} requested_event;
+
+/// Events counted when init() is given no event list.
+static const char *default_events = "cycles,instructions,branches,branch-misses";
+
+/// Copy of the event list passed to init(), split in place.
+static char ev_spec[1024];
+/// The names of `ev_spec` at the same offsets, without their mode suffix.
+static char ev_base[sizeof(ev_spec)];
+
+/// The event list of the last successful init(), unsplit.
+static char init_spec[sizeof(ev_spec)];
+static u32 init_max_groups = 0;
+
+/// Events passed to init(), in order.
+static requested_event ev_req[KPC_MAX_COUNTERS];
+static usize ev_req_count = 0;
+
+/// Events that were added to `groups`, in values buffer order.
+kpep_event *ev_arr[KPC_MAX_COUNTERS] = {0};
+usize ev_count = 0;
+
+/// event_mode of each values buffer slot.
+static u32 slot_mode[KPC_MAX_COUNTERS];
+
+/// What an empty start/stop pair counts, per event, set by calibration.
+static u64 overhead[KPC_MAX_COUNTERS] = {0};
+static u64 inline_overhead[KPC_MAX_COUNTERS] = {0};
+
+/// Counting has been enabled by performance_counters_open().
+static bool counting = false;
+
+/// Serializes init(), open(), close() and set_overhead(), which rewrite the
+/// configuration that the other threads count with.
+static pthread_mutex_t config_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/// Number of contexts that called performance_counters_retain().
+static atomic_uint session_users = 0;
+
+/// performance_counters_sample_cpus() has a previous sample to diff against.
+static bool cpu_has_prev = false;
+
+/// The forced counters and the active group have been written to the kernel.
+static bool programmed = false;
+
+/// All events in `db`, loaded by db_load().
+static kpep_event **db_event_arr = NULL;
+static usize db_event_count = 0;
+
+/// Load kperfdata and the pmc db for the current CPU, once.
+/// This does not require root privileges.
+/// @return NULL on success, error message otherwise.
+static const char *db_load(void) {
   int ret = 0;
+  if (db)
+    return 0;
+
   // load dylib
-  if (!lib_init()) {
+  if (!lib_init_data()) {
     return lib_err_msg;
   }
 
-  // check permission
-  int force_ctrs = 0;
-  if (kpc_force_all_ctrs_get(&force_ctrs)) {
-    return "Permission denied, xnu/kpc requires root privileges.\n";
-  }
-
-  // load pmc db
-  db = NULL;
-  if ((ret = kpep_db_create(NULL, &db))) {
+  // load pmc db, `db` is only set once everything below succeeded, so a
+  // failed load is retried from scratch instead of leaving half of it
+  kpep_db *loaded = NULL;
+  if ((ret = kpep_db_create(NULL, &loaded))) {
     return "Error: cannot load pmc database";
   }
-    // printf("loaded db: %s (%s)\n", db->name, db->marketing_name);
-    // printf("number of fixed counters: %zu\n", db->fixed_counter_count);
-    // printf("number of configurable counters: %zu\n",
-    // db->config_counter_count);
 
-  // create a config
-  cfg = NULL;
-  if ((ret = kpep_config_create(db, &cfg))) {
-    return kpep_config_error_desc(ret);
+  usize count = 0;
+  if ((ret = kpep_db_events_count(loaded, &count)) || !count) {
+    kpep_db_free(loaded);
+    return "Error: pmc database has no events";
   }
-  if ((ret = kpep_config_force_counters(cfg))) {
+  kpep_event **events = malloc(count * sizeof(kpep_event *));
+  if (!events) {
+    kpep_db_free(loaded);
+    return "Error: out of memory";
+  }
+  if ((ret = kpep_db_events(loaded, events, count * sizeof(kpep_event *)))) {
+    free(events);
+    kpep_db_free(loaded);
     return kpep_config_error_desc(ret);
   }
+  db = loaded;
+  db_event_arr = events;
+  db_event_count = count;
+  return 0;
+}
 
-  // get events
+/// Find an event by `profile_events` alias (e.g. "cycles"),
+/// by name in the pmc db (e.g. "L1D_CACHE_MISS_LD"),
+/// or by alias in the pmc db (e.g. "Instructions").
+static kpep_event *find_event(kpep_db *db, const char *name,
+                              const char **alias_out) {
+  *alias_out = NULL;
+  for (usize i = 0; i < lib_nelems(profile_events); i++) {
+    const event_alias *alias = profile_events + i;
+    if (strcasecmp(alias->alias, name) == 0) {
+      *alias_out = alias->alias;
+      return get_event(db, alias);
+    }
+  }
 
-  for (usize i = 0; i < ev_count; i++) {
+  kpep_event *ev = NULL;
+  if (kpep_db_event(db, name, &ev) != 0) {
+    ev = NULL;
+    for (usize i = 0; i < db_event_count && !ev; i++) {
+      const char *ev_alias = NULL;
+      if (kpep_event_alias(db_event_arr[i], &ev_alias) == 0 && ev_alias &&
+          strcasecmp(ev_alias, name) == 0)
+        ev = db_event_arr[i];
+    }
+    if (!ev)
+      return NULL;
+  }
+
+  // "FIXED_CYCLES" still fills `count.cycles`
+  for (usize i = 0; i < lib_nelems(profile_events); i++) {
     const event_alias *alias = profile_events + i;
-    ev_arr[i] = get_event(db, alias);
-    if (!ev_arr[i]) {
-      return alias->alias;
+    if (get_event(db, alias) == ev) {
+      *alias_out = alias->alias;
+      break;
     }
   }
+  return ev;
+}
 
-  // add event to config
-  for (usize i = 0; i < ev_count; i++) {
-    kpep_event *ev = ev_arr[i];
-    if ((ret = kpep_config_add_event(cfg, &ev, 0, NULL))) {
-      return kpep_config_error_desc(ret);
+/// Split a comma separated event list into `ev_req`.
+/// @return NULL on success, error message otherwise.
+static const char *parse_events(const char *events) {
+  if (!events || !*events)
+    events = default_events;
+  if (strlen(events) >= sizeof(ev_spec))
+    return "Event list is too long";
+  strcpy(ev_spec, events);
+
+  ev_req_count = 0;
+  char *cur = ev_spec;
+  while (cur) {
+    char *next = strchr(cur, ',');
+    if (next)
+      *next++ = '\0';
+    while (*cur == ' ')
+      cur++;
+    for (char *end = cur + strlen(cur); end > cur && end[-1] == ' ';)
+      *--end = '\0';
+    if (*cur) {
+      if (ev_req_count == KPC_MAX_COUNTERS)
+        return "Too many events";
+      requested_event *req = ev_req + ev_req_count++;
+      memset(req, 0, sizeof(requested_event));
+      req->name = cur;
+      req->slot = -1;
+
+      // "cycles:u" counts only in user space, "cycles:k" only in the kernel
+      char *base = ev_base + (cur - ev_spec);
+      strcpy(base, cur);
+      char *suffix = strrchr(base, ':');
+      if (suffix && strcasecmp(suffix, ":u") == 0) {
+        req->mode = EVENT_MODE_USER;
+        *suffix = '\0';
+      } else if (suffix && strcasecmp(suffix, ":k") == 0) {
+        req->mode = EVENT_MODE_KERNEL;
+        *suffix = '\0';
+      }
+      req->base = base;
     }
+    cur = next;
   }
+  if (!ev_req_count)
+    return "No events";
+  return 0;
+}
 
-  if ((ret = kpep_config_kpc_classes(cfg, &classes))) {
-    return kpep_config_error_desc(ret);
-    // printf("Failed get kpc classes: %d (%s).\n", ret,
-    //        kpep_config_error_desc(ret));
-    // return 1;
+/// The config word bits that enable counting in user space and in the
+/// kernel, for the configurable counters of `arch`.
+/// @return false if the counters can't be restricted on this CPU.
+static bool mode_bits(u32 arch, kpc_config_t *user, kpc_config_t *kernel) {
+  switch (arch) {
+  case KPEP_ARCH_ARM64:
+    // CFGWORD_EL0A32EN | CFGWORD_EL0A64EN, CFGWORD_EL1EN
+    *user = 0x30000;
+    *kernel = 0x40000;
+    return true;
+  case KPEP_ARCH_X86_64:
+  case KPEP_ARCH_I386:
+    // IA32_PERFEVTSELx USR, OS
+    *user = 1 << 16;
+    *kernel = 1 << 17;
+    return true;
   }
-  if ((ret = kpep_config_kpc_count(cfg, &reg_count))) {
-    return kpep_config_error_desc(ret);
+  return false;
+}
+
+/// Find the event to count `req` with. An event restricted to user space or
+/// the kernel can't be on a fixed counter, those count in every mode, so
+/// its configurable fallback is used instead.
+static kpep_event *resolve_event(requested_event *req) {
+  kpep_event *ev = find_event(db, req->base, &req->alias);
+  if (!ev || req->mode == EVENT_MODE_ALL)
+    return ev;
+
+  // "cycles:u" is not what `count.cycles` reads
+  req->alias = NULL;
+  kpc_config_t user, kernel;
+  if (!mode_bits(db->archtecture, &user, &kernel)) {
+    req->status = KPEP_CONFIG_ERROR_EVENT_UNAVAILABLE;
+    return NULL;
   }
-  if ((ret = kpep_config_kpc_map(cfg, counter_map, sizeof(counter_map)))) {
-    return kpep_config_error_desc(ret);
-    // return 1;
+  if (ev->is_fixed) {
+    kpep_event *fallback = NULL;
+    if (!ev->fallback || kpep_db_event(db, ev->fallback, &fallback) != 0) {
+      req->status = KPEP_CONFIG_ERROR_EVENT_UNAVAILABLE;
+      return NULL;
+    }
+    ev = fallback;
+  }
+  return ev;
+}
+
+/// Whether the value in `slot` is counted while `group` is programmed.
+static inline bool slot_in_group(usize slot, u32 group) {
+  return slot_group[slot] < 0 || (u32)slot_group[slot] == group;
+}
+
+/// Whether the value in `slot` is counted while the active group is
+/// programmed.
+static inline bool slot_counted(usize slot) {
+  return slot_in_group(slot, active_group);
+}
+
+static void groups_free(void) {
+  for (u32 g = 0; g < group_count; g++) {
+    // groups restored from the config cache have no kpep config
+    if (groups[g].cfg)
+      kpep_config_free(groups[g].cfg);
+    groups[g].cfg = NULL;
   }
-  if ((ret = kpep_config_kpc(cfg, regs, sizeof(regs)))) {
-    return "Failed get kpc registers";
-    // printf(": %d (%s).\n", ret,
-    //        kpep_config_error_desc(ret));
-    // return 1;
+  group_count = 0;
+  active_group = 0;
+}
+
+/// Write the registers of group `g` to the kernel.
+/// @return NULL on success, error message otherwise.
+static const char *group_program(u32 g) {
+  counter_group *grp = groups + g;
+  if ((grp->classes & KPC_CLASS_CONFIGURABLE_MASK) && grp->reg_count) {
+    if (kpc_set_config(grp->classes, grp->regs)) {
+      return "Failed set kpc config";
+    }
   }
+  active_group = g;
+  return 0;
+}
+
+/// Why multiplexed events can't be counted while several contexts are.
+static const char *multiplex_shared_err =
+    "Multiplexed events can only be counted by one thread";
+
+/// Program the next group when the events are multiplexed.
+/// The thread counters restart from the new configuration, so this must
+/// happen before a baseline is taken.
+/// The configuration belongs to the whole process: rotating under another
+/// thread would switch the events it is counting, so this fails when more
+/// than one context retains the counters.
+static inline const char *group_rotate(void) {
+  if (group_count < 2)
+    return 0;
+  if (atomic_load(&session_users) > 1)
+    return multiplex_shared_err;
+  return group_program((active_group + 1) % group_count);
+}
+
+/// Acquire all counters and write the active group to the kernel.
+/// @return NULL on success, error message otherwise.
+static const char *program_counters(void) {
+  int ret = 0;
+  if (programmed)
+    return 0;
 
   // set config to kernel
   if ((ret = kpc_force_all_ctrs_set(1))) {
     return "Failed force all ctrs";
   }
-  if ((classes & KPC_CLASS_CONFIGURABLE_MASK) && reg_count) {
-    if ((ret = kpc_set_config(classes, regs))) {
-      return "Failed set kpc config";
-    }
-  }
+  const char *err = group_program(active_group);
+  if (err)
+    return err;
 
+  programmed = true;
   return 0;
 }
 
-const char *performance_counters_start();
-const char *performance_counters_start() {
+/// Create an empty group at `groups[group_count]`.
+static int group_create(void) {
+  counter_group *grp = groups + group_count;
   int ret = 0;
-  // start counting
-  if ((ret = kpc_set_counting(classes))) {
-    return "Failed set counting";
+  memset(grp, 0, sizeof(counter_group));
+  if ((ret = kpep_config_create(db, &grp->cfg))) {
+    grp->cfg = NULL;
+    return ret;
   }
-  if ((ret = kpc_set_thread_counting(classes))) {
-    return "Failed set thread counting";
+  if ((ret = kpep_config_force_counters(grp->cfg))) {
+    kpep_config_free(grp->cfg);
+    grp->cfg = NULL;
+    return ret;
   }
+  group_count++;
+  return 0;
+}
 
-  // get counters before
-  if ((ret = kpc_get_thread_counters(0, KPC_MAX_COUNTERS, counters_0))) {
-    return "Failed get thread counters before";
+/// Add `req` to the first group it fits in, creating one if allowed.
+/// @return 0 on success, kpep_config_error_code otherwise.
+static int group_add_event(requested_event *req, u32 *group, usize *index) {
+  int ret = KPEP_CONFIG_ERROR_NONE;
+  for (u32 g = 0; g < group_count; g++) {
+    kpep_event *ev = req->ev;
+    if ((ret = kpep_config_add_event(groups[g].cfg, &ev, 0, NULL)) == 0) {
+      *group = g;
+      *index = groups[g].event_count++;
+      return 0;
+    }
   }
+  if (group_count == max_groups)
+    return ret;
 
+  int err = group_create();
+  if (err)
+    return err;
+  u32 g = group_count - 1;
+  kpep_event *ev = req->ev;
+  if ((err = kpep_config_add_event(groups[g].cfg, &ev, 0, NULL))) {
+    // doesn't fit even on its own
+    kpep_config_free(groups[g].cfg);
+    groups[g].cfg = NULL;
+    group_count--;
+    return err;
+  }
+  *group = g;
+  *index = groups[g].event_count++;
   return 0;
 }
 
-const char *performance_counters_stop(u64 *values);
-const char *performance_counters_stop(u64 *values) {
+/// Set how many groups init() may split the events into, 1 to skip the
+/// events that don't fit with the others. Takes effect on the next init().
+void performance_counters_set_max_groups(u32 count);
+void performance_counters_set_max_groups(u32 count) {
+  max_groups = count < 1 ? 1 : count > COUNTER_GROUP_MAX ? COUNTER_GROUP_MAX
+                                                         : count;
+}
+
+/// Number of groups the events were split into.
+u32 performance_counters_group_count();
+u32 performance_counters_group_count() { return group_count; }
+
+/// Group programmed for the last start().
+u32 performance_counters_active_group();
+u32 performance_counters_active_group() { return active_group; }
+
+/// Group counting the value in `slot`, -1 if every group counts it.
+i32 performance_counters_slot_group(u32 slot);
+i32 performance_counters_slot_group(u32 slot) {
+  return slot < ev_count ? slot_group[slot] : -1;
+}
+
+/// Program the next group now, for callers that sample with open() instead
+/// of start()/stop(). Samples taken before and after are not comparable.
+const char *performance_counters_rotate();
+const char *performance_counters_rotate() {
+  if (!programmed)
+    return "Counters are not programmed";
+  return group_rotate();
+}
+
+// -----------------------------------------------------------------------------
+// Config cache
+// Resolving events loads kperfdata and parses the pmc db plist, which is
+// most of the time init() takes. What it ends up with, the registers and
+// counter maps of each group, only depends on the CPU, the OS build and the
+// event list, so it is saved to a file. A later process with the same key
+// programs the kernel from the file and never loads kperfdata.
+// -----------------------------------------------------------------------------
+
+#define CONFIG_CACHE_MAGIC "KPCCACHE"
+#define CONFIG_CACHE_VERSION 1
+
+#if defined(__arm64__)
+#define CONFIG_CACHE_ARCH "arm64"
+#else
+#define CONFIG_CACHE_ARCH "x86_64"
+#endif
+
+/// What init() resolved one requested event to.
+typedef struct {
+  char name[128]; ///< Name in the pmc db.
+  u8 number;
+  u8 umask;
+  u8 is_fixed;
+  u8 found; ///< Whether the event was found, the other fields are 0 if not.
+  i32 slot;
+  i32 status;
+  i32 alias; ///< Index in `profile_events`, -1 for none.
+} cached_event;
+
+typedef struct {
+  u32 classes;
+  u32 reg_count;
+  kpc_config_t regs[KPC_MAX_COUNTERS];
+} cached_group;
+
+/// A cache file, in the native layout; the key includes the architecture.
+typedef struct {
+  char magic[8];
+  u32 version;
+  u32 size; ///< sizeof(config_cache).
+  /// Architecture, CPU string, OS build, PMU version, max groups and events.
+  char key[sizeof(ev_spec) + 256];
+  u32 classes;
+  u32 group_count;
+  u32 ev_count;
+  u32 ev_req_count;
+  cached_group groups[COUNTER_GROUP_MAX];
+  u64 counter_map[KPC_MAX_COUNTERS];
+  i32 slot_group[KPC_MAX_COUNTERS];
+  cached_event events[KPC_MAX_COUNTERS]; ///< In `ev_req` order.
+} config_cache;
+
+/// The file of the last load or store. The stand-in events point into it.
+static config_cache cache;
+
+/// kpep_event stand-ins for the events of a cached config, `ev_arr` and
+/// `ev_req` point at them until the next init().
+static kpep_event cached_ev[KPC_MAX_COUNTERS];
+
+/// Directory of the cache files, empty to disable the cache.
+static char cache_dir[1024];
+static bool cache_dir_set = false;
+
+/// The last init() was programmed from the cache.
+static bool config_cached = false;
+
+/// Set the directory of the config cache. NULL restores the default,
+/// $HW_PERF_COUNTERS_CACHE, else a directory of the user's own in $TMPDIR
+/// or /tmp, see cache_default_dir(). An empty string disables the cache.
+void performance_counters_set_cache_dir(const char *dir);
+void performance_counters_set_cache_dir(const char *dir) {
+  cache_dir_set = dir != NULL;
+  snprintf(cache_dir, sizeof(cache_dir), "%s", dir ? dir : "");
+}
+
+/// Whether the last init() read its config from the cache, so kperfdata and
+/// the pmc db were not loaded.
+u32 performance_counters_config_cached();
+u32 performance_counters_config_cached() { return config_cached; }
+
+/// Everything a config depends on.
+/// @return false if the key doesn't fit or can't be determined.
+static bool cache_key(char *key, usize size, const char *spec) {
+  char cpu[128] = {0};
+  char os[64] = {0};
+  usize os_size = sizeof(os) - 1;
+  if (kpc_cpu_string(cpu, sizeof(cpu)) < 0 ||
+      sysctlbyname("kern.osversion", os, &os_size, NULL, 0))
+    return false;
+  int n = snprintf(key, size, "%s %s %s %u %u %s", CONFIG_CACHE_ARCH, cpu, os,
+                   kpc_pmu_version(), max_groups, spec);
+  return n > 0 && (usize)n < size;
+}
+
+/// `hw-perf-counters-<euid>` in $TMPDIR or /tmp, created if needed. /tmp is
+/// writable by everyone, so the directory is only used if it belongs to the
+/// user and nobody else can access it.
+/// @return false if it can't be created or is not private.
+static bool cache_default_dir(char *dir, usize size) {
+  const char *tmp = getenv("TMPDIR");
+  if (!tmp || !*tmp)
+    tmp = "/tmp";
+  usize len = strlen(tmp);
+  int n = snprintf(dir, size, "%s%shw-perf-counters-%u", tmp,
+                   tmp[len - 1] == '/' ? "" : "/", (u32)geteuid());
+  if (n <= 0 || (usize)n >= size)
+    return false;
+  if (mkdir(dir, 0700) && errno != EEXIST)
+    return false;
+  // another user may have created it first
+  struct stat st;
+  return lstat(dir, &st) == 0 && S_ISDIR(st.st_mode) &&
+         st.st_uid == geteuid() && !(st.st_mode & (S_IRWXG | S_IRWXO));
+}
+
+/// Path of the cache file for `key`, named by its FNV-1a hash and the user.
+/// @return false if the cache is disabled or the path doesn't fit.
+static bool cache_path(char *path, usize size, const char *key) {
+  char private_dir[sizeof(cache_dir)];
+  const char *dir = cache_dir;
+  if (!cache_dir_set && !(dir = getenv("HW_PERF_COUNTERS_CACHE"))) {
+    if (!cache_default_dir(private_dir, sizeof(private_dir)))
+      return false;
+    dir = private_dir;
+  }
+  if (!*dir)
+    return false;
+
+  u64 hash = 0xcbf29ce484222325ull;
+  for (const char *c = key; *c; c++)
+    hash = (hash ^ (u8)*c) * 0x100000001b3ull;
+  usize len = strlen(dir);
+  int n = snprintf(path, size, "%s%shw-perf-counters-%u-%016llx.cache", dir,
+                   len && dir[len - 1] == '/' ? "" : "/", (u32)geteuid(),
+                   (unsigned long long)hash);
+  return n > 0 && (usize)n < size;
+}
+
+/// Whether the `cache` that was read is complete and consistent with the
+/// events parse_events() split, so it can't index out of bounds.
+static bool cache_valid(const char *key) {
+  if (memcmp(cache.magic, CONFIG_CACHE_MAGIC, 8) ||
+      cache.version != CONFIG_CACHE_VERSION ||
+      cache.size != sizeof(config_cache) ||
+      strncmp(cache.key, key, sizeof(cache.key)) ||
+      cache.ev_req_count != ev_req_count || !cache.group_count ||
+      cache.group_count > COUNTER_GROUP_MAX || !cache.ev_count ||
+      cache.ev_count > ev_req_count)
+    return false;
+  for (u32 g = 0; g < cache.group_count; g++) {
+    if (cache.groups[g].reg_count > KPC_MAX_COUNTERS)
+      return false;
+  }
+  for (u32 i = 0; i < cache.ev_count; i++) {
+    if (cache.counter_map[i] >= KPC_MAX_COUNTERS ||
+        cache.slot_group[i] >= (i32)cache.group_count)
+      return false;
+  }
+  // every slot belongs to exactly one event
+  u64 slots = 0;
+  for (usize i = 0; i < ev_req_count; i++) {
+    cached_event *ce = cache.events + i;
+    if (ce->slot >= (i32)cache.ev_count || (ce->slot >= 0 && !ce->found) ||
+        ce->alias >= (i32)lib_nelems(profile_events) ||
+        !memchr(ce->name, 0, sizeof(ce->name)))
+      return false;
+    if (ce->slot >= 0) {
+      if (slots >> ce->slot & 1)
+        return false;
+      slots |= 1ull << ce->slot;
+    }
+  }
+  return slots == (1ull << cache.ev_count) - 1;
+}
+
+/// Restore the config of `spec` from its cache file, if there is one.
+/// The file must belong to the user and not be writable by anyone else,
+/// since its registers are written to the kernel as they are.
+/// @return Whether the config was restored.
+static bool config_cache_load(const char *spec) {
+  char key[sizeof(cache.key)];
+  char path[sizeof(cache_dir) + 64];
+  if (!cache_key(key, sizeof(key), spec) ||
+      !cache_path(path, sizeof(path), key))
+    return false;
+  int fd = open(path, O_RDONLY | O_NOFOLLOW);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  bool ok = fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+            st.st_uid == geteuid() && !(st.st_mode & (S_IWGRP | S_IWOTH)) &&
+            st.st_size == sizeof(config_cache) &&
+            read(fd, &cache, sizeof(cache)) == sizeof(cache);
+  close(fd);
+  if (!ok || !cache_valid(key))
+    return false;
+
+  classes = cache.classes;
+  group_count = cache.group_count;
+  for (u32 g = 0; g < group_count; g++) {
+    counter_group *grp = groups + g;
+    memset(grp, 0, sizeof(counter_group));
+    grp->classes = cache.groups[g].classes;
+    grp->reg_count = cache.groups[g].reg_count;
+    memcpy(grp->regs, cache.groups[g].regs, sizeof(grp->regs));
+  }
+  ev_count = cache.ev_count;
+  for (usize i = 0; i < ev_count; i++) {
+    counter_map[i] = (usize)cache.counter_map[i];
+    slot_group[i] = cache.slot_group[i];
+  }
+  for (usize i = 0; i < ev_req_count; i++) {
+    cached_event *ce = cache.events + i;
+    requested_event *req = ev_req + i;
+    cached_ev[i] = (kpep_event){
+        .name = ce->name,
+        .number = ce->number,
+        .umask = ce->umask,
+        .is_fixed = ce->is_fixed,
+    };
+    req->ev = ce->found ? cached_ev + i : NULL;
+    req->alias = ce->alias >= 0 ? profile_events[ce->alias].alias : NULL;
+    req->status = ce->status;
+    req->slot = ce->slot;
+    if (req->slot >= 0) {
+      ev_arr[req->slot] = req->ev;
+      slot_mode[req->slot] = req->mode;
+    }
+  }
+  return true;
+}
+
+/// Save the config init() just resolved for `spec`. Best effort: a cache
+/// that can't be written only makes the next start slower.
+static void config_cache_store(const char *spec) {
+  memset(&cache, 0, sizeof(cache));
+  char path[sizeof(cache_dir) + 64];
+  if (!cache_key(cache.key, sizeof(cache.key), spec) ||
+      !cache_path(path, sizeof(path), cache.key))
+    return;
+
+  memcpy(cache.magic, CONFIG_CACHE_MAGIC, 8);
+  cache.version = CONFIG_CACHE_VERSION;
+  cache.size = sizeof(config_cache);
+  cache.classes = classes;
+  cache.group_count = group_count;
+  cache.ev_count = (u32)ev_count;
+  cache.ev_req_count = (u32)ev_req_count;
+  for (u32 g = 0; g < group_count; g++) {
+    cache.groups[g].classes = groups[g].classes;
+    cache.groups[g].reg_count = (u32)groups[g].reg_count;
+    memcpy(cache.groups[g].regs, groups[g].regs, sizeof(groups[g].regs));
+  }
+  for (usize i = 0; i < ev_count; i++) {
+    cache.counter_map[i] = counter_map[i];
+    cache.slot_group[i] = slot_group[i];
+  }
+  for (usize i = 0; i < ev_req_count; i++) {
+    requested_event *req = ev_req + i;
+    cached_event *ce = cache.events + i;
+    ce->slot = req->slot;
+    ce->status = req->status;
+    ce->alias = -1;
+    for (usize a = 0; a < lib_nelems(profile_events); a++) {
+      if (req->alias == profile_events[a].alias)
+        ce->alias = (i32)a;
+    }
+    if (!req->ev)
+      continue;
+    if (strlen(req->ev->name) >= sizeof(ce->name))
+      return;
+    strcpy(ce->name, req->ev->name);
+    ce->number = req->ev->number;
+    ce->umask = req->ev->umask;
+    ce->is_fixed = req->ev->is_fixed;
+    ce->found = 1;
+  }
+
+  // write a temporary file and rename it, so other processes never read a
+  // partial one. mkstemp() creates a new file (O_EXCL), a link or file that
+  // someone else put at a predictable name can't redirect the write.
+  char tmp[sizeof(path) + 16];
+  snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+  int fd = mkstemp(tmp);
+  if (fd < 0)
+    return;
+  // config_cache_load() rejects files that others can write
+  bool ok = fchmod(fd, 0600) == 0;
+  ok &= write(fd, &cache, sizeof(cache)) == sizeof(cache);
+  ok &= close(fd) == 0;
+  if (!ok || rename(tmp, path))
+    unlink(tmp);
+}
+
+/// Resolve the parsed events in the pmc db, split them into groups and
+/// get the registers and counter maps of each.
+/// @return NULL on success, error message otherwise.
+static const char *configure_events(void) {
   int ret = 0;
+  // load pmc db
+  const char *err = db_load();
+  if (err)
+    return err;
 
-  // get counters after
-  if ((ret = kpc_get_thread_counters(0, KPC_MAX_COUNTERS, counters_1))) {
-    return "Failed get thread counters after";
+  // create a config
+  if ((ret = group_create())) {
+    return kpep_config_error_desc(ret);
   }
 
-  // stop counting
-  kpc_set_counting(0);
-  kpc_set_thread_counting(0);
-  kpc_force_all_ctrs_set(0);
+  // get events
+  for (usize i = 0; i < ev_req_count; i++) {
+    requested_event *req = ev_req + i;
+    req->ev = resolve_event(req);
+    if (!req->ev && !req->status) {
+      req->status = KPEP_CONFIG_ERROR_EVENT_NOT_FOUND;
+    }
+  }
 
-  for (usize i = 0; i < 4; i++) {
-    const event_alias *alias = profile_events + i;
-    usize idx = counter_map[i];
-    values[i] = counters_1[idx] - counters_0[idx];
+  // add event to config, skip the ones that don't fit on the
+  // available counters or in another group
+  u32 slot_owner[KPC_MAX_COUNTERS];
+  usize slot_index[KPC_MAX_COUNTERS];
+  for (usize i = 0; i < ev_req_count; i++) {
+    requested_event *req = ev_req + i;
+    kpep_event *ev = req->ev;
+    if (!ev)
+      continue;
+    bool duplicate = false;
+    for (usize j = 0; j < ev_count; j++) {
+      duplicate |= ev_arr[j] == ev && slot_mode[j] == req->mode;
+    }
+    if (duplicate) {
+      req->status = KPEP_CONFIG_ERROR_CONFLICTING_EVENTS;
+      continue;
+    }
+    u32 group = 0;
+    usize index = 0;
+    if ((ret = group_add_event(req, &group, &index))) {
+      req->status = ret;
+      continue;
+    }
+    req->slot = (i32)ev_count;
+    slot_group[ev_count] = ev->is_fixed ? -1 : (i32)group;
+    slot_owner[ev_count] = group;
+    slot_index[ev_count] = index;
+    slot_mode[ev_count] = req->mode;
+    ev_arr[ev_count++] = req->ev;
+  }
+  if (!ev_count) {
+    return "None of the events could be configured";
   }
 
+  // counting is enabled for the classes of every group, so the thread
+  // counters always have the layout of `classes`
+  classes = 0;
+  u32 fixed_count = kpc_get_counter_count(KPC_CLASS_FIXED_MASK);
+  u32 fixed_configs = kpc_get_config_count(KPC_CLASS_FIXED_MASK);
+  usize group_map[COUNTER_GROUP_MAX][KPC_MAX_COUNTERS];
+  for (u32 g = 0; g < group_count; g++) {
+    counter_group *grp = groups + g;
+    if ((ret = kpep_config_kpc_classes(grp->cfg, &grp->classes))) {
+      return kpep_config_error_desc(ret);
+    }
+    if ((ret = kpep_config_kpc_count(grp->cfg, &grp->reg_count))) {
+      return kpep_config_error_desc(ret);
+    }
+    if ((ret = kpep_config_kpc_map(grp->cfg, group_map[g],
+                                   sizeof(group_map[g])))) {
+      return kpep_config_error_desc(ret);
+    }
+    if ((ret = kpep_config_kpc(grp->cfg, grp->regs, sizeof(grp->regs)))) {
+      return "Failed get kpc registers";
+    }
+    classes |= grp->classes;
+
+    // clear the mode bits of the restricted events in their config words,
+    // which follow the fixed counter configs
+    kpc_config_t user = 0, kernel = 0;
+    mode_bits(db->archtecture, &user, &kernel);
+    bool has_fixed = grp->classes & KPC_CLASS_FIXED_MASK;
+    for (usize i = 0; i < ev_count; i++) {
+      if (slot_owner[i] != g || slot_mode[i] == EVENT_MODE_ALL)
+        continue;
+      usize idx = group_map[g][slot_index[i]];
+      usize reg = idx;
+      if (has_fixed)
+        reg = idx - fixed_count + fixed_configs;
+      if (reg >= grp->reg_count)
+        continue;
+      grp->regs[reg] &= ~(user | kernel);
+      grp->regs[reg] |= slot_mode[i] == EVENT_MODE_USER ? user : kernel;
+    }
+  }
+  for (usize i = 0; i < ev_count; i++) {
+    u32 g = slot_owner[i];
+    usize idx = group_map[g][slot_index[i]];
+    // a group without fixed events maps its counters from 0
+    if (!(groups[g].classes & KPC_CLASS_FIXED_MASK) &&
+        (classes & KPC_CLASS_FIXED_MASK))
+      idx += fixed_count;
+    counter_map[i] = idx;
+  }
   return 0;
 }
 
-int main(int argc, const char *argv[]) {
-//   int ret = 0;
-//   // code to be measured
-//   profile_func();
+static const char *close_locked(void);
+const char *performance_counters_telemetry_stop();
 
-//   // result
-//   printf("counters value:\n");
+/// performance_counters_init() with `config_lock` held.
+static const char *init_locked(const char *events) {
+  // load dylib, kperfdata is loaded by db_load() when the config isn't cached
+  if (!lib_init()) {
+    return lib_err_msg;
+  }
 
-//   // TODO: free memory
+  // check permission
+  int force_ctrs = 0;
+  if (kpc_force_all_ctrs_get(&force_ctrs)) {
+    return "Permission denied, xnu/kpc requires root privileges.\n";
+  }
+
+  // every worker calls init(), only a different event list reconfigures
+  // the counters under the threads that are already measuring
+  const char *spec = events && *events ? events : default_events;
+  if (programmed && ev_count && strcmp(spec, init_spec) == 0 &&
+      max_groups == init_max_groups) {
+    return group_count > 1 && atomic_load(&session_users) > 1
+               ? multiplex_shared_err
+               : 0;
+  }
+  // the caller retained before init(), any other user is still measuring
+  if (ev_count && atomic_load(&session_users) > 1) {
+    return "Counters are in use by other threads, init() them with the "
+           "same events";
+  }
+  init_spec[0] = '\0';
+
+  // init() may be called again with another event list
+  if (counting) {
+    close_locked();
+  }
+  groups_free();
+  ev_count = 0;
+  cpu_has_prev = false;
+  memset(overhead, 0, sizeof(overhead));
+  memset(inline_overhead, 0, sizeof(inline_overhead));
+
+  const char *err = parse_events(events);
+  if (err)
+    return err;
+
+  config_cached = config_cache_load(spec);
+  if (!config_cached) {
+    if ((err = configure_events()))
+      return err;
+    config_cache_store(spec);
+  }
+
+  // regs may have changed since the last init()
+  programmed = false;
+  active_group = 0;
+  if ((err = program_counters()))
+    return err;
+  if (group_count > 1 && atomic_load(&session_users) > 1)
+    return multiplex_shared_err;
+  strcpy(init_spec, spec);
+  init_max_groups = max_groups;
   return 0;
 }
 
+/// Configure the counters.
+/// @param events Comma separated event names or aliases, NULL or empty for
+///               cycles, instructions, branches and branch-misses.
+///               Events that cannot be found or scheduled are skipped,
+///               see performance_counters_event_status(). Events that
+///               don't fit together are split into groups, up to
+///               performance_counters_set_max_groups().
+/// Fails when other contexts retain the counters and `events` differs from
+/// the list they were configured with.
+const char *performance_counters_init(const char *events);
+const char *performance_counters_init(const char *events) {
+  pthread_mutex_lock(&config_lock);
+  const char *err = init_locked(events);
+  pthread_mutex_unlock(&config_lock);
+  return err;
+}
+
+/// Number of events that are counted, i.e. the values buffer length.
+u32 performance_counters_counter_count();
+u32 performance_counters_counter_count() { return (u32)ev_count; }
+
+/// Number of events passed to init().
+u32 performance_counters_event_count();
+u32 performance_counters_event_count() { return (u32)ev_req_count; }
+
+/// Name of the i-th event passed to init(), as it was passed.
+const char *performance_counters_event_name(u32 i);
+const char *performance_counters_event_name(u32 i) {
+  return i < ev_req_count ? ev_req[i].name : 0;
+}
+
+/// Name of the i-th event in the pmc db, NULL if not found.
+const char *performance_counters_event_db_name(u32 i);
+const char *performance_counters_event_db_name(u32 i) {
+  // a field access instead of kpep_event_name(), kperfdata isn't loaded
+  // when the config came from the cache
+  return i < ev_req_count && ev_req[i].ev ? ev_req[i].ev->name : 0;
+}
+
+/// event_mode of the i-th event passed to init(), from its name suffix.
+u32 performance_counters_event_mode(u32 i);
+u32 performance_counters_event_mode(u32 i) {
+  return i < ev_req_count ? ev_req[i].mode : EVENT_MODE_ALL;
+}
+
+/// `profile_events` alias of the i-th event ("cycles"), NULL if none.
+const char *performance_counters_event_alias(u32 i);
+const char *performance_counters_event_alias(u32 i) {
+  return i < ev_req_count ? ev_req[i].alias : 0;
+}
+
+/// Index of the i-th event in the values buffer, -1 if it is not counted.
+i32 performance_counters_event_slot(u32 i);
+i32 performance_counters_event_slot(u32 i) {
+  return i < ev_req_count ? ev_req[i].slot : -1;
+}
+
+/// Why the i-th event is not counted, see kpep_config_error_code.
+/// @return 0 if it is counted.
+i32 performance_counters_event_status(u32 i);
+i32 performance_counters_event_status(u32 i) {
+  return i < ev_req_count ? ev_req[i].status : KPEP_CONFIG_ERROR_INVALID_ARGUMENT;
+}
+
+/// Description of a kpep_config_error_code.
+const char *performance_counters_error_desc(i32 code);
+const char *performance_counters_error_desc(i32 code) {
+  return kpep_config_error_desc(code);
+}
+
 // -----------------------------------------------------------------------------
-// Demo 2: profile a select process
+// Event catalog
 // -----------------------------------------------------------------------------
 
-/// Target process pid, -1 for all thread.
-static int target_pid = -1;
+/// Load the pmc db for the current CPU without configuring any counter.
+/// This does not require root privileges.
+const char *performance_counters_db_open();
+const char *performance_counters_db_open() {
+  pthread_mutex_lock(&config_lock);
+  const char *err = db_load();
+  pthread_mutex_unlock(&config_lock);
+  return err;
+}
 
-/// Profile time in seconds.
-static double total_profile_time = 0.1;
+/// Database name, such as "a14" or "haswell".
+const char *performance_counters_db_name();
+const char *performance_counters_db_name() { return db ? db->name : 0; }
 
-/// Profile sampler period in seconds (default 10ms).
-static double sample_period = 0.001;
+/// Marketing name, such as "Apple A14/M1" or "Intel Haswell".
+const char *performance_counters_db_marketing_name();
+const char *performance_counters_db_marketing_name() {
+  return db ? db->marketing_name : 0;
+}
 
-static double get_timestamp(void) {
-  struct timeval now;
-  gettimeofday(&now, NULL);
-  return (double)now.tv_sec + (double)now.tv_usec / (1000.0 * 1000.0);
+/// Plist name, such as "cpu_100000c_2_1b588bb3".
+const char *performance_counters_db_cpu_id();
+const char *performance_counters_db_cpu_id() {
+  return db ? db->cpu_id : 0;
 }
 
-// debugid sub-classes and code from xnu source
-#define PERF_KPC (6)
-#define PERF_KPC_DATA_THREAD (8)
+/// PMU version, see `PMU version constants`, KPC_PMU_ERROR if unknown.
+/// This does not require root privileges.
+u32 performance_counters_pmu_version();
+u32 performance_counters_pmu_version() {
+  return lib_init() ? kpc_pmu_version() : KPC_PMU_ERROR;
+}
 
-// int main2(int argc, const char *argv[]) {
-//   int ret = 0;
+/// Number of fixed counters.
+u32 performance_counters_db_fixed_counter_count();
+u32 performance_counters_db_fixed_counter_count() {
+  return db ? (u32)db->fixed_counter_count : 0;
+}
 
-//   // load dylib
-//   if (!lib_init()) {
-//     printf("Error: %s\n", lib_err_msg);
-//     return 1;
-//   }
-
-//   // check permission
-//   int force_ctrs = 0;
-//   if (kpc_force_all_ctrs_get(&force_ctrs)) {
-//     return "Permission denied, xnu/kpc requires root privileges.\n");
-//     return 1;
-//   }
-
-//   // load pmc db
-//   kpep_db *db = NULL;
-//   if ((ret = kpep_db_create(NULL, &db))) {
-//     printf("Error: cannot load pmc database: %d.\n", ret);
-//     return 1;
-//   }
-//   printf("loaded db: %s (%s)\n", db->name, db->marketing_name);
-//   printf("number of fixed counters: %zu\n", db->fixed_counter_count);
-//   printf("number of configurable counters: %zu\n", db->config_counter_count);
-//   printf("CPU tick frequency: %llu\n",
-//          (unsigned long long)kperf_tick_frequency());
-
-//   // create a config
-//   kpep_config *cfg = NULL;
-//   if ((ret = kpep_config_create(db, &cfg))) {
-//     printf("Failed to create kpep config: %d (%s).\n", ret,
-//            kpep_config_error_desc(ret));
-//     return 1;
-//   }
-//   if ((ret = kpep_config_force_counters(cfg))) {
-//     printf("Failed to force counters: %d (%s).\n", ret,
-//            kpep_config_error_desc(ret));
-//     return 1;
-//   }
-
-//   // get events
-//   const usize ev_count = sizeof(profile_events) / sizeof(profile_events[0]);
-//   kpep_event *ev_arr[ev_count] = {0};
-//   for (usize i = 0; i < ev_count; i++) {
-//     const event_alias *alias = profile_events + i;
-//     ev_arr[i] = get_event(db, alias);
-//     if (!ev_arr[i]) {
-//       printf("Cannot find event: %s.\n", alias->alias);
-//       return 1;
-//     }
-//   }
-
-//   // add event to config
-//   for (usize i = 0; i < ev_count; i++) {
-//     kpep_event *ev = ev_arr[i];
-//     if ((ret = kpep_config_add_event(cfg, &ev, 0, NULL))) {
-//       printf("Failed to add event: %d (%s).\n", ret,
-//              kpep_config_error_desc(ret));
-//       return 1;
-//     }
-//   }
-
-//   // prepare buffer and config
-//   u32 classes = 0;
-//   usize reg_count = 0;
-//   kpc_config_t regs[KPC_MAX_COUNTERS] = {0};
-//   usize counter_map[KPC_MAX_COUNTERS] = {0};
-//   if ((ret = kpep_config_kpc_classes(cfg, &classes))) {
-//     printf("Failed get kpc classes: %d (%s).\n", ret,
-//            kpep_config_error_desc(ret));
-//     return 1;
-//   }
-//   if ((ret = kpep_config_kpc_count(cfg, &reg_count))) {
-//     printf("Failed get kpc count: %d (%s).\n", ret,
-//            kpep_config_error_desc(ret));
-//     return 1;
-//   }
-//   if ((ret = kpep_config_kpc_map(cfg, counter_map, sizeof(counter_map)))) {
-//     printf("Failed get kpc map: %d (%s).\n", ret, kpep_config_error_desc(ret));
-//     return 1;
-//   }
-//   if ((ret = kpep_config_kpc(cfg, regs, sizeof(regs)))) {
-//     printf("Failed get kpc registers: %d (%s).\n", ret,
-//            kpep_config_error_desc(ret));
-//     return 1;
-//   }
-
-//   // set config to kernel
-//   if ((ret = kpc_force_all_ctrs_set(1))) {
-//     printf("Failed force all ctrs: %d.\n", ret);
-//     return 1;
-//   }
-//   if ((classes & KPC_CLASS_CONFIGURABLE_MASK) && reg_count) {
-//     if ((ret = kpc_set_config(classes, regs))) {
-//       printf("Failed set kpc config: %d.\n", ret);
-//       return 1;
-//     }
-//   }
-
-//   u32 counter_count = kpc_get_counter_count(classes);
-//   if (counter_count == 0) {
-//     printf("Failed no counter\n");
-//     return 1;
-//   }
-
-//   // start counting
-//   if ((ret = kpc_set_counting(classes))) {
-//     printf("Failed set counting: %d.\n", ret);
-//     return 1;
-//   }
-//   if ((ret = kpc_set_thread_counting(classes))) {
-//     printf("Failed set thread counting: %d.\n", ret);
-//     return 1;
-//   }
-
-//   // action id and timer id
-//   u32 actionid = 1;
-//   u32 timerid = 1;
-
-//   // alloc action and timer ids
-//   if ((ret = kperf_action_count_set(KPERF_ACTION_MAX))) {
-//     printf("Failed set action count: %d.\n", ret);
-//   }
-//   if ((ret = kperf_timer_count_set(KPERF_TIMER_MAX))) {
-//     printf("Failed set timer count: %d.\n", ret);
-//   }
-
-//   // set what to sample: PMC per thread
-//   if ((ret = kperf_action_samplers_set(actionid, KPERF_SAMPLER_PMC_THREAD))) {
-//     printf("Failed set sampler type: %d.\n", ret);
-//   }
-//   // set filter process
-//   if ((ret = kperf_action_filter_set_by_pid(actionid, target_pid))) {
-//     printf("Failed set filter pid: %d.\n", ret);
-//   }
-
-//   // setup PET (Profile Every Thread), start sampler
-//   u64 tick = kperf_ns_to_ticks(sample_period * 1000000000ul);
-//   if ((ret = kperf_timer_period_set(actionid, tick))) {
-//     printf("Failed set timer period: %d.\n", ret);
-//   }
-//   if ((ret = kperf_timer_action_set(actionid, timerid))) {
-//     printf("Failed set timer action: %d.\n", ret);
-//   }
-//   if ((ret = kperf_timer_pet_set(timerid))) {
-//     printf("Failed set timer PET: %d.\n", ret);
-//   }
-//   if ((ret = kperf_lightweight_pet_set(1))) {
-//     printf("Failed set lightweight PET: %d.\n", ret);
-//   }
-//   if ((ret = kperf_sample_set(1))) {
-//     printf("Failed start sample: %d.\n", ret);
-//   }
-
-//   // reset kdebug/ktrace
-//   if ((ret = kdebug_reset())) {
-//     printf("Failed reset kdebug: %d.\n", ret);
-//   }
-
-//   int nbufs = 1000000;
-//   if ((ret = kdebug_trace_setbuf(nbufs))) {
-//     printf("Failed setbuf: %d.\n", ret);
-//   }
-//   if ((ret = kdebug_reinit())) {
-//     printf("Failed init kdebug buffer: %d.\n", ret);
-//   }
-
-//   // set trace filter: only log PERF_KPC_DATA_THREAD
-//   kd_regtype kdr = {0};
-//   kdr.type = KDBG_VALCHECK;
-//   kdr.value1 = KDBG_EVENTID(DBG_PERF, PERF_KPC, PERF_KPC_DATA_THREAD);
-//   if ((ret = kdebug_setreg(&kdr))) {
-//     printf("Failed set kdebug filter: %d.\n", ret);
-//   }
-//   // start trace
-//   if ((ret = kdebug_trace_enable(1))) {
-//     printf("Failed enable kdebug trace: %d.\n", ret);
-//   }
-
-//   // sample and get buffers
-//   usize buf_capacity = nbufs * 2;
-//   kd_buf *buf_hdr = malloc(sizeof(kd_buf) * buf_capacity);
-//   kd_buf *buf_cur = buf_hdr;
-//   kd_buf *buf_end = buf_hdr + buf_capacity;
-
-//   double begin = get_timestamp();
-//   while (buf_hdr) {
-//     // wait for more buffer
-//     usleep(2 * sample_period * 1000000);
-
-//     // expand local buffer for next read
-//     if (buf_end - buf_cur < nbufs) {
-//       usize new_capacity = buf_capacity * 2;
-//       kd_buf *new_buf = realloc(buf_hdr, sizeof(kd_buf) * new_capacity);
-//       if (!new_buf) {
-//         free(buf_hdr);
-//         buf_hdr = NULL;
-//         break;
-//       }
-//       buf_capacity = new_capacity;
-//       buf_cur = new_buf + (buf_cur - buf_hdr);
-//       buf_end = new_buf + (buf_end - buf_hdr);
-//       buf_hdr = new_buf;
-//     }
-
-//     // read trace buffer from kernel
-//     usize count = 0;
-//     kdebug_trace_read(buf_cur, sizeof(kd_buf) * nbufs, &count);
-//     for (kd_buf *buf = buf_cur, *end = buf_cur + count; buf < end; buf++) {
-//       u32 debugid = buf->debugid;
-//       u32 cls = KDBG_EXTRACT_CLASS(debugid);
-//       u32 subcls = KDBG_EXTRACT_SUBCLASS(debugid);
-//       u32 code = KDBG_EXTRACT_CODE(debugid);
-
-//       // keep only thread PMC data
-//       if (cls != DBG_PERF)
-//         continue;
-//       if (subcls != PERF_KPC)
-//         continue;
-//       if (code != PERF_KPC_DATA_THREAD)
-//         continue;
-//       memmove(buf_cur, buf, sizeof(kd_buf));
-//       buf_cur++;
-//     }
-
-//     // stop when time is up
-//     double now = get_timestamp();
-//     if (now - begin > total_profile_time + sample_period)
-//       break;
-//   }
-
-//   // stop tracing
-//   kdebug_trace_enable(0);
-//   kdebug_reset();
-//   kperf_sample_set(0);
-//   kperf_lightweight_pet_set(0);
-
-//   // stop counting
-//   kpc_set_counting(0);
-//   kpc_set_thread_counting(0);
-//   kpc_force_all_ctrs_set(0);
-
-//   // aggregate thread PMC data
-//   if (!buf_hdr) {
-//     printf("Failed to allocate memory for trace log.\n");
-//     return 1;
-//   }
-//   if (buf_cur - buf_hdr == 0) {
-//     printf("No thread PMC data collected.\n");
-//     return 1;
-//   }
-
-//   typedef struct {
-//     u32 tid;
-//     u64 timestamp_0;
-//     u64 timestamp_1;
-//     u64 counters_0[KPC_MAX_COUNTERS];
-//     u64 counters_1[KPC_MAX_COUNTERS];
-//   } kpc_thread_data;
-
-//   usize thread_capacity = 16;
-//   usize thread_count = 0;
-//   kpc_thread_data *thread_data =
-//       malloc(thread_capacity * sizeof(kpc_thread_data));
-//   if (!thread_data) {
-//     printf("Failed to allocate memory for aggregate log.\n");
-//     return 1;
-//   }
-//   for (kd_buf *buf = buf_hdr; buf < buf_cur; buf++) {
-//     u32 func = buf->debugid & KDBG_FUNC_MASK;
-//     if (func != DBG_FUNC_START)
-//       continue;
-//     u32 tid = (u32)buf->arg5;
-//     if (!tid)
-//       continue;
-
-//     // read one counter log
-//     u32 ci = 0;
-//     u64 counters[KPC_MAX_COUNTERS];
-//     counters[ci++] = buf->arg1;
-//     counters[ci++] = buf->arg2;
-//     counters[ci++] = buf->arg3;
-//     counters[ci++] = buf->arg4;
-//     if (ci < counter_count) {
-//       // counter count larger than 4
-//       // values are split into multiple buffer entities
-//       for (kd_buf *buf2 = buf + 1; buf2 < buf_cur; buf2++) {
-//         u32 tid2 = (u32)buf2->arg5;
-//         if (tid2 != tid)
-//           break;
-//         u32 func2 = buf2->debugid & KDBG_FUNC_MASK;
-//         if (func2 == DBG_FUNC_START)
-//           break;
-//         if (ci < counter_count)
-//           counters[ci++] = buf2->arg1;
-//         if (ci < counter_count)
-//           counters[ci++] = buf2->arg2;
-//         if (ci < counter_count)
-//           counters[ci++] = buf2->arg3;
-//         if (ci < counter_count)
-//           counters[ci++] = buf2->arg4;
-//         if (ci == counter_count)
-//           break;
-//       }
-//     }
-//     if (ci != counter_count)
-//       continue; // not enough counters, maybe truncated
-
-//     // add to thread data
-//     kpc_thread_data *data = NULL;
-//     for (usize i = 0; i < thread_count; i++) {
-//       if (thread_data[i].tid == tid) {
-//         data = thread_data + i;
-//         break;
-//       }
-//     }
-//     if (!data) {
-//       if (thread_capacity == thread_count) {
-//         thread_capacity *= 2;
-//         kpc_thread_data *new_data =
-//             realloc(thread_data, thread_capacity * sizeof(kpc_thread_data));
-//         if (!new_data) {
-//           printf("Failed to allocate memory for aggregate log.\n");
-//           return 1;
-//         }
-//         thread_data = new_data;
-//       }
-//       data = thread_data + thread_count;
-//       thread_count++;
-//       memset(data, 0, sizeof(kpc_thread_data));
-//       data->tid = tid;
-//     }
-//     if (data->timestamp_0 == 0) {
-//       data->timestamp_0 = buf->timestamp;
-//       memcpy(data->counters_0, counters, counter_count * sizeof(u64));
-//     } else {
-//       data->timestamp_1 = buf->timestamp;
-//       memcpy(data->counters_1, counters, counter_count * sizeof(u64));
-//     }
-//   }
-
-//   u64 counters_sum[KPC_MAX_COUNTERS] = {0};
-//   for (usize i = 0; i < thread_count; i++) {
-//     kpc_thread_data *data = thread_data + i;
-//     if (!data->timestamp_0 || !data->timestamp_1)
-//       continue;
-
-//     u64 counters_one[KPC_MAX_COUNTERS] = {0};
-//     for (usize c = 0; c < counter_count; c++) {
-//       counters_one[c] += data->counters_1[c] - data->counters_0[c];
-//     }
-//     printf("------------------------\n");
-//     printf("thread: %u, trace time: %f\n", data->tid,
-//            kperf_ticks_to_ns(data->timestamp_1 - data->timestamp_0) /
-//                1000000000.0);
-//     for (usize i = 0; i < ev_count; i++) {
-//       const event_alias *alias = profile_events + i;
-//       u64 val = counters_one[counter_map[i]];
-//       printf("%14s: %llu\n", alias->alias, val);
-//     }
-
-//     for (usize c = 0; c < counter_count; c++) {
-//       counters_sum[c] += counters_one[c];
-//     }
-//   }
-
-//   printf("------------------------\n");
-//   printf("all threads:\n");
-//   for (usize i = 0; i < ev_count; i++) {
-//     const event_alias *alias = profile_events + i;
-//     u64 val = counters_sum[counter_map[i]];
-//     printf("%14s: %llu\n", alias->alias, val);
-//   }
+/// Number of configurable counters.
+u32 performance_counters_db_config_counter_count();
+u32 performance_counters_db_config_counter_count() {
+  return db ? (u32)db->config_counter_count : 0;
+}
 
-//   // TODO: free memory
-//   return 0;
-// }
\ No newline at end of file
+/// Number of power counters.
+u32 performance_counters_db_power_counter_count();
+u32 performance_counters_db_power_counter_count() {
+  return db ? (u32)db->power_counter_count : 0;
+}
+
+/// Number of events in the db.
+u32 performance_counters_db_event_count();
+u32 performance_counters_db_event_count() { return (u32)db_event_count; }
+
+static kpep_event *db_event_at(u32 i) {
+  return i < db_event_count ? db_event_arr[i] : NULL;
+}
+
+/// Unique name of the i-th event, such as "INST_RETIRED.ANY".
+const char *performance_counters_db_event_name(u32 i);
+const char *performance_counters_db_event_name(u32 i) {
+  kpep_event *ev = db_event_at(i);
+  return ev ? ev->name : 0;
+}
+
+/// Alias of the i-th event, such as "Instructions", may be NULL.
+const char *performance_counters_db_event_alias(u32 i);
+const char *performance_counters_db_event_alias(u32 i) {
+  kpep_event *ev = db_event_at(i);
+  return ev ? ev->alias : 0;
+}
+
+/// Description of the i-th event, may be NULL.
+const char *performance_counters_db_event_description(u32 i);
+const char *performance_counters_db_event_description(u32 i) {
+  kpep_event *ev = db_event_at(i);
+  return ev ? ev->description : 0;
+}
+
+/// Configurable event that can stand in for the i-th (fixed) event,
+/// may be NULL.
+const char *performance_counters_db_event_fallback(u32 i);
+const char *performance_counters_db_event_fallback(u32 i) {
+  kpep_event *ev = db_event_at(i);
+  return ev ? ev->fallback : 0;
+}
+
+/// Bitmask of the counters the i-th event can be scheduled on.
+u32 performance_counters_db_event_mask(u32 i);
+u32 performance_counters_db_event_mask(u32 i) {
+  kpep_event *ev = db_event_at(i);
+  return ev ? ev->mask : 0;
+}
+
+/// Whether the i-th event is counted by a fixed counter.
+u32 performance_counters_db_event_is_fixed(u32 i);
+u32 performance_counters_db_event_is_fixed(u32 i) {
+  kpep_event *ev = db_event_at(i);
+  return ev ? ev->is_fixed : 0;
+}
+
+/// performance_counters_open() with `config_lock` held.
+static const char *open_locked(void) {
+  int ret = 0;
+  if (counting)
+    return 0;
+
+  // init() programs the counters, but close() gives them back to the
+  // Power Manager, so a reopened session has to program them again
+  const char *err = program_counters();
+  if (err)
+    return err;
+
+  // start counting
+  if ((ret = kpc_set_counting(classes))) {
+    return "Failed set counting";
+  }
+  if ((ret = kpc_set_thread_counting(classes))) {
+    return "Failed set thread counting";
+  }
+
+  counting = true;
+  return 0;
+}
+
+const char *performance_counters_open();
+const char *performance_counters_open() {
+  if (counting)
+    return 0;
+  pthread_mutex_lock(&config_lock);
+  const char *err = open_locked();
+  pthread_mutex_unlock(&config_lock);
+  return err;
+}
+
+const char *performance_counters_sample(u64 *values);
+const char *performance_counters_sample(u64 *values) {
+  int ret = 0;
+  if ((ret = kpc_get_thread_counters(0, KPC_MAX_COUNTERS, counters_1))) {
+    return "Failed get thread counters";
+  }
+
+  for (usize i = 0; i < ev_count; i++) {
+    values[i] = slot_counted(i) ? counters_1[counter_map[i]] : 0;
+  }
+
+  return 0;
+}
+
+/// performance_counters_close() with `config_lock` held.
+static const char *close_locked(void) {
+  if (!lib_inited || lib_has_err)
+    return 0;
+
+  // the sampler would read counters that are being turned off
+  performance_counters_telemetry_stop();
+
+  // stop counting
+  kpc_set_counting(0);
+  kpc_set_thread_counting(0);
+  kpc_force_all_ctrs_set(0);
+
+  counting = false;
+  programmed = false;
+  return 0;
+}
+
+const char *performance_counters_close();
+const char *performance_counters_close() {
+  pthread_mutex_lock(&config_lock);
+  const char *err = close_locked();
+  pthread_mutex_unlock(&config_lock);
+  return err;
+}
+
+/// Message of the last hot entry point that failed on this thread.
+static _Thread_local const char *last_error = NULL;
+
+/// Record why a hot entry point failed.
+/// @return 1, the status of a failure.
+static inline i32 status_error(const char *err) {
+  last_error = err;
+  return 1;
+}
+
+/// 0 for NULL, else status_error(err).
+static inline i32 status_of(const char *err) {
+  return err ? status_error(err) : 0;
+}
+
+/// Why the last hot entry point that returned a non-zero status on this
+/// thread failed. The hot entry points (start, stop, batch_stop, the inline
+/// reads, the regions and the handles) return 0 on success, so checking them
+/// costs an integer compare instead of decoding a string.
+const char *performance_counters_last_error();
+const char *performance_counters_last_error() { return last_error; }
+
+/// Record the CPU start() and stop() run on, see
+/// performance_counters_track_cpu().
+static bool track_cpu = false;
+static _Thread_local i32 cpu_start = -1;
+static _Thread_local i32 cpu_end = -1;
+
+/// Read the time in start() and stop(), see performance_counters_track_time().
+static bool track_time = false;
+static _Thread_local u64 time_start = 0;
+static _Thread_local u64 time_end = 0;
+static mach_timebase_info_data_t timebase = {1, 1};
+
+/// Monotonic time in mach ticks.
+static inline u64 time_now(void) { return mach_absolute_time(); }
+
+/// Convert a time_now() difference to nanoseconds.
+static inline u64 time_ns(u64 delta) {
+  return delta / timebase.denom * timebase.numer +
+         delta % timebase.denom * timebase.numer / timebase.denom;
+}
+
+/// CPU the calling thread runs on, -1 if unknown.
+static inline i32 current_cpu(void) {
+  u64 buf[KPC_MAX_COUNTERS];
+  int cpu = -1;
+  if (kpc_get_cpu_counters(false, classes, &cpu, buf))
+    return -1;
+  return cpu;
+}
+
+i32 performance_counters_start();
+i32 performance_counters_start() {
+  int ret = 0;
+  // counting stays on between start() and stop(), only the first call
+  // pays for enabling it
+  if (!counting) {
+    const char *err = performance_counters_open();
+    if (err)
+      return status_error(err);
+  }
+
+  // multiplexed groups take turns, one per start()/stop() pair
+  if (group_count > 1) {
+    const char *err = group_rotate();
+    if (err)
+      return status_error(err);
+  }
+
+  // outside of the measured region, like the read in stop()
+  if (track_cpu)
+    cpu_start = current_cpu();
+  if (track_time)
+    time_start = time_now();
+
+  // get counters before
+  if ((ret = kpc_get_thread_counters(0, KPC_MAX_COUNTERS, counters_0))) {
+    return status_error("Failed get thread counters before");
+  }
+
+  return 0;
+}
+
+/// Write the corrected copy of `values[0, ev_count)` after it.
+static inline void subtract_overhead(u64 *values, const u64 *overhead) {
+  for (usize i = 0; i < ev_count; i++) {
+    u64 raw = values[i];
+    values[ev_count + i] = raw > overhead[i] ? raw - overhead[i] : 0;
+  }
+}
+
+/// Stop counting into `values`, which holds `2 * ev_count` slots:
+/// the raw deltas, then the deltas minus the calibrated overhead.
+i32 performance_counters_stop(u64 *values);
+i32 performance_counters_stop(u64 *values) {
+  int ret = 0;
+
+  // get counters after
+  if ((ret = kpc_get_thread_counters(0, KPC_MAX_COUNTERS, counters_1))) {
+    return status_error("Failed get thread counters after");
+  }
+  if (track_time)
+    time_end = time_now();
+  if (track_cpu)
+    cpu_end = current_cpu();
+
+  for (usize i = 0; i < ev_count; i++) {
+    usize idx = counter_map[i];
+    values[i] = slot_counted(i) ? counters_1[idx] - counters_0[idx] : 0;
+  }
+  subtract_overhead(values, overhead);
+
+  return 0;
+}
+
+/// Set what an empty start/stop pair counts, per event.
+/// @param values `ev_count` values, NULL to clear.
+/// @param inline_reads 1 for the overhead of the inline entry points.
+void performance_counters_set_overhead(const u64 *values, u32 inline_reads);
+void performance_counters_set_overhead(const u64 *values, u32 inline_reads) {
+  pthread_mutex_lock(&config_lock);
+  u64 *dst = inline_reads ? inline_overhead : overhead;
+  for (usize i = 0; i < KPC_MAX_COUNTERS; i++) {
+    dst[i] = values && i < ev_count ? values[i] : 0;
+  }
+  pthread_mutex_unlock(&config_lock);
+}
+
+// -----------------------------------------------------------------------------
+// Threads
+// Bun workers are threads of one process and share this library, its
+// configuration and the kernel counting state. Each JavaScript context
+// retains the session so the last one to leave turns counting off.
+// A handle is a baseline owned by one thread; it also publishes the last
+// values its thread read, so a supervisor thread can snapshot every worker
+// without stopping them.
+// -----------------------------------------------------------------------------
+
+/// Register one more user of the counters.
+/// @return The number of users, including this one.
+u32 performance_counters_retain();
+u32 performance_counters_retain() {
+  return atomic_fetch_add(&session_users, 1) + 1;
+}
+
+/// Release a performance_counters_retain(), closing the session when it was
+/// the last one.
+const char *performance_counters_release();
+const char *performance_counters_release() {
+  u32 users = atomic_load(&session_users);
+  while (users && !atomic_compare_exchange_weak(&session_users, &users,
+                                                users - 1)) {
+  }
+  if (users > 1)
+    return 0;
+  return performance_counters_close();
+}
+
+/// Id of the calling thread, as kdebug and the profiler report it.
+u64 performance_counters_thread_id();
+u64 performance_counters_thread_id() {
+  u64 tid = 0;
+  pthread_threadid_np(NULL, &tid);
+  return tid;
+}
+
+/// Read the counters of another thread of this process.
+/// @param tid Thread id, 0 for the calling thread.
+/// @param values Receives `ev_count` absolute values.
+const char *performance_counters_read_thread(u32 tid, u64 *values);
+const char *performance_counters_read_thread(u32 tid, u64 *values) {
+  u64 buf[KPC_MAX_COUNTERS];
+  // current kernels only implement tid 0, the others fail with ENOTSUP
+  if (kpc_get_thread_counters(tid, KPC_MAX_COUNTERS, buf)) {
+    return tid ? "Reading another thread's counters is not supported, "
+                 "read its handle instead"
+               : "Failed get thread counters";
+  }
+  for (usize i = 0; i < ev_count; i++) {
+    values[i] = slot_counted(i) ? buf[counter_map[i]] : 0;
+  }
+  return 0;
+}
+
+/// A start/stop baseline owned by one thread.
+typedef struct {
+  u64 tid;                         ///< Owner, set by handle_start().
+  u64 counters_0[KPC_MAX_COUNTERS]; ///< Baseline, kpc order.
+  atomic_uint seq;                 ///< Odd while `published` is written.
+  u64 published[KPC_MAX_COUNTERS];  ///< Last deltas read, values order.
+} counters_handle;
+
+/// Number of live handles.
+static atomic_uint handle_count = 0;
+
+counters_handle *performance_counters_handle_create();
+counters_handle *performance_counters_handle_create() {
+  counters_handle *h = calloc(1, sizeof(counters_handle));
+  if (h)
+    atomic_fetch_add(&handle_count, 1);
+  return h;
+}
+
+void performance_counters_handle_free(counters_handle *h);
+void performance_counters_handle_free(counters_handle *h) {
+  if (!h)
+    return;
+  atomic_fetch_sub(&handle_count, 1);
+  free(h);
+}
+
+/// Number of handles that have not been freed.
+u32 performance_counters_handle_count();
+u32 performance_counters_handle_count() {
+  return atomic_load(&handle_count);
+}
+
+/// Seqlock write of the deltas since `h->counters_0`, in values order.
+static void handle_publish(counters_handle *h, const u64 *now) {
+  atomic_fetch_add_explicit(&h->seq, 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  for (usize i = 0; i < ev_count; i++) {
+    usize idx = counter_map[i];
+    h->published[i] = slot_counted(i) ? now[idx] - h->counters_0[idx] : 0;
+  }
+  atomic_fetch_add_explicit(&h->seq, 1, memory_order_release);
+}
+
+/// Like performance_counters_start(), with the baseline in `h`.
+/// The calling thread becomes the owner of `h`.
+i32 performance_counters_handle_start(counters_handle *h);
+i32 performance_counters_handle_start(counters_handle *h) {
+  if (!counting) {
+    const char *err = performance_counters_open();
+    if (err)
+      return status_error(err);
+  }
+  if (!h->tid)
+    h->tid = performance_counters_thread_id();
+  if (kpc_get_thread_counters(0, KPC_MAX_COUNTERS, h->counters_0)) {
+    return status_error("Failed get thread counters before");
+  }
+  handle_publish(h, h->counters_0);
+  return 0;
+}
+
+/// Like performance_counters_stop(), against the baseline in `h`.
+/// Also publishes the raw deltas for performance_counters_handle_read().
+i32 performance_counters_handle_stop(counters_handle *h, u64 *values);
+i32 performance_counters_handle_stop(counters_handle *h, u64 *values) {
+  u64 now[KPC_MAX_COUNTERS];
+  if (kpc_get_thread_counters(0, KPC_MAX_COUNTERS, now)) {
+    return status_error("Failed get thread counters after");
+  }
+  for (usize i = 0; i < ev_count; i++) {
+    usize idx = counter_map[i];
+    values[i] = slot_counted(i) ? now[idx] - h->counters_0[idx] : 0;
+  }
+  subtract_overhead(values, overhead);
+  handle_publish(h, now);
+  return 0;
+}
+
+/// Publish what the owner of `h` counted since handle_start(), without
+/// stopping. Only the owner can call this.
+i32 performance_counters_handle_update(counters_handle *h);
+i32 performance_counters_handle_update(counters_handle *h) {
+  u64 now[KPC_MAX_COUNTERS];
+  if (kpc_get_thread_counters(0, KPC_MAX_COUNTERS, now)) {
+    return status_error("Failed get thread counters");
+  }
+  handle_publish(h, now);
+  return 0;
+}
+
+/// Read the deltas the owner of `h` last published, from any thread.
+/// @param values Receives `ev_count` values.
+void performance_counters_handle_read(const counters_handle *h, u64 *values);
+void performance_counters_handle_read(const counters_handle *h, u64 *values) {
+  counters_handle *w = (counters_handle *)h;
+  for (;;) {
+    u32 seq = atomic_load_explicit(&w->seq, memory_order_acquire);
+    if (seq & 1)
+      continue;
+    for (usize i = 0; i < ev_count; i++) {
+      values[i] = ((volatile u64 *)w->published)[i];
+    }
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&w->seq, memory_order_relaxed) == seq)
+      return;
+  }
+}
+
+/// Owning thread of `h`, 0 until its first handle_start().
+u64 performance_counters_handle_tid(const counters_handle *h);
+u64 performance_counters_handle_tid(const counters_handle *h) {
+  return h->tid;
+}
+
+// -----------------------------------------------------------------------------
+// Per-CPU counters
+// kpc_get_cpu_counters() reads the counters of every core, whatever runs on
+// them. The buffers are sized for the machine on the first sample and
+// reused, so polling does not allocate.
+// -----------------------------------------------------------------------------
+
+/// Counters of each CPU, `cpu_count * cpu_stride` values in kpc order.
+static u64 *cpu_buf = NULL;
+/// The previous sample, for deltas.
+static u64 *cpu_prev = NULL;
+static u32 cpu_count = 0;
+static u32 cpu_stride = 0;
+static int cpu_current = -1;
+
+/// Size the per-CPU buffers for the current configuration.
+/// @return NULL on success, error message otherwise.
+static const char *cpu_prepare(void) {
+  u32 stride = kpc_get_counter_count(classes);
+  int ncpu = 0;
+  usize size = sizeof(ncpu);
+  if (sysctlbyname("hw.ncpu", &ncpu, &size, NULL, 0) || ncpu <= 0) {
+    return "Failed get hw.ncpu";
+  }
+  if (cpu_buf && cpu_count == (u32)ncpu && cpu_stride == stride)
+    return 0;
+
+  usize len = (usize)ncpu * stride;
+  u64 *buf = calloc(len, sizeof(u64));
+  u64 *prev = calloc(len, sizeof(u64));
+  if (!buf || !prev) {
+    free(buf);
+    free(prev);
+    return "Failed to allocate memory for cpu counters";
+  }
+  free(cpu_buf);
+  free(cpu_prev);
+  cpu_buf = buf;
+  cpu_prev = prev;
+  cpu_count = (u32)ncpu;
+  cpu_stride = stride;
+  cpu_has_prev = false;
+  return 0;
+}
+
+/// Number of CPUs performance_counters_sample_cpus() reports.
+u32 performance_counters_cpu_count();
+u32 performance_counters_cpu_count() {
+  int ncpu = 0;
+  usize size = sizeof(ncpu);
+  if (cpu_count)
+    return cpu_count;
+  if (sysctlbyname("hw.ncpu", &ncpu, &size, NULL, 0) || ncpu <= 0)
+    return 0;
+  return (u32)ncpu;
+}
+
+/// Read the counters of every CPU.
+/// @param values Receives `cpu_count * ev_count` values, one row per CPU.
+/// @param deltas 1 for the counts since the previous call (zero the first
+///               time), 0 for the absolute values.
+const char *performance_counters_sample_cpus(u64 *values, u32 deltas);
+const char *performance_counters_sample_cpus(u64 *values, u32 deltas) {
+  if (!ev_count)
+    return "Counters are not configured";
+  if (!counting) {
+    const char *err = performance_counters_open();
+    if (err)
+      return err;
+  }
+  const char *err = cpu_prepare();
+  if (err)
+    return err;
+
+  if (kpc_get_cpu_counters(true, classes, &cpu_current, cpu_buf)) {
+    return "Failed get cpu counters";
+  }
+
+  for (u32 cpu = 0; cpu < cpu_count; cpu++) {
+    const u64 *now = cpu_buf + (usize)cpu * cpu_stride;
+    const u64 *prev = cpu_prev + (usize)cpu * cpu_stride;
+    u64 *row = values + (usize)cpu * ev_count;
+    for (usize i = 0; i < ev_count; i++) {
+      usize idx = counter_map[i];
+      row[i] = !slot_counted(i) ? 0
+               : !deltas        ? now[idx]
+               : cpu_has_prev   ? now[idx] - prev[idx]
+                                : 0;
+    }
+  }
+
+  u64 *tmp = cpu_prev;
+  cpu_prev = cpu_buf;
+  cpu_buf = tmp;
+  cpu_has_prev = true;
+  return 0;
+}
+
+/// CPU the calling thread ran on during the last sample_cpus(), -1 if unknown.
+i32 performance_counters_cpu_current();
+i32 performance_counters_cpu_current() { return cpu_current; }
+
+/// Number of performance levels, 2 on Apple Silicon with P and E cores.
+/// @details sysctl get(hw.nperflevels), 1 if it does not exist.
+u32 performance_counters_perflevel_count();
+u32 performance_counters_perflevel_count() {
+  u32 count = 0;
+  usize size = sizeof(count);
+  if (sysctlbyname("hw.nperflevels", &count, &size, NULL, 0) || !count)
+    return 1;
+  return count;
+}
+
+/// Number of logical CPUs in performance level `level`, 0 is the fastest.
+/// @details sysctl get(hw.perflevel<level>.logicalcpu)
+u32 performance_counters_perflevel_cpus(u32 level);
+u32 performance_counters_perflevel_cpus(u32 level) {
+  char name[64];
+  u32 count = 0;
+  usize size = sizeof(count);
+  snprintf(name, sizeof(name), "hw.perflevel%u.logicalcpu", level);
+  if (sysctlbyname(name, &count, &size, NULL, 0))
+    return level == 0 ? performance_counters_cpu_count() : 0;
+  return count;
+}
+
+/// Name of performance level `level`, such as "Performance" or "Efficiency".
+/// @details sysctl get(hw.perflevel<level>.name)
+const char *performance_counters_perflevel_name(u32 level);
+const char *performance_counters_perflevel_name(u32 level) {
+  static char names[4][32];
+  if (level >= lib_nelems(names))
+    return 0;
+  char key[64];
+  usize size = sizeof(names[level]);
+  snprintf(key, sizeof(key), "hw.perflevel%u.name", level);
+  if (sysctlbyname(key, names[level], &size, NULL, 0))
+    return 0;
+  return names[level];
+}
+
+// -----------------------------------------------------------------------------
+// CPU placement
+// Apple Silicon ignores thread affinity tags, so a thread can't be pinned to
+// a core. Its QoS class decides which cluster the scheduler prefers: user
+// interactive threads go to the P-cores, background ones stay on the
+// E-cores. The CPU is still not fixed, so start() and stop() can record the
+// CPU they ran on, and samples that migrated can be told apart.
+// -----------------------------------------------------------------------------
+
+/// Cluster to ask the scheduler for, see performance_counters_prefer_cores().
+typedef enum {
+  CORES_ANY = 0,         ///< Restore the QoS class the thread had.
+  CORES_PERFORMANCE = 1, ///< QOS_CLASS_USER_INTERACTIVE.
+  CORES_EFFICIENCY = 2,  ///< QOS_CLASS_BACKGROUND.
+} cores_kind;
+
+/// QoS class of the thread before the first prefer_cores().
+static _Thread_local qos_class_t qos_saved = QOS_CLASS_UNSPECIFIED;
+static _Thread_local bool qos_changed = false;
+
+/// Ask the scheduler to run the calling thread on one kind of core.
+/// @param kind See `cores_kind`.
+const char *performance_counters_prefer_cores(u32 kind);
+const char *performance_counters_prefer_cores(u32 kind) {
+  qos_class_t qos;
+  switch (kind) {
+  case CORES_ANY:
+    if (!qos_changed)
+      return 0;
+    qos = qos_saved;
+    break;
+  case CORES_PERFORMANCE:
+    qos = QOS_CLASS_USER_INTERACTIVE;
+    break;
+  case CORES_EFFICIENCY:
+    qos = QOS_CLASS_BACKGROUND;
+    break;
+  default:
+    return "Unknown kind of cores";
+  }
+  if (!qos_changed && kind != CORES_ANY)
+    qos_saved = qos_class_self();
+  // an unspecified class can't be set back, default is the closest
+  if (qos == QOS_CLASS_UNSPECIFIED)
+    qos = QOS_CLASS_DEFAULT;
+  if (pthread_set_qos_class_self_np(qos, 0)) {
+    return "Failed set thread QoS class";
+  }
+  qos_changed = kind != CORES_ANY;
+  return 0;
+}
+
+/// Record the CPU in start(), stop() and the batch rows.
+/// The CPU is read before the baseline and after the counters, so the
+/// measured window does not change.
+void performance_counters_track_cpu(u32 enabled);
+void performance_counters_track_cpu(u32 enabled) {
+  track_cpu = enabled;
+  cpu_start = cpu_end = -1;
+}
+
+/// CPU the last start() ran on, -1 if not tracked.
+i32 performance_counters_cpu_start();
+i32 performance_counters_cpu_start() { return track_cpu ? cpu_start : -1; }
+
+/// CPU the last stop() ran on, -1 if not tracked.
+i32 performance_counters_cpu_end();
+i32 performance_counters_cpu_end() { return track_cpu ? cpu_end : -1; }
+
+/// Record the wall time between start() and stop(), and of every batch
+/// row, next to the counts. The time is read outside of the counters, so
+/// the measured window does not change.
+void performance_counters_track_time(u32 enabled);
+void performance_counters_track_time(u32 enabled) {
+  if (enabled && mach_timebase_info(&timebase))
+    timebase = (mach_timebase_info_data_t){1, 1};
+  track_time = enabled;
+  time_start = time_end = 0;
+}
+
+/// Wall time between the last start() and stop(), 0 if not tracked.
+u64 performance_counters_elapsed_ns();
+u64 performance_counters_elapsed_ns() {
+  return track_time ? time_ns(time_end - time_start) : 0;
+}
+
+/// Energy the process has used so far, in nanojoules, as the kernel
+/// estimates it from the power counters on Apple Silicon. Every thread of
+/// the process contributes, so subtract two readings around a region that
+/// runs while the others are idle.
+/// @return 0 if the OS doesn't report it, before macOS 13 or on Intel.
+u64 performance_counters_energy_nj();
+u64 performance_counters_energy_nj() {
+#ifdef RUSAGE_INFO_V6
+  struct rusage_info_v6 ri;
+  if (proc_pid_rusage(getpid(), RUSAGE_INFO_V6, (rusage_info_t *)&ri) == 0)
+    return ri.ri_energy_nj;
+#endif
+  return 0;
+}
+
+/// Performance level of each CPU, 0 is the fastest.
+static u8 cpu_levels[256];
+static u32 cpu_levels_count = 0;
+
+/// Performance level of `cpu`, -1 if unknown.
+/// @details The CPUs of the slowest level are numbered first, on an M1 the
+/// E-cores are 0 to 3 and the P-cores 4 to 7.
+static i32 cpu_perflevel(i32 cpu) {
+  if (!cpu_levels_count) {
+    u32 levels = performance_counters_perflevel_count();
+    u32 n = 0;
+    for (u32 level = levels; level-- > 0;) {
+      u32 cpus = performance_counters_perflevel_cpus(level);
+      for (u32 i = 0; i < cpus && n < lib_nelems(cpu_levels); i++)
+        cpu_levels[n++] = (u8)level;
+    }
+    cpu_levels_count = n;
+  }
+  if (cpu < 0 || (u32)cpu >= cpu_levels_count)
+    return -1;
+  return cpu_levels[cpu];
+}
+
+/// Performance level of `cpu`, -1 if unknown.
+i32 performance_counters_cpu_perflevel(i32 cpu);
+i32 performance_counters_cpu_perflevel(i32 cpu) { return cpu_perflevel(cpu); }
+
+// -----------------------------------------------------------------------------
+// Telemetry
+// A background thread samples the counters of all CPUs at a fixed interval
+// and pushes the deltas, summed over the CPUs, into a single-producer
+// single-consumer ring. The consumer drains it without taking a lock, so the
+// JavaScript thread never waits on the sampler. The ring does not grow: when
+// it is full new samples are dropped and counted.
+// -----------------------------------------------------------------------------
+
+/// One ring entry: the timestamp in ns, then the values in values order.
+#define TELEMETRY_STRIDE (1 + KPC_MAX_COUNTERS)
+
+typedef struct {
+  pthread_t thread;
+  atomic_bool running;
+  useconds_t interval_us;
+
+  u64 *ring;          ///< `capacity * TELEMETRY_STRIDE` values.
+  u64 capacity;       ///< Power of 2.
+  atomic_ullong head; ///< Next entry the sampler writes.
+  atomic_ullong tail; ///< Next entry the consumer reads.
+  atomic_ullong dropped;
+
+  // the configuration at start(), so a later init() can't change the
+  // layout under the sampler
+  usize ev_count;
+  usize counter_map[KPC_MAX_COUNTERS];
+  u32 cpu_count;
+  u32 cpu_stride;
+  u64 *now;
+  u64 *prev;
+} telemetry_state;
+
+static telemetry_state telemetry = {0};
+
+static void *telemetry_main(void *arg) {
+  telemetry_state *t = arg;
+  bool has_prev = false;
+  u32 prev_group = 0;
+  while (atomic_load_explicit(&t->running, memory_order_relaxed)) {
+    // configurable counters that were reprogrammed since the previous
+    // sample count two different events, those are reported as 0
+    u32 group = active_group;
+    if (kpc_get_cpu_counters(true, classes, NULL, t->now) == 0) {
+      u64 time = kperf_ticks_to_ns(mach_absolute_time());
+      if (has_prev) {
+        u64 head = atomic_load_explicit(&t->head, memory_order_relaxed);
+        u64 tail = atomic_load_explicit(&t->tail, memory_order_acquire);
+        if (head - tail == t->capacity) {
+          atomic_fetch_add_explicit(&t->dropped, 1, memory_order_relaxed);
+        } else {
+          u64 *entry = t->ring + (head & (t->capacity - 1)) * TELEMETRY_STRIDE;
+          entry[0] = time;
+          for (usize i = 0; i < t->ev_count; i++) {
+            usize idx = t->counter_map[i];
+            u64 sum = 0;
+            if (slot_group[i] >= 0 &&
+                ((u32)slot_group[i] != group || group != prev_group)) {
+              entry[1 + i] = 0;
+              continue;
+            }
+            for (u32 cpu = 0; cpu < t->cpu_count; cpu++) {
+              usize at = (usize)cpu * t->cpu_stride + idx;
+              sum += t->now[at] - t->prev[at];
+            }
+            entry[1 + i] = sum;
+          }
+          atomic_store_explicit(&t->head, head + 1, memory_order_release);
+        }
+      }
+      u64 *tmp = t->prev;
+      t->prev = t->now;
+      t->now = tmp;
+      has_prev = true;
+      prev_group = group;
+    }
+    usleep(t->interval_us);
+  }
+  return NULL;
+}
+
+/// Start sampling in the background.
+/// @param interval_ms Time between two samples.
+/// @param capacity Number of samples the ring holds, rounded up to a power
+///                 of 2.
+const char *performance_counters_telemetry_start(f64 interval_ms,
+                                                 u32 capacity);
+const char *performance_counters_telemetry_start(f64 interval_ms,
+                                                 u32 capacity) {
+  telemetry_state *t = &telemetry;
+  if (!ev_count)
+    return "Counters are not configured";
+  if (!(interval_ms > 0) || !capacity)
+    return "Invalid telemetry interval or capacity";
+  if (atomic_load(&t->running))
+    performance_counters_telemetry_stop();
+  if (!counting) {
+    const char *err = performance_counters_open();
+    if (err)
+      return err;
+  }
+
+  int ncpu = 0;
+  usize size = sizeof(ncpu);
+  if (sysctlbyname("hw.ncpu", &ncpu, &size, NULL, 0) || ncpu <= 0) {
+    return "Failed get hw.ncpu";
+  }
+  u64 cap = 1;
+  while (cap < capacity)
+    cap <<= 1;
+
+  t->cpu_count = (u32)ncpu;
+  t->cpu_stride = kpc_get_counter_count(classes);
+  usize len = (usize)t->cpu_count * t->cpu_stride;
+  t->ring = malloc(cap * TELEMETRY_STRIDE * sizeof(u64));
+  t->now = malloc(len * sizeof(u64));
+  t->prev = malloc(len * sizeof(u64));
+  if (!t->ring || !t->now || !t->prev) {
+    performance_counters_telemetry_stop();
+    return "Failed to allocate memory for telemetry";
+  }
+  t->capacity = cap;
+  t->interval_us = (useconds_t)(interval_ms * 1000);
+  t->ev_count = ev_count;
+  memcpy(t->counter_map, counter_map, sizeof(counter_map));
+  atomic_store(&t->head, 0);
+  atomic_store(&t->tail, 0);
+  atomic_store(&t->dropped, 0);
+
+  atomic_store(&t->running, true);
+  if (pthread_create(&t->thread, NULL, telemetry_main, t)) {
+    atomic_store(&t->running, false);
+    performance_counters_telemetry_stop();
+    return "Failed to start the telemetry thread";
+  }
+  return 0;
+}
+
+/// Stop the sampler and free the ring. Samples not drained are lost.
+const char *performance_counters_telemetry_stop();
+const char *performance_counters_telemetry_stop() {
+  telemetry_state *t = &telemetry;
+  if (atomic_exchange(&t->running, false))
+    pthread_join(t->thread, NULL);
+  free(t->ring);
+  free(t->now);
+  free(t->prev);
+  t->ring = t->now = t->prev = NULL;
+  t->capacity = 0;
+  return 0;
+}
+
+/// Number of values per drained sample: the timestamp, then one per event.
+u32 performance_counters_telemetry_stride();
+u32 performance_counters_telemetry_stride() {
+  return (u32)(1 + (telemetry.ring ? telemetry.ev_count : ev_count));
+}
+
+/// Move up to `max` samples out of the ring, oldest first.
+/// @param out Receives `max * performance_counters_telemetry_stride()` values.
+/// @return The number of samples written.
+u32 performance_counters_telemetry_drain(u64 *out, u32 max);
+u32 performance_counters_telemetry_drain(u64 *out, u32 max) {
+  telemetry_state *t = &telemetry;
+  if (!t->ring)
+    return 0;
+  u64 tail = atomic_load_explicit(&t->tail, memory_order_relaxed);
+  u64 head = atomic_load_explicit(&t->head, memory_order_acquire);
+  u64 n = head - tail < max ? head - tail : max;
+  usize stride = 1 + t->ev_count;
+  for (u64 i = 0; i < n; i++) {
+    const u64 *entry =
+        t->ring + ((tail + i) & (t->capacity - 1)) * TELEMETRY_STRIDE;
+    memcpy(out + i * stride, entry, stride * sizeof(u64));
+  }
+  atomic_store_explicit(&t->tail, tail + n, memory_order_release);
+  return (u32)n;
+}
+
+/// Samples dropped because the ring was full.
+u64 performance_counters_telemetry_dropped();
+u64 performance_counters_telemetry_dropped() {
+  return atomic_load(&telemetry.dropped);
+}
+
+// -----------------------------------------------------------------------------
+// Results
+// The result blocks and batches in counters.results.h, and the entry points
+// that write them.
+// -----------------------------------------------------------------------------
+
+#include "counters.results.h"
+
+/// Mirror the values of `r` as f64 and update the header.
+static inline void result_publish(result_block *r, u64 flags) {
+  result_mirror(r, 2);
+  if (group_count > 1)
+    flags |= RESULT_MULTIPLEXED;
+  r->flags = RESULT_VALID | flags;
+  r->group = active_group;
+  // start_inline() and stop_inline() don't read the CPU
+  bool cpus = track_cpu && !(flags & RESULT_INLINE);
+  r->cpu_start = cpus ? cpu_start : -1;
+  r->cpu_end = cpus ? cpu_end : -1;
+  r->elapsed_ns = track_time ? time_ns(time_end - time_start) : 0;
+  r->sequence++;
+}
+
+static int inline_state;
+i32 performance_counters_stop_inline(u64 *values);
+
+/// Like performance_counters_stop(), writing into a result block.
+i32 performance_counters_stop_result(result_block *r);
+i32 performance_counters_stop_result(result_block *r) {
+  i32 status = performance_counters_stop(r->values);
+  if (status)
+    return status;
+  result_publish(r, 0);
+  return 0;
+}
+
+/// Like performance_counters_stop_inline(), writing into a result block.
+i32 performance_counters_stop_inline_result(result_block *r);
+i32 performance_counters_stop_inline_result(result_block *r) {
+  i32 status = performance_counters_stop_inline(r->values);
+  if (status)
+    return status;
+  result_publish(r, inline_state > 0 ? RESULT_INLINE : 0);
+  return 0;
+}
+
+/// Like performance_counters_stop(), appending the deltas to the batch.
+i32 performance_counters_batch_stop();
+i32 performance_counters_batch_stop() {
+  int ret = 0;
+
+  // get counters after
+  if ((ret = kpc_get_thread_counters(0, KPC_MAX_COUNTERS, counters_1))) {
+    return status_error("Failed get thread counters after");
+  }
+  u64 now = track_time ? time_now() : 0;
+  if (batch_count == batch_capacity) {
+    return status_error("Batch is full");
+  }
+  batch_cpus[2 * batch_count] = track_cpu ? (i16)cpu_start : -1;
+  batch_cpus[2 * batch_count + 1] = track_cpu ? (i16)current_cpu() : -1;
+
+  u64 *row = batch_samples + batch_count * ev_count;
+  for (usize i = 0; i < ev_count; i++) {
+    usize idx = counter_map[i];
+    u64 raw = slot_counted(i) ? counters_1[idx] - counters_0[idx] : 0;
+    row[i] = !batch_corrected ? raw : raw > overhead[i] ? raw - overhead[i] : 0;
+  }
+  batch_groups[batch_count] = (u8)active_group;
+  batch_arms[batch_count] = batch_arm;
+  batch_elapsed[batch_count] = track_time ? time_ns(now - time_start) : 0;
+  batch_count++;
+
+  return 0;
+}
+
+// -----------------------------------------------------------------------------
+// Regions
+// Named regions nest on a per-thread stack. Every enter and exit reads the
+// counters once; exit charges the delta to the region's node in a per-thread
+// call tree, inclusive of its children and exclusive of them. Names are
+// interned once into ids, so the hot path only passes integers.
+// -----------------------------------------------------------------------------
+
+#define REGION_DEPTH_MAX 64
+
+/// Interned region names, shared by all threads.
+static char **region_names = NULL;
+static u32 region_name_count = 0;
+static u32 region_name_capacity = 0;
+static pthread_mutex_t region_names_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/// A region in a call path. Node 0 is the root.
+typedef struct {
+  u32 region;
+  u32 parent;
+  u32 first_child; ///< 0 if none, the root is never a child.
+  u32 next_sibling;
+  u64 calls;
+  u64 inclusive[KPC_MAX_COUNTERS]; ///< values order
+  u64 exclusive[KPC_MAX_COUNTERS];
+} region_node;
+
+typedef struct {
+  u32 node;
+  u64 counters_0[KPC_MAX_COUNTERS]; ///< kpc order
+  u64 children[KPC_MAX_COUNTERS];   ///< values order, charged by children
+} region_frame;
+
+static _Thread_local region_node *region_nodes = NULL;
+static _Thread_local u32 region_node_count = 0;
+static _Thread_local u32 region_node_capacity = 0;
+static _Thread_local region_frame region_stack[REGION_DEPTH_MAX];
+static _Thread_local u32 region_depth = 0;
+
+/// Id of a region name, creating it on the first call.
+/// @return The id, or UINT32_MAX if out of memory.
+u32 performance_counters_region_intern(const char *name);
+u32 performance_counters_region_intern(const char *name) {
+  u32 id = UINT32_MAX;
+  pthread_mutex_lock(&region_names_lock);
+  for (u32 i = 0; i < region_name_count; i++) {
+    if (strcmp(region_names[i], name) == 0) {
+      id = i;
+      goto done;
+    }
+  }
+  if (region_name_count == region_name_capacity) {
+    u32 capacity = region_name_capacity ? region_name_capacity * 2 : 64;
+    char **names = realloc(region_names, capacity * sizeof(char *));
+    if (!names)
+      goto done;
+    region_names = names;
+    region_name_capacity = capacity;
+  }
+  char *copy = strdup(name);
+  if (!copy)
+    goto done;
+  region_names[region_name_count] = copy;
+  id = region_name_count++;
+done:
+  pthread_mutex_unlock(&region_names_lock);
+  return id;
+}
+
+/// Name of an interned region.
+const char *performance_counters_region_name(u32 id);
+const char *performance_counters_region_name(u32 id) {
+  pthread_mutex_lock(&region_names_lock);
+  const char *name = id < region_name_count ? region_names[id] : 0;
+  pthread_mutex_unlock(&region_names_lock);
+  return name;
+}
+
+/// Child of `parent` for `region`, created if needed.
+/// @return The node index, 0 if out of memory.
+static u32 region_child(u32 parent, u32 region) {
+  for (u32 i = region_nodes[parent].first_child; i;
+       i = region_nodes[i].next_sibling) {
+    if (region_nodes[i].region == region)
+      return i;
+  }
+  if (region_node_count == region_node_capacity) {
+    u32 capacity = region_node_capacity * 2;
+    region_node *nodes = realloc(region_nodes, capacity * sizeof(region_node));
+    if (!nodes)
+      return 0;
+    region_nodes = nodes;
+    region_node_capacity = capacity;
+  }
+  u32 idx = region_node_count++;
+  region_node *node = region_nodes + idx;
+  memset(node, 0, sizeof(region_node));
+  node->region = region;
+  node->parent = parent;
+  node->next_sibling = region_nodes[parent].first_child;
+  region_nodes[parent].first_child = idx;
+  return idx;
+}
+
+/// Forget the calling thread's tree and open regions.
+void performance_counters_region_reset();
+void performance_counters_region_reset() {
+  region_depth = 0;
+  region_node_count = region_nodes ? 1 : 0;
+  if (region_nodes)
+    memset(region_nodes, 0, sizeof(region_node));
+}
+
+/// Open region `id` inside the innermost open region of this thread.
+i32 performance_counters_region_enter(u32 id);
+i32 performance_counters_region_enter(u32 id) {
+  if (region_depth == REGION_DEPTH_MAX)
+    return status_error("Regions are nested too deeply");
+  if (!counting) {
+    const char *err = performance_counters_open();
+    if (err)
+      return status_error(err);
+  }
+  if (!region_nodes) {
+    region_nodes = calloc(64, sizeof(region_node));
+    if (!region_nodes)
+      return status_error("Failed to allocate memory for regions");
+    region_node_capacity = 64;
+    region_node_count = 1;
+  }
+
+  u32 parent = region_depth ? region_stack[region_depth - 1].node : 0;
+  u32 node = region_child(parent, id);
+  if (!node)
+    return status_error("Failed to allocate memory for regions");
+
+  region_frame *frame = region_stack + region_depth;
+  frame->node = node;
+  memset(frame->children, 0, ev_count * sizeof(u64));
+  // the read is last, so the bookkeeping above is charged to the parent
+  if (kpc_get_thread_counters(0, KPC_MAX_COUNTERS, frame->counters_0)) {
+    return status_error("Failed get thread counters");
+  }
+  region_depth++;
+  return 0;
+}
+
+/// Close the innermost open region of this thread.
+i32 performance_counters_region_exit();
+i32 performance_counters_region_exit() {
+  u64 now[KPC_MAX_COUNTERS];
+  // the read is first, so the bookkeeping below is charged to the parent
+  if (kpc_get_thread_counters(0, KPC_MAX_COUNTERS, now)) {
+    return status_error("Failed get thread counters");
+  }
+  if (!region_depth)
+    return status_error("No open region");
+
+  region_frame *frame = region_stack + --region_depth;
+  region_frame *parent = region_depth ? frame - 1 : NULL;
+  region_node *node = region_nodes + frame->node;
+  node->calls++;
+  for (usize i = 0; i < ev_count; i++) {
+    usize idx = counter_map[i];
+    u64 delta = slot_counted(i) ? now[idx] - frame->counters_0[idx] : 0;
+    node->inclusive[i] += delta;
+    node->exclusive[i] += delta > frame->children[i]
+                              ? delta - frame->children[i]
+                              : 0;
+    if (parent)
+      parent->children[i] += delta;
+  }
+  return 0;
+}
+
+/// Number of regions open on this thread.
+u32 performance_counters_region_depth();
+u32 performance_counters_region_depth() { return region_depth; }
+
+/// Number of nodes in this thread's tree, including the root at 0.
+u32 performance_counters_region_node_count();
+u32 performance_counters_region_node_count() { return region_node_count; }
+
+/// Region id of the i-th node.
+u32 performance_counters_region_node_region(u32 i);
+u32 performance_counters_region_node_region(u32 i) {
+  return i < region_node_count ? region_nodes[i].region : 0;
+}
+
+/// Parent node of the i-th node, 0 for top level regions.
+u32 performance_counters_region_node_parent(u32 i);
+u32 performance_counters_region_node_parent(u32 i) {
+  return i < region_node_count ? region_nodes[i].parent : 0;
+}
+
+/// Number of times the i-th node was exited.
+u64 performance_counters_region_node_calls(u32 i);
+u64 performance_counters_region_node_calls(u32 i) {
+  return i < region_node_count ? region_nodes[i].calls : 0;
+}
+
+/// Totals of the i-th node.
+/// @param values Receives `ev_count` inclusive, then `ev_count` exclusive
+///               values.
+void performance_counters_region_node_values(u32 i, u64 *values);
+void performance_counters_region_node_values(u32 i, u64 *values) {
+  if (i >= region_node_count)
+    return;
+  memcpy(values, region_nodes[i].inclusive, ev_count * sizeof(u64));
+  memcpy(values + ev_count, region_nodes[i].exclusive, ev_count * sizeof(u64));
+}
+
+// -----------------------------------------------------------------------------
+// Inline counter reads
+// On Apple Silicon the fixed counters (cycles, instructions) are the PMC0 and
+// PMC1 system registers. When the kernel lets EL0 read them, a sample costs
+// a couple of instructions instead of a kpc_get_thread_counters() syscall.
+// The registers count for the current core, not the current thread, so the
+// values are only meaningful if the thread is not preempted or migrated
+// between start and stop. If EL0 access is disabled the read raises SIGILL,
+// performance_counters_inline_available() probes for that once and the
+// inline entry points fall back to the syscall path.
+// -----------------------------------------------------------------------------
+
+#if defined(__arm64__)
+
+#define INLINE_COUNTER_COUNT 2
+
+static inline __attribute__((always_inline)) void
+inline_counters_read(u64 *buf) {
+  u64 cycles, instructions;
+  __asm__ __volatile__("isb\n"
+                       "mrs %0, S3_2_C15_C0_0\n"
+                       "mrs %1, S3_2_C15_C1_0\n"
+                       : "=r"(cycles), "=r"(instructions)
+                       :
+                       : "memory");
+  buf[0] = cycles;
+  buf[1] = instructions;
+}
+
+static sigjmp_buf inline_probe_env;
+
+static void inline_probe_handler(int sig) {
+  (void)sig;
+  siglongjmp(inline_probe_env, 1);
+}
+
+/// Try to read the registers, catching SIGILL.
+static bool inline_probe(void) {
+  struct sigaction sa, old_ill, old_segv;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = inline_probe_handler;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGILL, &sa, &old_ill);
+  sigaction(SIGSEGV, &sa, &old_segv);
+
+  volatile bool ok = false;
+  if (sigsetjmp(inline_probe_env, 1) == 0) {
+    u64 before[INLINE_COUNTER_COUNT], after[INLINE_COUNTER_COUNT];
+    inline_counters_read(before);
+    for (volatile u32 i = 0; i < 1000; i++) {
+    }
+    inline_counters_read(after);
+    // registers that read as constant are not counting for us
+    ok = after[0] != before[0] && after[1] != before[1];
+  }
+
+  sigaction(SIGILL, &old_ill, NULL);
+  sigaction(SIGSEGV, &old_segv, NULL);
+  return ok;
+}
+
+#else
+
+#define INLINE_COUNTER_COUNT 1
+
+static inline void inline_counters_read(u64 *buf) { buf[0] = 0; }
+
+static bool inline_probe(void) { return false; }
+
+#endif
+
+/// 0: not probed yet, 1: available, -1: unavailable.
+static int inline_state = 0;
+
+static _Thread_local u64 inline_counters_0[INLINE_COUNTER_COUNT] = {0};
+
+/// Whether the fixed counters can be read without a syscall.
+/// Enables counting if needed, since the probe requires running counters.
+u32 performance_counters_inline_available();
+u32 performance_counters_inline_available() {
+  if (inline_state == 0) {
+    if (!counting && performance_counters_open()) {
+      return 0;
+    }
+    inline_state = inline_probe() ? 1 : -1;
+  }
+  return inline_state > 0;
+}
+
+/// Bitmask of the values buffer slots performance_counters_stop_inline()
+/// fills, i.e. the events on a fixed counter.
+u32 performance_counters_inline_mask();
+u32 performance_counters_inline_mask() {
+  u32 mask = 0;
+  for (usize i = 0; i < ev_count; i++) {
+    if (counter_map[i] < INLINE_COUNTER_COUNT &&
+        ev_arr[i] && ev_arr[i]->is_fixed)
+      mask |= 1u << i;
+  }
+  return mask;
+}
+
+/// Like performance_counters_start(), reading the counters inline if
+/// performance_counters_inline_available() says so.
+i32 performance_counters_start_inline();
+i32 performance_counters_start_inline() {
+  if (inline_state <= 0) {
+    return performance_counters_start();
+  }
+  if (track_time)
+    time_start = time_now();
+  inline_counters_read(inline_counters_0);
+  return 0;
+}
+
+/// Like performance_counters_stop(), reading the counters inline if
+/// performance_counters_inline_available() says so. Only the slots in
+/// performance_counters_inline_mask() are counted then, the rest are 0.
+/// `values` has the same layout as for performance_counters_stop().
+i32 performance_counters_stop_inline(u64 *values);
+i32 performance_counters_stop_inline(u64 *values) {
+  if (inline_state <= 0) {
+    return performance_counters_stop(values);
+  }
+  u64 inline_counters_1[INLINE_COUNTER_COUNT];
+  inline_counters_read(inline_counters_1);
+  if (track_time)
+    time_end = time_now();
+
+  for (usize i = 0; i < ev_count; i++) {
+    usize idx = counter_map[i];
+    values[i] = idx < INLINE_COUNTER_COUNT && ev_arr[i]->is_fixed
+                    ? inline_counters_1[idx] - inline_counters_0[idx]
+                    : 0;
+  }
+  subtract_overhead(values, inline_overhead);
+  return 0;
+}
+
+int main(int argc, const char *argv[]) {
+//   int ret = 0;
+//   // code to be measured
+//   profile_func();
+
+//   // result
+//   printf("counters value:\n");
+
+//   // TODO: free memory
+  return 0;
+}
+
+// -----------------------------------------------------------------------------
+// Trace files
+// A profile can stream every sample to a file for offline analysis. The file
+// is column-oriented so a reader can map it and use each column as a typed
+// array in place:
+//
+//   trace_header
+//   trace_event[event_count]
+//   event names, NUL-terminated, padded to 8 bytes
+//   blocks until the end of the file:
+//     trace_block
+//     u64 timestamps[rows]                    mach ticks
+//     u64 counters[counter_count][rows]       thread counts, one column each
+//     u32 tids[rows], padded to 8 bytes
+//
+// Everything is little-endian and every u64 column is 8-byte aligned.
+// -----------------------------------------------------------------------------
+
+#define TRACE_MAGIC "KPCTRACE"
+#define TRACE_VERSION 1
+
+/// Rows buffered before a block is written.
+#define TRACE_BLOCK_ROWS 4096
+
+typedef struct {
+  char magic[8];
+  u32 version;
+  u32 header_size;    ///< Offset of the first block.
+  u32 event_count;
+  u32 counter_count;  ///< Counter columns per block.
+  u32 block_rows;     ///< Most rows in one block.
+  i32 pid;            ///< Profiled process, -1 for all.
+  u64 tick_frequency; ///< Timestamp ticks per second.
+  u64 period_ticks;   ///< PET period.
+  u64 rows;           ///< Rows in all blocks, 0 if the file was not closed.
+  u64 reserved;
+} trace_header;
+
+typedef struct {
+  u32 counter; ///< Counter column of the event.
+  u32 id;      ///< Event number, and umask << 8.
+  u32 flags;   ///< 1 if the event is on a fixed counter.
+  u32 name;    ///< Offset of the name from the start of the file.
+} trace_event;
+
+typedef struct {
+  u32 rows;
+  u32 size; ///< Bytes including this header, the offset of the next block.
+} trace_block;
+
+typedef struct {
+  FILE *file;
+  u32 counter_count;
+  u32 rows;
+  u64 total_rows;
+  u64 timestamps[TRACE_BLOCK_ROWS];
+  u32 tids[TRACE_BLOCK_ROWS];
+  /// `counter_count` columns of `TRACE_BLOCK_ROWS` values.
+  u64 *counters;
+  bool failed;
+} trace_writer;
+
+static void trace_write(trace_writer *tw, const void *data, usize size) {
+  if (size && fwrite(data, 1, size, tw->file) != size)
+    tw->failed = true;
+}
+
+/// Pad `size` written bytes to a multiple of 8.
+static void trace_pad(trace_writer *tw, usize size) {
+  static const u8 zeros[8] = {0};
+  trace_write(tw, zeros, (8 - (size & 7)) & 7);
+}
+
+/// Create a trace file and write its header for the configured events.
+/// @return NULL on success, error message otherwise.
+static const char *trace_open(trace_writer *tw, const char *path,
+                              u32 counter_count, i32 pid, u64 period_ticks) {
+  memset(tw, 0, sizeof(trace_writer));
+  if (!path)
+    return "No output path";
+  tw->counter_count = counter_count;
+  tw->counters = malloc((usize)counter_count * TRACE_BLOCK_ROWS * sizeof(u64));
+  if (!tw->counters)
+    return "Failed to allocate memory for trace";
+  tw->file = fopen(path, "wb");
+  if (!tw->file) {
+    free(tw->counters);
+    tw->counters = NULL;
+    return "Failed to open output file";
+  }
+
+  usize names = 0;
+  for (usize e = 0; e < ev_count; e++)
+    names += strlen(ev_arr[e]->name) + 1;
+  usize events_end = sizeof(trace_header) + ev_count * sizeof(trace_event);
+
+  trace_header header = {0};
+  memcpy(header.magic, TRACE_MAGIC, 8);
+  header.version = TRACE_VERSION;
+  header.header_size = (u32)((events_end + names + 7) & ~(usize)7);
+  header.event_count = (u32)ev_count;
+  header.counter_count = counter_count;
+  header.block_rows = TRACE_BLOCK_ROWS;
+  header.pid = pid;
+  header.tick_frequency = kperf_tick_frequency();
+  header.period_ticks = period_ticks;
+  trace_write(tw, &header, sizeof(header));
+
+  usize name = events_end;
+  for (usize e = 0; e < ev_count; e++) {
+    kpep_event *ev = ev_arr[e];
+    trace_event event = {
+        .counter = (u32)counter_map[e],
+        .id = (u32)ev->number | (u32)ev->umask << 8,
+        .flags = ev->is_fixed ? 1 : 0,
+        .name = (u32)name,
+    };
+    trace_write(tw, &event, sizeof(event));
+    name += strlen(ev->name) + 1;
+  }
+  for (usize e = 0; e < ev_count; e++)
+    trace_write(tw, ev_arr[e]->name, strlen(ev_arr[e]->name) + 1);
+  trace_pad(tw, names);
+  return 0;
+}
+
+/// Write the buffered rows as one block.
+static void trace_flush(trace_writer *tw) {
+  u32 rows = tw->rows;
+  if (!rows)
+    return;
+  usize tids = rows * sizeof(u32);
+  trace_block block = {
+      .rows = rows,
+      .size = (u32)(sizeof(trace_block) +
+                    rows * sizeof(u64) * (1 + tw->counter_count) +
+                    ((tids + 7) & ~(usize)7)),
+  };
+  trace_write(tw, &block, sizeof(block));
+  trace_write(tw, tw->timestamps, rows * sizeof(u64));
+  for (u32 c = 0; c < tw->counter_count; c++)
+    trace_write(tw, tw->counters + c * TRACE_BLOCK_ROWS, rows * sizeof(u64));
+  trace_write(tw, tw->tids, tids);
+  trace_pad(tw, tids);
+  tw->total_rows += rows;
+  tw->rows = 0;
+}
+
+static void trace_append(trace_writer *tw, u64 timestamp, u32 tid,
+                         const u64 *counters) {
+  u32 r = tw->rows++;
+  tw->timestamps[r] = timestamp;
+  tw->tids[r] = tid;
+  for (u32 c = 0; c < tw->counter_count; c++)
+    tw->counters[c * TRACE_BLOCK_ROWS + r] = counters[c];
+  if (tw->rows == TRACE_BLOCK_ROWS)
+    trace_flush(tw);
+}
+
+/// Write the last block and the row count, and close the file.
+/// @return Whether everything was written.
+static bool trace_close(trace_writer *tw) {
+  if (!tw->file)
+    return false;
+  trace_flush(tw);
+  if (fseek(tw->file, offsetof(trace_header, rows), SEEK_SET) == 0)
+    trace_write(tw, &tw->total_rows, sizeof(u64));
+  else
+    tw->failed = true;
+  if (fclose(tw->file))
+    tw->failed = true;
+  free(tw->counters);
+  tw->file = NULL;
+  tw->counters = NULL;
+  return !tw->failed;
+}
+
+// -----------------------------------------------------------------------------
+// Demo 2: profile a select process
+// kperf fires a PET (Profile Every Thread) timer every `period`, which logs
+// the counters of every thread of the target process as kdebug
+// PERF_KPC_DATA_THREAD records. The records are aggregated per thread.
+// Callstacks can instead be sampled on counter overflow: kpc fires a PMI
+// every N events of one counter, which logs a PERF_KPC_PMI record and runs
+// the same kperf action.
+// -----------------------------------------------------------------------------
+
+static double get_timestamp(void) {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return (double)now.tv_sec + (double)now.tv_usec / (1000.0 * 1000.0);
+}
+
+// debugid sub-classes and code from xnu source
+#define PERF_CALLSTACK (2)
+#define PERF_KPC (6)
+#define PERF_KPC_DATA_THREAD (8)
+#define PERF_KPC_PMI (11)
+
+// PERF_CALLSTACK codes, a header (arg2: frame count) then 4 frames per record
+#define PERF_CS_KDATA (3)
+#define PERF_CS_UDATA (4)
+#define PERF_CS_KHDR (5)
+#define PERF_CS_UHDR (6)
+
+/// Per thread data, the counters live in `profile_state.counters`.
+typedef struct {
+  u32 tid;
+  u32 samples;
+  u64 timestamp_0;
+  u64 timestamp_1;
+} kpc_thread_data;
+
+/// Number of kd_buf read from the kernel at a time.
+#define PROFILE_READ_BUFS 16384
+
+/// Folds the PERF_KPC_DATA_THREAD stream into per thread data as it is
+/// read. A sample with more than 4 counters is split over several kd_buf
+/// (one DBG_FUNC_START, then continuations from the same thread), the
+/// partial sample is kept here so it can span two reads.
+typedef struct {
+  u32 counter_count;
+
+  // sample being assembled
+  bool pending;
+  u32 pending_tid;
+  u32 pending_ci;
+  u64 pending_timestamp;
+  u64 pending_counters[KPC_MAX_COUNTERS];
+
+  /// Threads in the order they were first seen.
+  kpc_thread_data *threads;
+  /// `3 * counter_count` values per thread: the first sample, the last
+  /// sample, and the sum of the deltas between consecutive samples.
+  u64 *counters;
+  usize thread_count;
+  usize thread_capacity;
+
+  /// Open addressing tid -> thread index + 1 (0 is empty), linear probing.
+  u32 *table;
+  usize table_mask;
+
+  /// Sorted tids of the threads that existed when tracing started, NULL
+  /// when they could not be listed. A thread not in here was created during
+  /// the profile; its counters started at 0 rather than at its first sample.
+  u32 *existing;
+  usize existing_count;
+
+  bool out_of_memory;
+
+  /// Samples that were cut off and could not be used.
+  u64 dropped;
+  /// Times the kernel trace buffer filled up and lost records.
+  u32 overflows;
+
+  /// Callstack aggregation, NULL when only counting.
+  struct stack_sampler *stacks;
+  /// Receives every sample, or NULL.
+  trace_writer *trace;
+} profile_state;
+
+static void stacks_on_pmc(profile_state *st, i64 i, const u64 *cur,
+                          const u64 *last);
+static void stacks_on_pmi(profile_state *st, const kd_buf *buf);
+static void stacks_feed(profile_state *st, const kd_buf *buf, u32 code);
+
+/// Result of the last performance_counters_profile_process().
+static kpc_thread_data *profile_threads = NULL;
+static u64 *profile_values = NULL; ///< `profile_counter_count` per thread
+static usize profile_thread_count = 0;
+static u32 profile_counter_count = 0;
+static u64 profile_sum[KPC_MAX_COUNTERS] = {0};
+static u64 profile_dropped = 0;
+static u32 profile_overflows = 0;
+
+static inline usize profile_hash(u32 tid) {
+  return (usize)((tid * 2654435761u) ^ (tid >> 16));
+}
+
+/// Rebuild the tid table with `size` (a power of 2) buckets.
+static bool profile_rehash(profile_state *st, usize size) {
+  u32 *table = calloc(size, sizeof(u32));
+  if (!table)
+    return false;
+  for (usize i = 0; i < st->thread_count; i++) {
+    usize h = profile_hash(st->threads[i].tid) & (size - 1);
+    while (table[h])
+      h = (h + 1) & (size - 1);
+    table[h] = (u32)(i + 1);
+  }
+  free(st->table);
+  st->table = table;
+  st->table_mask = size - 1;
+  return true;
+}
+
+/// Find the data of a thread.
+/// @return The thread index, or -1 if it was not seen yet.
+static i64 profile_find(const profile_state *st, u32 tid) {
+  usize h = profile_hash(tid) & st->table_mask;
+  for (u32 slot; (slot = st->table[h]); h = (h + 1) & st->table_mask) {
+    if (st->threads[slot - 1].tid == tid)
+      return slot - 1;
+  }
+  return -1;
+}
+
+/// Find or add the data of a thread.
+/// @return The thread index, or -1 if out of memory.
+static i64 profile_thread(profile_state *st, u32 tid) {
+  i64 found = profile_find(st, tid);
+  if (found >= 0)
+    return found;
+  usize h = profile_hash(tid) & st->table_mask;
+  while (st->table[h])
+    h = (h + 1) & st->table_mask;
+
+  if (st->thread_capacity == st->thread_count) {
+    usize new_capacity = st->thread_capacity * 2;
+    usize stride = 3 * st->counter_count;
+    kpc_thread_data *new_data =
+        realloc(st->threads, new_capacity * sizeof(kpc_thread_data));
+    if (new_data)
+      st->threads = new_data;
+    u64 *new_counters =
+        realloc(st->counters, new_capacity * stride * sizeof(u64));
+    if (new_counters)
+      st->counters = new_counters;
+    if (!new_data || !new_counters) {
+      st->out_of_memory = true;
+      return -1;
+    }
+    st->thread_capacity = new_capacity;
+  }
+
+  usize i = st->thread_count++;
+  kpc_thread_data *data = st->threads + i;
+  memset(data, 0, sizeof(kpc_thread_data));
+  data->tid = tid;
+
+  // keep the load factor at or below 1/2
+  if (st->thread_count * 2 > st->table_mask + 1) {
+    if (!profile_rehash(st, (st->table_mask + 1) * 2)) {
+      st->out_of_memory = true;
+      st->thread_count--;
+      return -1;
+    }
+  } else {
+    st->table[h] = (u32)(i + 1);
+  }
+  return (i64)i;
+}
+
+/// Allocate the thread storage.
+static bool profile_state_init(profile_state *st, u32 counter_count) {
+  memset(st, 0, sizeof(profile_state));
+  st->counter_count = counter_count;
+  st->thread_capacity = 64;
+  st->threads = malloc(st->thread_capacity * sizeof(kpc_thread_data));
+  st->counters =
+      malloc(st->thread_capacity * 3 * counter_count * sizeof(u64));
+  return st->threads && st->counters && profile_rehash(st, 128);
+}
+
+static void profile_state_free(profile_state *st) {
+  free(st->threads);
+  free(st->counters);
+  free(st->table);
+  free(st->existing);
+  st->threads = NULL;
+  st->counters = NULL;
+  st->table = NULL;
+  st->existing = NULL;
+}
+
+static int profile_tid_cmp(const void *a, const void *b) {
+  u32 x = *(const u32 *)a, y = *(const u32 *)b;
+  return (x > y) - (x < y);
+}
+
+/// Remember the threads `pid` has right now, see `profile_state.existing`.
+/// Leaves `existing` NULL when they can't be listed (or pid is -1), then
+/// only threads sampled at least twice are kept.
+static void profile_list_threads(profile_state *st, i32 pid) {
+  if (pid < 0)
+    return;
+  u64 *ids = NULL;
+  int bytes = 0;
+  // the process may start threads meanwhile, retry with room to spare
+  for (usize capacity = 256; capacity <= (1u << 20); capacity *= 4) {
+    free(ids);
+    ids = malloc(capacity * sizeof(u64));
+    if (!ids)
+      return;
+    bytes = proc_pidinfo(pid, PROC_PIDLISTTHREADIDS, 0, ids,
+                         (int)(capacity * sizeof(u64)));
+    if (bytes <= 0 || (usize)bytes < capacity * sizeof(u64))
+      break;
+  }
+  usize count = bytes > 0 ? (usize)bytes / sizeof(u64) : 0;
+  u32 *tids = count ? malloc(count * sizeof(u32)) : NULL;
+  if (tids) {
+    // records carry the tid truncated to 32 bits, see profile_feed()
+    for (usize i = 0; i < count; i++)
+      tids[i] = (u32)ids[i];
+    qsort(tids, count, sizeof(u32), profile_tid_cmp);
+    st->existing = tids;
+    st->existing_count = count;
+  }
+  free(ids);
+}
+
+/// Whether a thread was created after tracing started.
+static bool profile_thread_created(const profile_state *st, u32 tid) {
+  if (!st->existing)
+    return false;
+  return !bsearch(&tid, st->existing, st->existing_count, sizeof(u32),
+                  profile_tid_cmp);
+}
+
+/// Fold the assembled sample into its thread's data.
+static void profile_commit(profile_state *st) {
+  st->pending = false;
+  if (st->trace)
+    trace_append(st->trace, st->pending_timestamp, st->pending_tid,
+                 st->pending_counters);
+  i64 i = profile_thread(st, st->pending_tid);
+  if (i < 0)
+    return;
+  kpc_thread_data *data = st->threads + i;
+  usize cc = st->counter_count;
+  u64 *first = st->counters + i * 3 * cc;
+  u64 *last = first + cc;
+  u64 *sum = last + cc;
+  const u64 *cur = st->pending_counters;
+
+  if (data->samples == 0) {
+    data->timestamp_0 = st->pending_timestamp;
+    memcpy(first, cur, cc * sizeof(u64));
+    memset(sum, 0, cc * sizeof(u64));
+  } else {
+    for (usize c = 0; c < cc; c++) {
+      sum[c] += cur[c] - last[c];
+    }
+    if (st->stacks)
+      stacks_on_pmc(st, i, cur, last);
+  }
+  data->timestamp_1 = st->pending_timestamp;
+  memcpy(last, cur, cc * sizeof(u64));
+  data->samples++;
+}
+
+/// Feed one trace record.
+static void profile_feed(profile_state *st, const kd_buf *buf) {
+  u32 debugid = buf->debugid;
+  u32 cls = KDBG_EXTRACT_CLASS(debugid);
+  u32 subcls = KDBG_EXTRACT_SUBCLASS(debugid);
+  u32 code = KDBG_EXTRACT_CODE(debugid);
+
+  // keep only thread PMC data and callstacks
+  if (cls != DBG_PERF)
+    return;
+  if (subcls == PERF_CALLSTACK && st->stacks) {
+    stacks_feed(st, buf, code);
+    return;
+  }
+  if (subcls == PERF_KPC && code == PERF_KPC_PMI && st->stacks) {
+    stacks_on_pmi(st, buf);
+    return;
+  }
+  if (subcls != PERF_KPC)
+    return;
+  if (code != PERF_KPC_DATA_THREAD)
+    return;
+
+  u32 func = debugid & KDBG_FUNC_MASK;
+  u32 tid = (u32)buf->arg5;
+  if (func == DBG_FUNC_START) {
+    if (st->pending)
+      st->dropped++; // not enough counters, truncated
+    st->pending = !!tid;
+    st->pending_tid = tid;
+    st->pending_ci = 0;
+    st->pending_timestamp = buf->timestamp;
+  } else if (!st->pending || tid != st->pending_tid) {
+    // continuation of a sample we did not see the start of
+    if (st->pending)
+      st->dropped++;
+    st->pending = false;
+    return;
+  }
+  if (!st->pending)
+    return;
+
+  // read one counter log
+  // counter count larger than 4
+  // values are split into multiple buffer entities
+  const u64 args[4] = {buf->arg1, buf->arg2, buf->arg3, buf->arg4};
+  for (u32 i = 0; i < 4 && st->pending_ci < st->counter_count; i++) {
+    st->pending_counters[st->pending_ci++] = args[i];
+  }
+  if (st->pending_ci == st->counter_count)
+    profile_commit(st);
+}
+
+/// Stop sampling and tracing, and reset kperf/kdebug.
+/// @param pmi Whether counter periods were set, they are cleared again.
+static void profile_teardown(bool close_counters, bool pmi) {
+  // stop tracing
+  kdebug_trace_enable(0);
+  kdebug_reset();
+  kperf_sample_set(0);
+  kperf_lightweight_pet_set(0);
+  if (pmi) {
+    u64 periods[KPC_MAX_COUNTERS] = {0};
+    u32 actionids[KPC_MAX_COUNTERS] = {0};
+    kpc_set_actionid(classes, actionids);
+    kpc_set_period(classes, periods);
+  }
+  kperf_reset();
+
+  // stop counting, unless a session was already counting
+  if (close_counters)
+    performance_counters_close();
+}
+
+/// Sample every thread of a process with the events configured by
+/// performance_counters_init(), folding the records into `st`.
+/// Blocks for `duration_ms`. Records are folded as they are read, so memory
+/// only grows with the number of threads, not with the profile length.
+/// kperf and kdebug are reset when this returns, even on error.
+/// @param samplers What to sample, at least `KPERF_SAMPLER_PMC_THREAD`, or
+///                 a stack sampler when sampling on overflow.
+/// @param pmi_counter Counter whose overflow triggers the samples.
+/// @param pmi_period Events of `pmi_counter` between two samples, 0 to
+///                   sample on the PET timer. `period_ms` then only paces
+///                   the reads.
+/// @param stacks Callstack aggregation, or NULL.
+/// @param trace Receives every sample as it is read, or NULL.
+/// @return NULL on success, error message otherwise. `st` is freed on error.
+static const char *profile_capture(profile_state *st, i32 pid, f64 period_ms,
+                                   f64 duration_ms, u32 samplers,
+                                   u32 pmi_counter, u64 pmi_period,
+                                   struct stack_sampler *stacks,
+                                   trace_writer *trace) {
+  int ret = 0;
+  kd_buf *read_buf = NULL;
+  bool close_counters = !counting;
+  bool pmi = pmi_period != 0;
+
+#define return_err(msg)                                                        \
+  do {                                                                         \
+    free(read_buf);                                                            \
+    profile_state_free(st);                                                    \
+    profile_teardown(close_counters, pmi);                                     \
+    return msg;                                                                \
+  } while (false)
+
+  memset(st, 0, sizeof(profile_state));
+  if (!ev_count)
+    return "Counters are not configured";
+  if (period_ms <= 0 || duration_ms <= 0)
+    return "Invalid profile period or duration";
+  double sample_period = period_ms / 1000.0;
+  double total_profile_time = duration_ms / 1000.0;
+
+  u32 counter_count = kpc_get_counter_count(classes);
+  if (counter_count == 0) {
+    return "Failed no counter";
+  }
+  if (pmi && pmi_counter >= counter_count) {
+    return "Invalid weight event";
+  }
+
+  // setup PET (Profile Every Thread) period
+  u64 tick = kperf_ns_to_ticks(sample_period * 1000000000ul);
+
+  read_buf = malloc(sizeof(kd_buf) * PROFILE_READ_BUFS);
+  if (!read_buf || !profile_state_init(st, counter_count)) {
+    free(read_buf);
+    profile_state_free(st);
+    return "Failed to allocate memory for trace log";
+  }
+  st->stacks = stacks;
+  st->trace = trace;
+
+  // start counting
+  const char *err = performance_counters_open();
+  if (err)
+    return_err(err);
+
+  // action id and timer id
+  u32 actionid = 1;
+  u32 timerid = 1;
+
+  // alloc action and timer ids
+  if ((ret = kperf_action_count_set(KPERF_ACTION_MAX))) {
+    return_err("Failed set action count");
+  }
+  if ((ret = kperf_timer_count_set(KPERF_TIMER_MAX))) {
+    return_err("Failed set timer count");
+  }
+
+  // set what to sample: PMC per thread, maybe callstacks
+  if ((ret = kperf_action_samplers_set(actionid, samplers))) {
+    return_err("Failed set sampler type");
+  }
+  // set filter process
+  if ((ret = kperf_action_filter_set_by_pid(actionid, pid))) {
+    return_err("Failed set filter pid");
+  }
+
+  if (pmi) {
+    // run the action on overflow of the weight counter only
+    u64 periods[KPC_MAX_COUNTERS] = {0};
+    u32 actionids[KPC_MAX_COUNTERS] = {0};
+    periods[pmi_counter] = pmi_period;
+    actionids[pmi_counter] = actionid;
+    if ((ret = kpc_set_period(classes, periods))) {
+      return_err("Failed set counter period");
+    }
+    if ((ret = kpc_set_actionid(classes, actionids))) {
+      return_err("Failed set counter action");
+    }
+  } else {
+    // setup PET (Profile Every Thread), start sampler
+    if ((ret = kperf_timer_period_set(actionid, tick))) {
+      return_err("Failed set timer period");
+    }
+    if ((ret = kperf_timer_action_set(actionid, timerid))) {
+      return_err("Failed set timer action");
+    }
+    if ((ret = kperf_timer_pet_set(timerid))) {
+      return_err("Failed set timer PET");
+    }
+    if ((ret = kperf_lightweight_pet_set(1))) {
+      return_err("Failed set lightweight PET");
+    }
+  }
+  if ((ret = kperf_sample_set(1))) {
+    return_err("Failed start sample");
+  }
+
+  // reset kdebug/ktrace
+  if ((ret = kdebug_reset())) {
+    return_err("Failed reset kdebug");
+  }
+
+  int nbufs = 1000000;
+  if ((ret = kdebug_trace_setbuf(nbufs))) {
+    return_err("Failed setbuf");
+  }
+  if ((ret = kdebug_reinit())) {
+    return_err("Failed init kdebug buffer");
+  }
+
+  // set trace filter: only log PERF_KPC_DATA_THREAD,
+  // or the whole DBG_PERF class when callstacks are sampled too
+  kd_regtype kdr = {0};
+  if (stacks) {
+    kdr.type = KDBG_CLASSTYPE;
+    kdr.value1 = DBG_PERF;
+    kdr.value2 = DBG_PERF + 1;
+  } else {
+    kdr.type = KDBG_VALCHECK;
+    kdr.value1 = KDBG_EVENTID(DBG_PERF, PERF_KPC, PERF_KPC_DATA_THREAD);
+  }
+  if ((ret = kdebug_setreg(&kdr))) {
+    return_err("Failed set kdebug filter");
+  }
+  // start trace
+  if ((ret = kdebug_trace_enable(1))) {
+    return_err("Failed enable kdebug trace");
+  }
+  // list the threads only now: any thread missing from the list is then
+  // created while traced, and its counters start at 0
+  profile_list_threads(st, pid);
+
+  // wake up at least every other sample period to drain the kernel buffer
+  usize wait_ms = (usize)(2 * period_ms);
+  if (wait_ms < 1)
+    wait_ms = 1;
+
+  double begin = get_timestamp();
+  for (;;) {
+    // stop when time is up, after a last read
+    bool done = get_timestamp() - begin > total_profile_time + sample_period;
+    if (!done) {
+      kdebug_wait(wait_ms, NULL);
+    }
+
+    // the flag is cleared by the next read
+    kbufinfo_t info = {0};
+    if (kdebug_get_bufinfo(&info) == 0 && (info.flags & KDBG_WRAPPED)) {
+      st->overflows++;
+    }
+
+    // read trace buffer from kernel until it is empty
+    for (;;) {
+      usize count = 0;
+      if (kdebug_trace_read(read_buf, sizeof(kd_buf) * PROFILE_READ_BUFS,
+                            &count))
+        break;
+      for (usize i = 0; i < count; i++) {
+        profile_feed(st, read_buf + i);
+      }
+      if (count < PROFILE_READ_BUFS)
+        break;
+    }
+
+    if (st->out_of_memory) {
+      return_err("Failed to allocate memory for aggregate log");
+    }
+    if (trace && trace->failed) {
+      return_err("Failed to write trace file");
+    }
+    if (done)
+      break;
+  }
+  if (st->pending)
+    st->dropped++;
+
+  free(read_buf);
+  profile_teardown(close_counters, pmi);
+  return 0;
+
+#undef return_err
+}
+
+/// Profile a process and keep the per thread counts for
+/// performance_counters_profile_thread_values() and the like.
+/// @param trace Receives every sample, or NULL.
+static const char *profile_run(i32 pid, f64 period_ms, f64 duration_ms,
+                               trace_writer *trace) {
+  profile_state st;
+  profile_thread_count = 0;
+  profile_dropped = 0;
+  profile_overflows = 0;
+  memset(profile_sum, 0, sizeof(profile_sum));
+
+  const char *err = profile_capture(&st, pid, period_ms, duration_ms,
+                                    KPERF_SAMPLER_PMC_THREAD, 0, 0, NULL,
+                                    trace);
+  if (err)
+    return err;
+  u32 counter_count = st.counter_count;
+
+  if (st.thread_count == 0) {
+    profile_state_free(&st);
+    return "No thread PMC data collected";
+  }
+
+  // keep the threads with a known delta: sampled at least twice, or
+  // created during the profile (their counters started at 0)
+  usize cc = counter_count;
+  usize kept = 0;
+  for (usize i = 0; i < st.thread_count; i++) {
+    kpc_thread_data *data = st.threads + i;
+    const u64 *first = st.counters + i * 3 * cc;
+    const u64 *sum = first + 2 * cc;
+    bool created = profile_thread_created(&st, data->tid);
+    if (data->samples < 2 && !created)
+      continue;
+
+    // compact in place: the kept values never overlap unread ones
+    u64 *values = st.counters + kept * cc;
+    for (usize c = 0; c < cc; c++) {
+      u64 val = sum[c] + (created ? first[c] : 0);
+      values[c] = val;
+      profile_sum[c] += val;
+    }
+    st.threads[kept++] = *data;
+  }
+
+  free(profile_threads);
+  free(profile_values);
+  profile_threads = st.threads;
+  profile_values = st.counters;
+  profile_thread_count = kept;
+  profile_counter_count = counter_count;
+  profile_dropped = st.dropped;
+  profile_overflows = st.overflows;
+  free(st.table);
+  free(st.existing);
+  return 0;
+}
+
+/// Profile every thread of a process with the events configured by
+/// performance_counters_init(). Blocks for `duration_ms`.
+/// kperf and kdebug are reset when this returns, even on error.
+/// @param pid Target process pid, -1 for all threads.
+/// @param period_ms Sampler period in milliseconds.
+/// @param duration_ms Profile time in milliseconds.
+const char *performance_counters_profile_process(i32 pid, f64 period_ms,
+                                                 f64 duration_ms);
+const char *performance_counters_profile_process(i32 pid, f64 period_ms,
+                                                 f64 duration_ms) {
+  return profile_run(pid, period_ms, duration_ms, NULL);
+}
+
+/// Trace file of performance_counters_profile_record(), too large for the
+/// stack.
+static trace_writer profile_trace;
+
+/// Like performance_counters_profile_process(), and also stream every
+/// sample to a trace file as it is read, see "Trace files" above. Memory
+/// does not grow with the profile length, so this suits long captures.
+/// @param path File to write the trace to.
+const char *performance_counters_profile_record(i32 pid, f64 period_ms,
+                                                f64 duration_ms,
+                                                const char *path);
+const char *performance_counters_profile_record(i32 pid, f64 period_ms,
+                                                f64 duration_ms,
+                                                const char *path) {
+  if (!ev_count)
+    return "Counters are not configured";
+  if (period_ms <= 0 || duration_ms <= 0)
+    return "Invalid profile period or duration";
+
+  u64 period_ticks = kperf_ns_to_ticks((u64)(period_ms * 1000000.0));
+  const char *err = trace_open(&profile_trace, path,
+                               kpc_get_counter_count(classes), pid,
+                               period_ticks);
+  if (err)
+    return err;
+  err = profile_run(pid, period_ms, duration_ms, &profile_trace);
+  bool written = trace_close(&profile_trace);
+  if (err)
+    return err;
+  return written ? 0 : "Failed to write trace file";
+}
+
+/// Number of samples the last profile had to drop because they were cut
+/// off, e.g. when the kernel trace buffer overflowed.
+u64 performance_counters_profile_dropped();
+u64 performance_counters_profile_dropped() { return profile_dropped; }
+
+/// Number of times the kernel trace buffer overflowed during the last
+/// profile. Records lost that way cannot be counted.
+u32 performance_counters_profile_overflows();
+u32 performance_counters_profile_overflows() { return profile_overflows; }
+
+/// Number of threads in the last profile.
+u32 performance_counters_profile_thread_count();
+u32 performance_counters_profile_thread_count() {
+  return (u32)profile_thread_count;
+}
+
+/// Thread id of the i-th thread in the last profile.
+u32 performance_counters_profile_thread_tid(u32 i);
+u32 performance_counters_profile_thread_tid(u32 i) {
+  return i < profile_thread_count ? profile_threads[i].tid : 0;
+}
+
+/// Time between the first and the last sample of the i-th thread, in
+/// nanoseconds. 0 for a thread that was sampled only once.
+u64 performance_counters_profile_thread_time(u32 i);
+u64 performance_counters_profile_thread_time(u32 i) {
+  if (i >= profile_thread_count)
+    return 0;
+  kpc_thread_data *data = profile_threads + i;
+  return kperf_ticks_to_ns(data->timestamp_1 - data->timestamp_0);
+}
+
+/// Counts of the i-th thread in the last profile.
+/// @param values Receives `ev_count` values.
+void performance_counters_profile_thread_values(u32 i, u64 *values);
+void performance_counters_profile_thread_values(u32 i, u64 *values) {
+  for (usize e = 0; e < ev_count; e++) {
+    usize idx = counter_map[e];
+    values[e] = i < profile_thread_count
+                    ? profile_values[i * profile_counter_count + idx]
+                    : 0;
+  }
+}
+
+/// Counts of all threads in the last profile.
+/// @param values Receives `ev_count` values.
+void performance_counters_profile_total(u64 *values);
+void performance_counters_profile_total(u64 *values) {
+  for (usize e = 0; e < ev_count; e++) {
+    values[e] = profile_sum[counter_map[e]];
+  }
+}
+
+// -----------------------------------------------------------------------------
+// Callstack sampling
+// Same sampling as above, with the user (and optionally kernel) callstack of
+// every sample. Each unique stack is charged the delta of one event since
+// the thread's previous sample, and written as folded stacks
+// ("root;...;leaf weight" per line) for flamegraph tools.
+// -----------------------------------------------------------------------------
+
+/// Frames kept per callstack, deeper frames are cut off.
+#define STACK_MAX_FRAMES 128
+
+/// Callstack being assembled for one thread.
+typedef struct {
+  /// Weight event count since the last stack was charged.
+  u64 weight;
+  u32 unframes;
+  u32 uhave;
+  u32 knframes;
+  u32 khave;
+  /// A kernel stack is complete and waits for the user stack of the same
+  /// sample, which kperf may log later (on return to user space).
+  bool kdone;
+  u64 uframes[STACK_MAX_FRAMES]; ///< leaf first
+  u64 kframes[STACK_MAX_FRAMES]; ///< leaf first
+} stack_thread;
+
+/// One unique callstack, open addressing by `hash` (0 is empty).
+typedef struct {
+  u64 hash;
+  u64 weight;
+  u64 samples;
+  u32 offset;  ///< Index of the first frame in `stack_sampler.frames`.
+  u16 nframes; ///< User and kernel frames, root first.
+  u16 kframes; ///< How many of the leaf-most frames are kernel frames.
+} stack_entry;
+
+typedef struct stack_sampler {
+  /// Thread counter the stacks are weighted by.
+  u32 weight_counter;
+  bool kernel;
+  /// Sample every `every` events of the weight counter, 0 to sample on the
+  /// PET timer.
+  u64 every;
+  /// Samples charged to a stack.
+  u64 samples;
+
+  /// Indexed like `profile_state.threads`.
+  stack_thread *threads;
+  usize thread_capacity;
+
+  stack_entry *entries;
+  usize entry_count;
+  usize entry_mask;
+
+  u64 *frames;
+  usize frame_count;
+  usize frame_capacity;
+} stack_sampler;
+
+/// The assembly state of the i-th profiled thread.
+static stack_thread *stacks_thread(profile_state *st, i64 i) {
+  stack_sampler *ss = st->stacks;
+  if ((usize)i >= ss->thread_capacity) {
+    usize new_capacity = st->thread_capacity;
+    stack_thread *threads =
+        realloc(ss->threads, new_capacity * sizeof(stack_thread));
+    if (!threads) {
+      st->out_of_memory = true;
+      return NULL;
+    }
+    memset(threads + ss->thread_capacity, 0,
+           (new_capacity - ss->thread_capacity) * sizeof(stack_thread));
+    ss->threads = threads;
+    ss->thread_capacity = new_capacity;
+  }
+  return ss->threads + i;
+}
+
+static void stacks_on_pmc(profile_state *st, i64 i, const u64 *cur,
+                          const u64 *last) {
+  stack_thread *t = stacks_thread(st, i);
+  if (t) {
+    u32 c = st->stacks->weight_counter;
+    t->weight += cur[c] - last[c];
+  }
+}
+
+/// A PMI of the weight counter: `every` more events since the previous one.
+/// The stacks of the sample follow, the user stack once the thread returns
+/// to user space.
+static void stacks_on_pmi(profile_state *st, const kd_buf *buf) {
+  u32 tid = (u32)buf->arg5;
+  if (!tid)
+    return;
+  // kpc logs the PMI of whichever thread overflowed the counter, kperf only
+  // samples the target's. Charge the threads the target had at the start,
+  // or that already logged a callstack; a thread created meanwhile misses
+  // its first sample.
+  i64 i = profile_find(st, tid);
+  if (i < 0 && st->existing && profile_thread_created(st, tid))
+    return;
+  if (i < 0)
+    i = profile_thread(st, tid);
+  if (i < 0)
+    return;
+  stack_thread *t = stacks_thread(st, i);
+  if (t)
+    t->weight += st->stacks->every;
+}
+
+static bool stacks_grow(stack_sampler *ss) {
+  usize size = (ss->entry_mask + 1) * 2;
+  stack_entry *entries = calloc(size, sizeof(stack_entry));
+  if (!entries)
+    return false;
+  for (usize i = 0; i <= ss->entry_mask; i++) {
+    stack_entry *e = ss->entries + i;
+    if (!e->hash)
+      continue;
+    usize h = e->hash & (size - 1);
+    while (entries[h].hash)
+      h = (h + 1) & (size - 1);
+    entries[h] = *e;
+  }
+  free(ss->entries);
+  ss->entries = entries;
+  ss->entry_mask = size - 1;
+  return true;
+}
+
+/// Charge the assembled stack of a thread.
+static void stacks_emit(profile_state *st, stack_thread *t) {
+  stack_sampler *ss = st->stacks;
+  u64 frames[STACK_MAX_FRAMES * 2];
+  usize n = 0;
+  for (u32 i = t->unframes; i > 0; i--)
+    frames[n++] = t->uframes[i - 1];
+  u16 kcount = 0;
+  if (ss->kernel && t->kdone) {
+    for (u32 i = t->knframes; i > 0; i--)
+      frames[n++] = t->kframes[i - 1];
+    kcount = (u16)t->knframes;
+  }
+  u64 weight = t->weight;
+  t->weight = 0;
+  t->kdone = false;
+  if (!n)
+    return;
+  if (weight)
+    ss->samples++;
+
+  // FNV-1a
+  u64 hash = 14695981039346656037ull;
+  for (usize i = 0; i < n; i++) {
+    hash = (hash ^ frames[i]) * 1099511628211ull;
+  }
+  hash = (hash ^ kcount) | 1;
+
+  usize h = hash & ss->entry_mask;
+  for (stack_entry *e; (e = ss->entries + h)->hash;
+       h = (h + 1) & ss->entry_mask) {
+    if (e->hash == hash && e->nframes == n && e->kframes == kcount &&
+        memcmp(ss->frames + e->offset, frames, n * sizeof(u64)) == 0) {
+      e->weight += weight;
+      e->samples++;
+      return;
+    }
+  }
+
+  if (ss->frame_count + n > ss->frame_capacity) {
+    usize new_capacity = ss->frame_capacity * 2 + n;
+    u64 *new_frames = realloc(ss->frames, new_capacity * sizeof(u64));
+    if (!new_frames) {
+      st->out_of_memory = true;
+      return;
+    }
+    ss->frames = new_frames;
+    ss->frame_capacity = new_capacity;
+  }
+  stack_entry *e = ss->entries + h;
+  e->hash = hash;
+  e->weight = weight;
+  e->samples = 1;
+  e->offset = (u32)ss->frame_count;
+  e->nframes = (u16)n;
+  e->kframes = kcount;
+  memcpy(ss->frames + ss->frame_count, frames, n * sizeof(u64));
+  ss->frame_count += n;
+
+  // keep the load factor at or below 1/2
+  if (++ss->entry_count * 2 > ss->entry_mask + 1 && !stacks_grow(ss)) {
+    st->out_of_memory = true;
+  }
+}
+
+static void stacks_feed(profile_state *st, const kd_buf *buf, u32 code) {
+  u32 tid = (u32)buf->arg5;
+  if (!tid)
+    return;
+  i64 i = profile_thread(st, tid);
+  if (i < 0)
+    return;
+  stack_thread *t = stacks_thread(st, i);
+  if (!t)
+    return;
+
+  const u64 args[4] = {buf->arg1, buf->arg2, buf->arg3, buf->arg4};
+  switch (code) {
+  case PERF_CS_KHDR:
+    t->knframes = buf->arg2 < STACK_MAX_FRAMES ? (u32)buf->arg2
+                                               : STACK_MAX_FRAMES;
+    t->khave = 0;
+    t->kdone = t->knframes == 0;
+    break;
+  case PERF_CS_KDATA:
+    for (u32 a = 0; a < 4 && t->khave < t->knframes; a++)
+      t->kframes[t->khave++] = args[a];
+    if (t->knframes && t->khave == t->knframes)
+      t->kdone = true;
+    break;
+  case PERF_CS_UHDR:
+    t->unframes = buf->arg2 < STACK_MAX_FRAMES ? (u32)buf->arg2
+                                               : STACK_MAX_FRAMES;
+    t->uhave = 0;
+    if (!t->unframes)
+      stacks_emit(st, t);
+    break;
+  case PERF_CS_UDATA:
+    if (t->uhave >= t->unframes)
+      break;
+    for (u32 a = 0; a < 4 && t->uhave < t->unframes; a++)
+      t->uframes[t->uhave++] = args[a];
+    if (t->uhave == t->unframes)
+      stacks_emit(st, t);
+    break;
+  }
+}
+
+static void stacks_free(stack_sampler *ss) {
+  free(ss->threads);
+  free(ss->entries);
+  free(ss->frames);
+  memset(ss, 0, sizeof(stack_sampler));
+}
+
+/// Write one frame of a folded stack. Addresses in this process are
+/// symbolized with dladdr(), others are left for tools like `atos`.
+/// @param exact Keep the offset in the function, for the leaf frame of
+///              samples taken on overflow.
+static void stacks_write_frame(FILE *file, u64 pc, bool kernel, bool self,
+                               bool exact) {
+  Dl_info info = {0};
+  bool found = !kernel && self && dladdr((void *)(uintptr_t)pc, &info);
+  if (kernel) {
+    fprintf(file, "0x%llx_[k]", (unsigned long long)pc);
+  } else if (found && info.dli_sname && exact) {
+    fprintf(file, "%s+0x%llx", info.dli_sname,
+            (unsigned long long)(pc - (uintptr_t)info.dli_saddr));
+  } else if (found && info.dli_sname) {
+    fprintf(file, "%s", info.dli_sname);
+  } else if (found && info.dli_fname) {
+    const char *base = strrchr(info.dli_fname, '/');
+    fprintf(file, "%s+0x%llx", base ? base + 1 : info.dli_fname,
+            (unsigned long long)(pc - (uintptr_t)info.dli_fbase));
+  } else {
+    fprintf(file, "0x%llx", (unsigned long long)pc);
+  }
+}
+
+/// Number of unique stacks in the last stack profile.
+static usize stacks_last_count = 0;
+/// Number of samples charged to a stack in the last stack profile.
+static u64 stacks_last_samples = 0;
+/// Folded stacks of the last stack profile without an output file.
+static char *stacks_last_folded = NULL;
+
+/// Capture callstacks and write them as folded stacks.
+/// @param every Sample on every `every` weight events, 0 to sample every
+///              `period_ms` instead.
+static const char *stacks_profile(i32 pid, f64 period_ms, f64 duration_ms,
+                                  u64 every, u32 weight_slot, u32 kernel,
+                                  const char *path) {
+  if (weight_slot >= ev_count)
+    return "Invalid weight event";
+
+  stack_sampler ss = {0};
+  ss.weight_counter = (u32)counter_map[weight_slot];
+  ss.kernel = !!kernel;
+  ss.every = every;
+  ss.entry_mask = 1023;
+  ss.entries = calloc(ss.entry_mask + 1, sizeof(stack_entry));
+  if (!ss.entries)
+    return "Failed to allocate memory for callstacks";
+
+  // on overflow the PMI carries the weight, thread counters would add it
+  // twice
+  u32 samplers = KPERF_SAMPLER_USTACK;
+  if (!every)
+    samplers |= KPERF_SAMPLER_PMC_THREAD;
+  if (kernel)
+    samplers |= KPERF_SAMPLER_KSTACK;
+
+  profile_state st;
+  const char *err = profile_capture(&st, pid, period_ms, duration_ms, samplers,
+                                    ss.weight_counter, every, &ss, NULL);
+  if (err) {
+    stacks_free(&ss);
+    return err;
+  }
+  profile_state_free(&st);
+
+  // without a path the stacks stay in memory, so nothing is created where
+  // another user could have planted a link
+  free(stacks_last_folded);
+  stacks_last_folded = NULL;
+  char *folded = NULL;
+  size_t folded_size = 0;
+  FILE *file = path ? fopen(path, "w") : open_memstream(&folded, &folded_size);
+  if (!file) {
+    stacks_free(&ss);
+    return path ? "Failed to open output file"
+                : "Failed to allocate memory for callstacks";
+  }
+  bool self = pid == getpid();
+  for (usize i = 0; i <= ss.entry_mask; i++) {
+    stack_entry *e = ss.entries + i;
+    if (!e->hash || !e->weight)
+      continue;
+    const u64 *frames = ss.frames + e->offset;
+    for (u16 f = 0; f < e->nframes; f++) {
+      if (f)
+        fputc(';', file);
+      bool leaf = f == e->nframes - 1;
+      stacks_write_frame(file, frames[f], f >= e->nframes - e->kframes, self,
+                         every && leaf);
+    }
+    fprintf(file, " %llu\n", (unsigned long long)e->weight);
+  }
+  bool failed = ferror(file);
+  fclose(file);
+  if (failed)
+    free(folded);
+  else
+    stacks_last_folded = folded;
+
+  stacks_last_count = ss.entry_count;
+  stacks_last_samples = ss.samples;
+  stacks_free(&ss);
+  return failed ? "Failed to write output file" : 0;
+}
+
+/// Sample every thread of a process with its callstacks, and write the
+/// stacks weighted by one event as folded stacks.
+/// Blocks for `duration_ms`. kperf and kdebug are reset when this returns,
+/// even on error.
+/// @param pid Target process pid, -1 for all threads.
+/// @param weight_slot Index of the weight event in the values buffer.
+/// @param kernel 1 to sample kernel stacks too.
+/// @param path File to write the folded stacks to, NULL to keep them for
+///             performance_counters_profile_stack_folded().
+const char *performance_counters_profile_stacks(i32 pid, f64 period_ms,
+                                                f64 duration_ms,
+                                                u32 weight_slot, u32 kernel,
+                                                const char *path);
+const char *performance_counters_profile_stacks(i32 pid, f64 period_ms,
+                                                f64 duration_ms,
+                                                u32 weight_slot, u32 kernel,
+                                                const char *path) {
+  return stacks_profile(pid, period_ms, duration_ms, 0, weight_slot, kernel,
+                        path);
+}
+
+/// Like performance_counters_profile_stacks(), but take a sample each time
+/// the weight event occurred `every` more times, from the overflow
+/// interrupt of its counter. Each stack is charged `every` per sample, and
+/// its leaf frame is the interrupted instruction.
+/// @param every Events between two samples, e.g. 10000 cache misses.
+const char *performance_counters_profile_overflow(i32 pid, u64 every,
+                                                  f64 duration_ms,
+                                                  u32 weight_slot,
+                                                  u32 kernel,
+                                                  const char *path);
+const char *performance_counters_profile_overflow(i32 pid, u64 every,
+                                                  f64 duration_ms,
+                                                  u32 weight_slot,
+                                                  u32 kernel,
+                                                  const char *path) {
+  if (!every)
+    return "Invalid sample period";
+  // the period only paces the reads here, which wake up every other period:
+  // the trace buffer is drained every 2 ms
+  return stacks_profile(pid, 1, duration_ms, every, weight_slot, kernel, path);
+}
+
+/// Number of unique stacks in the last stack profile.
+u32 performance_counters_profile_stack_count();
+u32 performance_counters_profile_stack_count() {
+  return (u32)stacks_last_count;
+}
+
+/// Number of samples charged to a stack in the last stack profile.
+u64 performance_counters_profile_stack_samples();
+u64 performance_counters_profile_stack_samples() {
+  return stacks_last_samples;
+}
+
+/// Folded stacks of the last stack profile that was given no output file,
+/// empty otherwise.
+const char *performance_counters_profile_stack_folded();
+const char *performance_counters_profile_stack_folded() {
+  return stacks_last_folded ? stacks_last_folded : "";
+}
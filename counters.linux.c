@@ -0,0 +1,1404 @@
+// clang-format off
+// =============================================================================
+// Linux perf_event_open backend
+// The entry points of counters.c that init(), start()/stop(), run(),
+// runMany(), open() and the inline reads use, on top of perf_event_open(2).
+//
+// The events passed to init() are opened for each thread that measures, as
+// one group, so a single read() of the group leader returns all of them
+// (PERF_FORMAT_GROUP). Events that don't fit on the counters together are
+// split into groups that take turns like the kpc groups of counters.c. On
+// x86-64 the mmap'd control page of each event lets the inline entry points
+// read the counters with rdpmc, without a syscall.
+//
+// Events without a mode suffix count user space and the kernel, like on
+// macOS, when kernel.perf_event_paranoid <= 1 or the process has
+// CAP_PERFMON. Otherwise they count user space only and report
+// EVENT_MODE_USER. Unprivileged processes need perf_event_paranoid <= 2,
+// and /sys/devices/cpu/rdpmc != 0 for the inline reads.
+//
+// References:
+// https://man7.org/linux/man-pages/man2/perf_event_open.2.html
+// https://github.com/torvalds/linux/blob/master/include/uapi/linux/perf_event.h
+// =============================================================================
+
+#define _GNU_SOURCE // for sched_getcpu(), CPU_SET
+
+#include <errno.h>
+#include <math.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <linux/perf_event.h> // for perf_event_attr
+#include <pthread.h>          // for pthread_mutex_t
+#include <sys/ioctl.h>        // for PERF_EVENT_IOC_ENABLE
+#include <sys/mman.h>         // for mmap()
+#include <sys/syscall.h>      // for SYS_perf_event_open, SYS_gettid
+#include <time.h>             // for clock_gettime()
+#include <unistd.h>           // for read(), syscall()
+
+#if defined(__x86_64__)
+#include <cpuid.h> // for __get_cpuid()
+#endif
+
+typedef float f32;
+typedef double f64;
+typedef int8_t i8;
+typedef uint8_t u8;
+typedef int16_t i16;
+typedef uint16_t u16;
+typedef int32_t i32;
+typedef uint32_t u32;
+typedef int64_t i64;
+typedef uint64_t u64;
+typedef size_t usize;
+
+// PMU version constants, the values of counters.c.
+#define KPC_PMU_ERROR (0)    // Error
+#define KPC_PMU_INTEL_V3 (1) // Intel
+
+// Most events init() accepts, the values buffer length of counters.c.
+#define KPC_MAX_COUNTERS 32
+
+#define lib_nelems(x) (sizeof(x) / sizeof((x)[0]))
+
+// -----------------------------------------------------------------------------
+// Events
+// The generic hardware, cache and software events of the kernel, under the
+// names perf uses, and raw events as "r<hex>" like `perf stat -e r01c2`.
+// -----------------------------------------------------------------------------
+
+typedef struct {
+  const char *name;
+  const char *alias; ///< `profile_events` alias in counters.c, or NULL.
+  u32 type;
+  u64 config;
+  const char *description;
+} linux_event;
+
+#define HW_CACHE(id, op, result)                                               \
+  (PERF_COUNT_HW_CACHE_##id | PERF_COUNT_HW_CACHE_OP_##op << 8 |               \
+   PERF_COUNT_HW_CACHE_RESULT_##result << 16)
+
+static const linux_event linux_events[] = {
+    {"cycles", "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES,
+     "Core cycles"},
+    {"instructions", "instructions", PERF_TYPE_HARDWARE,
+     PERF_COUNT_HW_INSTRUCTIONS, "Instructions retired"},
+    {"branches", "branches", PERF_TYPE_HARDWARE,
+     PERF_COUNT_HW_BRANCH_INSTRUCTIONS, "Branch instructions retired"},
+    {"branch-misses", "branch-misses", PERF_TYPE_HARDWARE,
+     PERF_COUNT_HW_BRANCH_MISSES, "Mispredicted branches"},
+    {"cache-references", NULL, PERF_TYPE_HARDWARE,
+     PERF_COUNT_HW_CACHE_REFERENCES, "Last level cache accesses"},
+    {"cache-misses", NULL, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES,
+     "Last level cache misses"},
+    {"bus-cycles", NULL, PERF_TYPE_HARDWARE, PERF_COUNT_HW_BUS_CYCLES,
+     "Bus cycles"},
+    {"ref-cycles", NULL, PERF_TYPE_HARDWARE, PERF_COUNT_HW_REF_CPU_CYCLES,
+     "Cycles at the reference frequency, not scaled by frequency changes"},
+    {"stalled-cycles-frontend", NULL, PERF_TYPE_HARDWARE,
+     PERF_COUNT_HW_STALLED_CYCLES_FRONTEND,
+     "Cycles the frontend delivered no micro-op"},
+    {"stalled-cycles-backend", NULL, PERF_TYPE_HARDWARE,
+     PERF_COUNT_HW_STALLED_CYCLES_BACKEND,
+     "Cycles the backend accepted no micro-op"},
+    {"L1-dcache-loads", NULL, PERF_TYPE_HW_CACHE, HW_CACHE(L1D, READ, ACCESS),
+     "L1 data cache loads"},
+    {"L1-dcache-load-misses", NULL, PERF_TYPE_HW_CACHE,
+     HW_CACHE(L1D, READ, MISS), "L1 data cache load misses"},
+    {"L1-dcache-stores", NULL, PERF_TYPE_HW_CACHE,
+     HW_CACHE(L1D, WRITE, ACCESS), "L1 data cache stores"},
+    {"L1-icache-load-misses", NULL, PERF_TYPE_HW_CACHE,
+     HW_CACHE(L1I, READ, MISS), "L1 instruction cache misses"},
+    {"LLC-loads", NULL, PERF_TYPE_HW_CACHE, HW_CACHE(LL, READ, ACCESS),
+     "Last level cache loads"},
+    {"LLC-load-misses", NULL, PERF_TYPE_HW_CACHE, HW_CACHE(LL, READ, MISS),
+     "Last level cache load misses"},
+    {"dTLB-loads", NULL, PERF_TYPE_HW_CACHE, HW_CACHE(DTLB, READ, ACCESS),
+     "Data TLB loads"},
+    {"dTLB-load-misses", NULL, PERF_TYPE_HW_CACHE, HW_CACHE(DTLB, READ, MISS),
+     "Data TLB load misses"},
+    {"iTLB-load-misses", NULL, PERF_TYPE_HW_CACHE, HW_CACHE(ITLB, READ, MISS),
+     "Instruction TLB misses"},
+    {"branch-load-misses", NULL, PERF_TYPE_HW_CACHE, HW_CACHE(BPU, READ, MISS),
+     "Branch predictor misses"},
+    {"task-clock", NULL, PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK,
+     "Nanoseconds the thread ran"},
+    {"page-faults", NULL, PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS,
+     "Page faults"},
+    {"context-switches", NULL, PERF_TYPE_SOFTWARE,
+     PERF_COUNT_SW_CONTEXT_SWITCHES, "Context switches"},
+    {"cpu-migrations", NULL, PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS,
+     "Moves of the thread to another CPU"},
+};
+
+/// Why an event is not counted, the Linux counterpart of
+/// kpep_config_error_code.
+typedef enum {
+  EVENT_OK = 0,
+  EVENT_NOT_FOUND = 1,
+  EVENT_DUPLICATE = 2,
+  EVENT_DOES_NOT_FIT = 3,
+  EVENT_UNSUPPORTED = 4,
+  EVENT_PERMISSION = 5,
+  EVENT_OPEN_FAILED = 6,
+} event_status;
+
+static const char *event_status_names[] = {
+    "none",
+    "event not found",
+    "conflicting events",
+    "event does not fit on the counters with the others",
+    "event is not supported by this CPU or kernel",
+    "permission denied, lower kernel.perf_event_paranoid to 2",
+    "perf_event_open failed",
+};
+
+/// Privilege levels an event counts in, from a ":u" or ":k" name suffix.
+/// Events without one count both, or user space only when the kernel is
+/// off limits, see kernel_allowed().
+typedef enum {
+  EVENT_MODE_ALL = 0,
+  EVENT_MODE_USER = 1,
+  EVENT_MODE_KERNEL = 2,
+} event_mode;
+
+/// One event passed to performance_counters_init().
+typedef struct {
+  const char *name;  ///< Requested name, points into `ev_spec`.
+  const char *base;  ///< `name` without its mode suffix.
+  u32 mode;          ///< event_mode.
+  const char *alias; ///< `profile_events` alias, or NULL.
+  const linux_event *ev; ///< Generic event, NULL for raw ones.
+  u32 type;
+  u64 config;
+  int status; ///< event_status from resolving/opening it.
+  i32 slot;   ///< Index in the values buffer, -1 if not counted.
+} requested_event;
+
+/// Events counted when init() is given no event list.
+static const char *default_events = "cycles,instructions,branches,branch-misses";
+
+/// Copy of the event list passed to init(), split in place.
+static char ev_spec[1024];
+/// The names of `ev_spec` at the same offsets, without their mode suffix.
+static char ev_base[sizeof(ev_spec)];
+
+/// The event list of the last successful init(), unsplit.
+static char init_spec[sizeof(ev_spec)];
+static u32 init_max_groups = 0;
+
+/// Events passed to init(), in order.
+static requested_event ev_req[KPC_MAX_COUNTERS];
+static usize ev_req_count = 0;
+
+/// Find a generic event by name, or parse a raw "r<hex>" one.
+static bool find_event(requested_event *req) {
+  for (usize i = 0; i < lib_nelems(linux_events); i++) {
+    const linux_event *ev = linux_events + i;
+    if (strcasecmp(ev->name, req->base) == 0) {
+      req->ev = ev;
+      // "cycles:k" is not what `count.cycles` reads
+      req->alias = req->mode == EVENT_MODE_ALL ? ev->alias : NULL;
+      req->type = ev->type;
+      req->config = ev->config;
+      return true;
+    }
+  }
+  if ((req->base[0] == 'r' || req->base[0] == 'R') && req->base[1]) {
+    char *end = NULL;
+    u64 config = strtoull(req->base + 1, &end, 16);
+    if (*end == '\0') {
+      req->type = PERF_TYPE_RAW;
+      req->config = config;
+      return true;
+    }
+  }
+  return false;
+}
+
+/// Split a comma separated event list into `ev_req`.
+/// @return NULL on success, error message otherwise.
+static const char *parse_events(const char *events) {
+  if (!events || !*events)
+    events = default_events;
+  if (strlen(events) >= sizeof(ev_spec))
+    return "Event list is too long";
+  strcpy(ev_spec, events);
+
+  ev_req_count = 0;
+  char *cur = ev_spec;
+  while (cur) {
+    char *next = strchr(cur, ',');
+    if (next)
+      *next++ = '\0';
+    while (*cur == ' ')
+      cur++;
+    for (char *end = cur + strlen(cur); end > cur && end[-1] == ' ';)
+      *--end = '\0';
+    if (*cur) {
+      if (ev_req_count == KPC_MAX_COUNTERS)
+        return "Too many events";
+      requested_event *req = ev_req + ev_req_count++;
+      memset(req, 0, sizeof(requested_event));
+      req->name = cur;
+      req->slot = -1;
+
+      char *base = ev_base + (cur - ev_spec);
+      strcpy(base, cur);
+      char *suffix = strrchr(base, ':');
+      if (suffix && strcasecmp(suffix, ":u") == 0) {
+        req->mode = EVENT_MODE_USER;
+        *suffix = '\0';
+      } else if (suffix && strcasecmp(suffix, ":k") == 0) {
+        req->mode = EVENT_MODE_KERNEL;
+        *suffix = '\0';
+      }
+      req->base = base;
+    }
+    cur = next;
+  }
+  if (!ev_req_count)
+    return "No events";
+  return 0;
+}
+
+// -----------------------------------------------------------------------------
+// Groups
+// A perf group is scheduled on the counters as a whole or not at all. init()
+// adds the events to the first group that still gets scheduled, and each
+// thread opens its own copy of the groups the first time it measures, since
+// perf events opened with pid 0 only count the thread that opened them.
+// -----------------------------------------------------------------------------
+
+/// Most counter groups init() splits the events into.
+#define COUNTER_GROUP_MAX 8
+
+typedef struct {
+  usize event_count;
+  usize slots[KPC_MAX_COUNTERS]; ///< Values buffer slot of each member.
+} counter_group;
+
+static counter_group groups[COUNTER_GROUP_MAX];
+static u32 group_count = 0;
+static u32 max_groups = 1;
+
+/// Event of each values buffer slot.
+static u32 slot_type[KPC_MAX_COUNTERS];
+static u64 slot_config[KPC_MAX_COUNTERS];
+static u32 slot_mode[KPC_MAX_COUNTERS];
+/// Group of each slot, and what performance_counters_slot_group() reports:
+/// -1 when there is a single group.
+static u32 slot_owner[KPC_MAX_COUNTERS];
+static i32 slot_group[KPC_MAX_COUNTERS];
+static usize ev_count = 0;
+
+/// Incremented by every init(), threads reopen their events when it changes.
+/// Starts at 1, the generation of closed events is 0 and never matches.
+static atomic_uint config_generation = 1;
+
+/// What an empty start/stop pair counts, per event, set by calibration.
+static u64 overhead[KPC_MAX_COUNTERS] = {0};
+static u64 inline_overhead[KPC_MAX_COUNTERS] = {0};
+
+/// Serializes init() and set_overhead() against each other and against the
+/// threads that open their events from the configuration.
+static pthread_mutex_t config_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/// Number of contexts that called performance_counters_retain().
+static atomic_uint session_users = 0;
+
+/// The events of one thread.
+typedef struct {
+  u32 generation; ///< `config_generation` they were opened for, 0 if closed.
+  bool counting;  ///< The active group is enabled.
+  bool mapped;    ///< Every event has a control page in `pages`.
+  u32 active_group;
+  int fds[KPC_MAX_COUNTERS]; ///< -1 when not open.
+  struct perf_event_mmap_page *pages[KPC_MAX_COUNTERS];
+} thread_events;
+
+static _Thread_local thread_events te = {
+    .fds = {[0 ... KPC_MAX_COUNTERS - 1] = -1},
+};
+
+// start() and stop() baselines, per thread like in counters.c
+static _Thread_local u64 counters_0[KPC_MAX_COUNTERS] = {0};
+static _Thread_local u64 counters_1[KPC_MAX_COUNTERS] = {0};
+
+/// What a PERF_FORMAT_GROUP read returns.
+typedef struct {
+  u64 nr;
+  u64 time_enabled;
+  u64 time_running;
+  u64 values[KPC_MAX_COUNTERS];
+} group_read_format;
+
+static void attr_init(struct perf_event_attr *attr, u32 type, u64 config,
+                      u32 mode, bool leader) {
+  memset(attr, 0, sizeof(struct perf_event_attr));
+  attr->size = sizeof(struct perf_event_attr);
+  attr->type = type;
+  attr->config = config;
+  // the members follow their leader
+  attr->disabled = leader;
+  // counting the kernel needs perf_event_paranoid 1 or CAP_PERFMON
+  attr->exclude_kernel = mode == EVENT_MODE_USER;
+  attr->exclude_user = mode == EVENT_MODE_KERNEL;
+  attr->exclude_hv = 1;
+  attr->read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                      PERF_FORMAT_TOTAL_TIME_RUNNING;
+}
+
+/// perf_event_open() for the calling thread, on any CPU.
+static int perf_open(struct perf_event_attr *attr, int group_fd) {
+  return (int)syscall(SYS_perf_event_open, attr, 0, -1, group_fd,
+                      PERF_FLAG_FD_CLOEXEC);
+}
+
+/// Whether this process may count the kernel, probed with a software event
+/// since perf_event_paranoid applies to every event type.
+static bool kernel_allowed(void) {
+  struct perf_event_attr attr;
+  attr_init(&attr, PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK,
+            EVENT_MODE_KERNEL, true);
+  int fd = perf_open(&attr, -1);
+  if (fd < 0)
+    return false;
+  close(fd);
+  return true;
+}
+
+static int open_status(int err) {
+  switch (err) {
+  case EACCES:
+  case EPERM:
+    return EVENT_PERMISSION;
+  case ENOENT:
+  case EOPNOTSUPP:
+    return EVENT_UNSUPPORTED;
+  case EINVAL:
+  case ENOSPC:
+    return EVENT_DOES_NOT_FIT;
+  default:
+    return EVENT_OPEN_FAILED;
+  }
+}
+
+/// Whether the group led by `leader` gets on the counters.
+/// @details A group that doesn't fit opens fine but never runs.
+static bool group_fits(int leader) {
+  group_read_format data;
+  ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+  ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  for (volatile u32 i = 0; i < 10000; i++) {
+  }
+  ioctl(leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+  if (read(leader, &data, sizeof(data)) < (ssize_t)(3 * sizeof(u64)))
+    return false;
+  return data.time_running > 0;
+}
+
+static void thread_close(void) {
+  long page = sysconf(_SC_PAGESIZE);
+  for (usize i = 0; i < KPC_MAX_COUNTERS; i++) {
+    if (te.pages[i])
+      munmap(te.pages[i], (usize)page);
+    if (te.fds[i] >= 0)
+      close(te.fds[i]);
+    te.pages[i] = NULL;
+    te.fds[i] = -1;
+  }
+  te.generation = 0;
+  te.counting = false;
+  te.mapped = false;
+  te.active_group = 0;
+}
+
+/// Open the calling thread's events for the current configuration, disabled.
+/// @return NULL on success, error message otherwise.
+static const char *thread_open(void) {
+  u32 generation = atomic_load(&config_generation);
+  if (te.generation == generation)
+    return 0;
+  thread_close();
+  if (!ev_count)
+    return "Counters are not configured";
+
+  long page = sysconf(_SC_PAGESIZE);
+  bool mapped = true;
+  for (u32 g = 0; g < group_count; g++) {
+    counter_group *grp = groups + g;
+    int leader = -1;
+    for (usize k = 0; k < grp->event_count; k++) {
+      usize slot = grp->slots[k];
+      struct perf_event_attr attr;
+      attr_init(&attr, slot_type[slot], slot_config[slot], slot_mode[slot],
+                k == 0);
+      int fd = perf_open(&attr, leader);
+      if (fd < 0) {
+        thread_close();
+        return "Failed open perf events";
+      }
+      te.fds[slot] = fd;
+      if (k == 0)
+        leader = fd;
+#if defined(__x86_64__)
+      void *pc = mmap(NULL, (usize)page, PROT_READ, MAP_SHARED, fd, 0);
+      te.pages[slot] = pc == MAP_FAILED ? NULL : pc;
+#endif
+      mapped &= te.pages[slot] != NULL;
+    }
+  }
+  te.generation = generation;
+  te.mapped = mapped;
+  te.active_group = 0;
+  return 0;
+}
+
+static inline int group_leader(u32 g) { return te.fds[groups[g].slots[0]]; }
+
+/// Whether the value in `slot` is counted while `group` is enabled.
+static inline bool slot_in_group(usize slot, u32 group) {
+  return slot_owner[slot] == group;
+}
+
+/// Whether the value in `slot` is counted while the active group is enabled.
+static inline bool slot_counted(usize slot) {
+  return slot_in_group(slot, te.active_group);
+}
+
+/// Whether the calling thread's events are open for the current
+/// configuration. `groups` describes other events when they are not.
+static inline bool group_live(void) {
+  return te.generation ==
+         atomic_load_explicit(&config_generation, memory_order_relaxed);
+}
+
+/// Read the active group into `buf`, by values buffer slot.
+static inline const char *group_read(u64 *buf) {
+  group_read_format data;
+  if (!group_live())
+    return "Counters are not enabled on this thread";
+  const counter_group *grp = groups + te.active_group;
+  if (read(group_leader(te.active_group), &data, sizeof(data)) <
+      (ssize_t)((3 + grp->event_count) * sizeof(u64))) {
+    return "Failed read perf group";
+  }
+  for (usize k = 0; k < grp->event_count; k++) {
+    buf[grp->slots[k]] = data.values[k];
+  }
+  return 0;
+}
+
+/// Enable the next group instead of the active one.
+static const char *group_rotate(void) {
+  u32 next = (te.active_group + 1) % group_count;
+  if (next == te.active_group)
+    return 0;
+  if (te.counting) {
+    ioctl(group_leader(te.active_group), PERF_EVENT_IOC_DISABLE,
+          PERF_IOC_FLAG_GROUP);
+    if (ioctl(group_leader(next), PERF_EVENT_IOC_ENABLE,
+              PERF_IOC_FLAG_GROUP)) {
+      return "Failed enable perf group";
+    }
+  }
+  te.active_group = next;
+  return 0;
+}
+
+/// Set how many groups init() may split the events into, 1 to skip the
+/// events that don't fit with the others. Takes effect on the next init().
+void performance_counters_set_max_groups(u32 count);
+void performance_counters_set_max_groups(u32 count) {
+  max_groups = count < 1 ? 1 : count > COUNTER_GROUP_MAX ? COUNTER_GROUP_MAX
+                                                         : count;
+}
+
+/// Number of groups the events were split into.
+u32 performance_counters_group_count();
+u32 performance_counters_group_count() { return group_count; }
+
+/// Group enabled for the calling thread's last start().
+u32 performance_counters_active_group();
+u32 performance_counters_active_group() { return te.active_group; }
+
+/// Group counting the value in `slot`, -1 if every group counts it.
+i32 performance_counters_slot_group(u32 slot);
+i32 performance_counters_slot_group(u32 slot) {
+  return slot < ev_count ? slot_group[slot] : -1;
+}
+
+/// Enable the next group now, for callers that sample with open() instead
+/// of start()/stop(). Samples taken before and after are not comparable.
+const char *performance_counters_rotate();
+const char *performance_counters_rotate() {
+  if (!te.counting)
+    return "Counters are not enabled";
+  return group_rotate();
+}
+
+const char *performance_counters_close();
+
+/// performance_counters_init() with `config_lock` held.
+static const char *init_locked(const char *events) {
+  // every worker calls init(), only a different event list reconfigures
+  const char *spec = events && *events ? events : default_events;
+  if (ev_count && strcmp(spec, init_spec) == 0 &&
+      max_groups == init_max_groups) {
+    return 0;
+  }
+  // the caller retained before init(), any other user is still measuring
+  if (ev_count && atomic_load(&session_users) > 1) {
+    return "Counters are in use by other threads, init() them with the "
+           "same events";
+  }
+  init_spec[0] = '\0';
+
+  // the threads' events stop matching `groups` as soon as it changes, so
+  // they see a new generation before, even if this init() fails
+  thread_close();
+  atomic_fetch_add(&config_generation, 1);
+  ev_count = 0;
+  group_count = 0;
+  memset(overhead, 0, sizeof(overhead));
+  memset(inline_overhead, 0, sizeof(inline_overhead));
+
+  const char *err = parse_events(events);
+  if (err)
+    return err;
+
+  // open the events once here to find out which fit together, the threads
+  // reopen them for themselves
+  int fds[KPC_MAX_COUNTERS];
+  int leaders[COUNTER_GROUP_MAX];
+  usize fd_count = 0;
+  bool kernel = kernel_allowed();
+  for (usize i = 0; i < ev_req_count; i++) {
+    requested_event *req = ev_req + i;
+    if (!find_event(req)) {
+      req->status = EVENT_NOT_FOUND;
+      continue;
+    }
+    // without the kernel, a plain event counts what ":u" does, and says so
+    if (req->mode == EVENT_MODE_ALL && !kernel)
+      req->mode = EVENT_MODE_USER;
+    bool duplicate = false;
+    for (usize j = 0; j < ev_count; j++) {
+      duplicate |= slot_type[j] == req->type &&
+                   slot_config[j] == req->config && slot_mode[j] == req->mode;
+    }
+    if (duplicate) {
+      req->status = EVENT_DUPLICATE;
+      continue;
+    }
+
+    struct perf_event_attr attr;
+    u32 g = 0;
+    int fd = -1;
+    req->status = EVENT_DOES_NOT_FIT;
+    for (; g < group_count; g++) {
+      attr_init(&attr, req->type, req->config, req->mode, false);
+      if ((fd = perf_open(&attr, leaders[g])) < 0) {
+        req->status = open_status(errno);
+        if (req->status != EVENT_DOES_NOT_FIT)
+          break;
+        continue;
+      }
+      if (group_fits(leaders[g]))
+        break;
+      close(fd);
+      fd = -1;
+    }
+    if (fd < 0 && g == group_count && group_count < max_groups) {
+      attr_init(&attr, req->type, req->config, req->mode, true);
+      if ((fd = perf_open(&attr, -1)) < 0) {
+        req->status = open_status(errno);
+      } else if (!group_fits(fd)) {
+        // doesn't fit even on its own
+        close(fd);
+        fd = -1;
+      } else {
+        leaders[g] = fd;
+        groups[g].event_count = 0;
+        group_count++;
+      }
+    }
+    if (fd < 0)
+      continue;
+
+    fds[fd_count++] = fd;
+    req->status = EVENT_OK;
+    req->slot = (i32)ev_count;
+    slot_type[ev_count] = req->type;
+    slot_config[ev_count] = req->config;
+    slot_mode[ev_count] = req->mode;
+    slot_owner[ev_count] = g;
+    groups[g].slots[groups[g].event_count++] = ev_count;
+    ev_count++;
+  }
+  for (usize i = 0; i < fd_count; i++) {
+    close(fds[i]);
+  }
+  if (!ev_count) {
+    return "None of the events could be configured";
+  }
+  for (usize i = 0; i < ev_count; i++) {
+    slot_group[i] = group_count > 1 ? (i32)slot_owner[i] : -1;
+  }
+
+  if ((err = thread_open()))
+    return err;
+  strcpy(init_spec, spec);
+  init_max_groups = max_groups;
+  return 0;
+}
+
+/// Configure the counters.
+/// @param events Comma separated event names, NULL or empty for cycles,
+///               instructions, branches and branch-misses. Events that
+///               cannot be found or opened are skipped, see
+///               performance_counters_event_status(). Events that don't fit
+///               together are split into groups, up to
+///               performance_counters_set_max_groups().
+/// Fails when other contexts retain the counters and `events` differs from
+/// the list they were configured with.
+const char *performance_counters_init(const char *events);
+const char *performance_counters_init(const char *events) {
+  pthread_mutex_lock(&config_lock);
+  const char *err = init_locked(events);
+  pthread_mutex_unlock(&config_lock);
+  return err;
+}
+
+/// Number of events that are counted, i.e. the values buffer length.
+u32 performance_counters_counter_count();
+u32 performance_counters_counter_count() { return (u32)ev_count; }
+
+/// Number of events passed to init().
+u32 performance_counters_event_count();
+u32 performance_counters_event_count() { return (u32)ev_req_count; }
+
+/// Name of the i-th event passed to init(), as it was passed.
+const char *performance_counters_event_name(u32 i);
+const char *performance_counters_event_name(u32 i) {
+  return i < ev_req_count ? ev_req[i].name : 0;
+}
+
+/// Name of the i-th event in the event table, NULL if not found.
+const char *performance_counters_event_db_name(u32 i);
+const char *performance_counters_event_db_name(u32 i) {
+  if (i >= ev_req_count || ev_req[i].status == EVENT_NOT_FOUND)
+    return 0;
+  return ev_req[i].ev ? ev_req[i].ev->name : ev_req[i].name;
+}
+
+/// event_mode of the i-th event passed to init(), from its name suffix, or
+/// EVENT_MODE_USER without one when the kernel can't be counted.
+u32 performance_counters_event_mode(u32 i);
+u32 performance_counters_event_mode(u32 i) {
+  return i < ev_req_count ? ev_req[i].mode : EVENT_MODE_ALL;
+}
+
+/// `profile_events` alias of the i-th event ("cycles"), NULL if none.
+const char *performance_counters_event_alias(u32 i);
+const char *performance_counters_event_alias(u32 i) {
+  return i < ev_req_count ? ev_req[i].alias : 0;
+}
+
+/// Index of the i-th event in the values buffer, -1 if it is not counted.
+i32 performance_counters_event_slot(u32 i);
+i32 performance_counters_event_slot(u32 i) {
+  return i < ev_req_count ? ev_req[i].slot : -1;
+}
+
+/// Why the i-th event is not counted, see event_status.
+/// @return 0 if it is counted.
+i32 performance_counters_event_status(u32 i);
+i32 performance_counters_event_status(u32 i) {
+  return i < ev_req_count ? ev_req[i].status : EVENT_NOT_FOUND;
+}
+
+/// Description of an event_status.
+const char *performance_counters_error_desc(i32 code);
+const char *performance_counters_error_desc(i32 code) {
+  if (code < 0 || (usize)code >= lib_nelems(event_status_names))
+    return "unknown error";
+  return event_status_names[code];
+}
+
+// -----------------------------------------------------------------------------
+// Event catalog
+// The table above stands in for the pmc db, the CPU is named after the
+// kernel's PMU, such as "skylake" or "icelake", which is also the name of the
+// kpep database on Intel Macs.
+// -----------------------------------------------------------------------------
+
+static char cpu_name[64];
+static char cpu_marketing_name[128];
+static bool cpu_intel = false;
+
+/// Read the first line of a file into `buf`, without the newline.
+static bool read_line(const char *path, char *buf, usize size) {
+  FILE *file = fopen(path, "r");
+  if (!file)
+    return false;
+  bool ok = fgets(buf, (int)size, file) != NULL;
+  fclose(file);
+  if (ok)
+    buf[strcspn(buf, "\n")] = '\0';
+  return ok;
+}
+
+/// Name the CPU, once.
+const char *performance_counters_db_open();
+const char *performance_counters_db_open() {
+  if (cpu_name[0])
+    return 0;
+  if (!read_line("/sys/bus/event_source/devices/cpu/caps/pmu_name", cpu_name,
+                 sizeof(cpu_name)) &&
+      !read_line("/sys/bus/event_source/devices/cpu_core/caps/pmu_name",
+                 cpu_name, sizeof(cpu_name))) {
+    strcpy(cpu_name, "unknown");
+  }
+
+  FILE *file = fopen("/proc/cpuinfo", "r");
+  char line[256];
+  while (file && fgets(line, sizeof(line), file)) {
+    char *value = strchr(line, ':');
+    if (!value)
+      continue;
+    value += strspn(value + 1, " ") + 1;
+    value[strcspn(value, "\n")] = '\0';
+    if (strncmp(line, "vendor_id", 9) == 0)
+      cpu_intel = strcmp(value, "GenuineIntel") == 0;
+    else if (strncmp(line, "model name", 10) == 0 && !cpu_marketing_name[0])
+      snprintf(cpu_marketing_name, sizeof(cpu_marketing_name), "%s", value);
+  }
+  if (file)
+    fclose(file);
+  return 0;
+}
+
+/// PMU name, such as "skylake", "unknown" if the kernel doesn't say.
+const char *performance_counters_db_name();
+const char *performance_counters_db_name() {
+  return cpu_name[0] ? cpu_name : 0;
+}
+
+/// Model name from /proc/cpuinfo.
+const char *performance_counters_db_marketing_name();
+const char *performance_counters_db_marketing_name() {
+  return cpu_marketing_name[0] ? cpu_marketing_name : 0;
+}
+
+/// Not meaningful on Linux, the PMU name.
+const char *performance_counters_db_cpu_id();
+const char *performance_counters_db_cpu_id() {
+  return performance_counters_db_name();
+}
+
+/// KPC_PMU_INTEL_V3 on Intel, KPC_PMU_ERROR otherwise, so the derived
+/// metrics pick the same family as on an Intel Mac.
+u32 performance_counters_pmu_version();
+u32 performance_counters_pmu_version() {
+  performance_counters_db_open();
+  return cpu_intel ? KPC_PMU_INTEL_V3 : KPC_PMU_ERROR;
+}
+
+/// Architectural performance monitoring leaf of CPUID, 0 elsewhere.
+static void pmu_leaf(u32 *eax, u32 *edx) {
+  *eax = *edx = 0;
+#if defined(__x86_64__)
+  u32 ebx, ecx;
+  if (__get_cpuid(0, eax, &ebx, &ecx, edx) && *eax >= 0xa)
+    __cpuid(0xa, *eax, ebx, ecx, *edx);
+  else
+    *eax = *edx = 0;
+#endif
+}
+
+/// Number of fixed counters, from CPUID on Intel, 0 elsewhere.
+u32 performance_counters_db_fixed_counter_count();
+u32 performance_counters_db_fixed_counter_count() {
+  u32 eax, edx;
+  pmu_leaf(&eax, &edx);
+  return edx & 0x1f;
+}
+
+/// Number of general purpose counters, from CPUID on Intel, 0 elsewhere.
+u32 performance_counters_db_config_counter_count();
+u32 performance_counters_db_config_counter_count() {
+  u32 eax, edx;
+  pmu_leaf(&eax, &edx);
+  return (eax >> 8) & 0xff;
+}
+
+u32 performance_counters_db_power_counter_count();
+u32 performance_counters_db_power_counter_count() { return 0; }
+
+/// Number of events in the table.
+u32 performance_counters_db_event_count();
+u32 performance_counters_db_event_count() {
+  return (u32)lib_nelems(linux_events);
+}
+
+/// Name of the i-th event, such as "L1-dcache-load-misses".
+const char *performance_counters_db_event_name(u32 i);
+const char *performance_counters_db_event_name(u32 i) {
+  return i < lib_nelems(linux_events) ? linux_events[i].name : 0;
+}
+
+/// Alias of the i-th event, may be NULL.
+const char *performance_counters_db_event_alias(u32 i);
+const char *performance_counters_db_event_alias(u32 i) {
+  return i < lib_nelems(linux_events) ? linux_events[i].alias : 0;
+}
+
+/// Description of the i-th event.
+const char *performance_counters_db_event_description(u32 i);
+const char *performance_counters_db_event_description(u32 i) {
+  return i < lib_nelems(linux_events) ? linux_events[i].description : 0;
+}
+
+/// Always NULL, there are no fixed events.
+const char *performance_counters_db_event_fallback(u32 i);
+const char *performance_counters_db_event_fallback(u32 i) {
+  (void)i;
+  return 0;
+}
+
+/// The kernel schedules the events, every counter is allowed.
+u32 performance_counters_db_event_mask(u32 i);
+u32 performance_counters_db_event_mask(u32 i) {
+  return i < lib_nelems(linux_events) ? ~0u : 0;
+}
+
+u32 performance_counters_db_event_is_fixed(u32 i);
+u32 performance_counters_db_event_is_fixed(u32 i) {
+  (void)i;
+  return 0;
+}
+
+// -----------------------------------------------------------------------------
+// Counting
+// -----------------------------------------------------------------------------
+
+/// Message of the last hot entry point that failed on this thread.
+static _Thread_local const char *last_error = NULL;
+
+/// Record why a hot entry point failed.
+/// @return 1, the status of a failure.
+static inline i32 status_error(const char *err) {
+  last_error = err;
+  return 1;
+}
+
+/// 0 for NULL, else status_error(err).
+static inline i32 status_of(const char *err) {
+  return err ? status_error(err) : 0;
+}
+
+/// Why the last hot entry point that returned a non-zero status on this
+/// thread failed. The hot entry points (start, stop, batch_stop and the
+/// inline reads) return 0 on success, so checking them costs an integer
+/// compare instead of decoding a string.
+const char *performance_counters_last_error();
+const char *performance_counters_last_error() { return last_error; }
+
+/// Record the CPU start() and stop() run on, see
+/// performance_counters_track_cpu().
+static bool track_cpu = false;
+static _Thread_local i32 cpu_start = -1;
+static _Thread_local i32 cpu_end = -1;
+
+/// Read the time in start() and stop(), see performance_counters_track_time().
+static bool track_time = false;
+static _Thread_local u64 time_start = 0;
+static _Thread_local u64 time_end = 0;
+
+/// Monotonic time in nanoseconds.
+static inline u64 time_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u64)ts.tv_sec * 1000000000ull + (u64)ts.tv_nsec;
+}
+
+/// Convert a time_now() difference to nanoseconds.
+static inline u64 time_ns(u64 delta) { return delta; }
+
+/// Enable the calling thread's counters until close().
+const char *performance_counters_open();
+const char *performance_counters_open() {
+  if (te.counting && te.generation == atomic_load(&config_generation))
+    return 0;
+  pthread_mutex_lock(&config_lock);
+  const char *err = thread_open();
+  pthread_mutex_unlock(&config_lock);
+  if (err)
+    return err;
+  int leader = group_leader(te.active_group);
+  if (leader < 0)
+    return "Counters are not configured";
+  ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+  if (ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP)) {
+    return "Failed enable perf group";
+  }
+  te.counting = true;
+  return 0;
+}
+
+const char *performance_counters_sample(u64 *values);
+const char *performance_counters_sample(u64 *values) {
+  const char *err = group_read(counters_1);
+  if (err)
+    return err;
+  for (usize i = 0; i < ev_count; i++) {
+    values[i] = slot_counted(i) ? counters_1[i] : 0;
+  }
+  return 0;
+}
+
+/// Close the calling thread's events.
+const char *performance_counters_close();
+const char *performance_counters_close() {
+  thread_close();
+  return 0;
+}
+
+i32 performance_counters_start();
+i32 performance_counters_start() {
+  // counting stays on between start() and stop(), only the first call
+  // pays for enabling it
+  if (!te.counting || te.generation != atomic_load(&config_generation)) {
+    const char *err = performance_counters_open();
+    if (err)
+      return status_error(err);
+  }
+
+  // multiplexed groups take turns, one per start()/stop() pair
+  if (group_count > 1) {
+    const char *err = group_rotate();
+    if (err)
+      return status_error(err);
+  }
+
+  // outside of the measured region, like the read in stop()
+  if (track_cpu)
+    cpu_start = sched_getcpu();
+  if (track_time)
+    time_start = time_now();
+
+  // get counters before
+  return status_of(group_read(counters_0));
+}
+
+/// Write the corrected copy of `values[0, ev_count)` after it.
+static inline void subtract_overhead(u64 *values, const u64 *overhead) {
+  for (usize i = 0; i < ev_count; i++) {
+    u64 raw = values[i];
+    values[ev_count + i] = raw > overhead[i] ? raw - overhead[i] : 0;
+  }
+}
+
+/// Stop counting into `values`, which holds `2 * ev_count` slots:
+/// the raw deltas, then the deltas minus the calibrated overhead.
+i32 performance_counters_stop(u64 *values);
+i32 performance_counters_stop(u64 *values) {
+  // get counters after
+  const char *err = group_read(counters_1);
+  if (err)
+    return status_error(err);
+  if (track_time)
+    time_end = time_now();
+  if (track_cpu)
+    cpu_end = sched_getcpu();
+
+  for (usize i = 0; i < ev_count; i++) {
+    values[i] = slot_counted(i) ? counters_1[i] - counters_0[i] : 0;
+  }
+  subtract_overhead(values, overhead);
+  return 0;
+}
+
+/// Set what an empty start/stop pair counts, per event.
+/// @param values `ev_count` values, NULL to clear.
+/// @param inline_reads 1 for the overhead of the inline entry points.
+void performance_counters_set_overhead(const u64 *values, u32 inline_reads);
+void performance_counters_set_overhead(const u64 *values, u32 inline_reads) {
+  pthread_mutex_lock(&config_lock);
+  u64 *dst = inline_reads ? inline_overhead : overhead;
+  for (usize i = 0; i < KPC_MAX_COUNTERS; i++) {
+    dst[i] = values && i < ev_count ? values[i] : 0;
+  }
+  pthread_mutex_unlock(&config_lock);
+}
+
+// -----------------------------------------------------------------------------
+// Threads
+// Each JavaScript context retains the session. The events belong to the
+// thread that opened them, so releasing closes the calling thread's events
+// whether or not other contexts still measure.
+// -----------------------------------------------------------------------------
+
+/// Register one more user of the counters.
+/// @return The number of users, including this one.
+u32 performance_counters_retain();
+u32 performance_counters_retain() {
+  return atomic_fetch_add(&session_users, 1) + 1;
+}
+
+/// Release a performance_counters_retain() and the calling thread's events.
+const char *performance_counters_release();
+const char *performance_counters_release() {
+  u32 users = atomic_load(&session_users);
+  while (users && !atomic_compare_exchange_weak(&session_users, &users,
+                                                users - 1)) {
+  }
+  return performance_counters_close();
+}
+
+/// Kernel id of the calling thread.
+u64 performance_counters_thread_id();
+u64 performance_counters_thread_id() { return (u64)syscall(SYS_gettid); }
+
+// -----------------------------------------------------------------------------
+// CPU placement
+// Unlike macOS, Linux can pin a thread. On hybrid Intel CPUs the P-cores and
+// E-cores are the cpu_core and cpu_atom PMUs, and prefer_cores() sets the
+// thread's affinity to the CPUs of one of them.
+// -----------------------------------------------------------------------------
+
+/// Cluster to run on, see performance_counters_prefer_cores().
+typedef enum {
+  CORES_ANY = 0,         ///< Restore the affinity the thread had.
+  CORES_PERFORMANCE = 1, ///< The cpu_core CPUs, or every CPU.
+  CORES_EFFICIENCY = 2,  ///< The cpu_atom CPUs.
+} cores_kind;
+
+static _Thread_local cpu_set_t affinity_saved;
+static _Thread_local bool affinity_changed = false;
+
+/// Parse a CPU list such as "0-7,16" into `set`.
+static bool parse_cpu_list(const char *path, cpu_set_t *set) {
+  char buf[256];
+  CPU_ZERO(set);
+  if (!read_line(path, buf, sizeof(buf)))
+    return false;
+  for (char *cur = buf; *cur;) {
+    char *end = NULL;
+    long from = strtol(cur, &end, 10), to = from;
+    if (end == cur)
+      return false;
+    if (*end == '-')
+      to = strtol(end + 1, &end, 10);
+    for (long cpu = from; cpu <= to && cpu < CPU_SETSIZE; cpu++)
+      CPU_SET((int)cpu, set);
+    cur = *end == ',' ? end + 1 : end;
+    if (*end && *end != ',')
+      break;
+  }
+  return CPU_COUNT(set) > 0;
+}
+
+/// Run the calling thread on one kind of core.
+/// @param kind See `cores_kind`.
+const char *performance_counters_prefer_cores(u32 kind);
+const char *performance_counters_prefer_cores(u32 kind) {
+  cpu_set_t set;
+  switch (kind) {
+  case CORES_ANY:
+    if (!affinity_changed)
+      return 0;
+    set = affinity_saved;
+    break;
+  case CORES_PERFORMANCE:
+    if (!parse_cpu_list("/sys/devices/cpu_core/cpus", &set)) {
+      // not hybrid, every CPU is a performance core
+      if (!affinity_changed)
+        return 0;
+      set = affinity_saved;
+    }
+    break;
+  case CORES_EFFICIENCY:
+    if (!parse_cpu_list("/sys/devices/cpu_atom/cpus", &set))
+      return "This CPU has no efficiency cores";
+    break;
+  default:
+    return "Unknown kind of cores";
+  }
+  if (!affinity_changed && kind != CORES_ANY &&
+      sched_getaffinity(0, sizeof(affinity_saved), &affinity_saved)) {
+    return "Failed get thread affinity";
+  }
+  if (sched_setaffinity(0, sizeof(set), &set)) {
+    return "Failed set thread affinity";
+  }
+  affinity_changed = kind != CORES_ANY;
+  return 0;
+}
+
+/// Record the CPU in start(), stop() and the batch rows.
+void performance_counters_track_cpu(u32 enabled);
+void performance_counters_track_cpu(u32 enabled) {
+  track_cpu = enabled;
+  cpu_start = cpu_end = -1;
+}
+
+/// CPU the last start() ran on, -1 if not tracked.
+i32 performance_counters_cpu_start();
+i32 performance_counters_cpu_start() { return track_cpu ? cpu_start : -1; }
+
+/// CPU the last stop() ran on, -1 if not tracked.
+i32 performance_counters_cpu_end();
+i32 performance_counters_cpu_end() { return track_cpu ? cpu_end : -1; }
+
+/// Record the wall time between start() and stop(), and of every batch
+/// row, next to the counts. The time is read outside of the counters, so
+/// the measured window does not change.
+void performance_counters_track_time(u32 enabled);
+void performance_counters_track_time(u32 enabled) {
+  track_time = enabled;
+  time_start = time_end = 0;
+}
+
+/// Wall time between the last start() and stop(), 0 if not tracked.
+u64 performance_counters_elapsed_ns();
+u64 performance_counters_elapsed_ns() {
+  return track_time ? time_ns(time_end - time_start) : 0;
+}
+
+/// Energy the process has used so far, in nanojoules. The kernel has no
+/// per-process energy counter, see counters.c.
+/// @return 0, it isn't reported.
+u64 performance_counters_energy_nj();
+u64 performance_counters_energy_nj() { return 0; }
+
+/// Number of CPUs.
+u32 performance_counters_cpu_count();
+u32 performance_counters_cpu_count() {
+  long n = sysconf(_SC_NPROCESSORS_CONF);
+  return n > 0 ? (u32)n : 0;
+}
+
+/// Performance level of `cpu`, 0 is the fastest, -1 if unknown.
+i32 performance_counters_cpu_perflevel(i32 cpu);
+i32 performance_counters_cpu_perflevel(i32 cpu) {
+  static cpu_set_t atom;
+  static int hybrid = -1;
+  if (hybrid < 0)
+    hybrid = parse_cpu_list("/sys/devices/cpu_atom/cpus", &atom);
+  if (cpu < 0 || (u32)cpu >= performance_counters_cpu_count())
+    return -1;
+  return hybrid && cpu < CPU_SETSIZE && CPU_ISSET(cpu, &atom) ? 1 : 0;
+}
+
+// -----------------------------------------------------------------------------
+// Results
+// The result blocks and batches in counters.results.h, and the entry points
+// that write them.
+// -----------------------------------------------------------------------------
+
+#include "counters.results.h"
+
+/// Mirror the values of `r` as f64 and update the header.
+static inline void result_publish(result_block *r, u64 flags) {
+  result_mirror(r, 2);
+  if (group_count > 1)
+    flags |= RESULT_MULTIPLEXED;
+  r->flags = RESULT_VALID | flags;
+  r->group = te.active_group;
+  r->cpu_start = track_cpu ? cpu_start : -1;
+  r->cpu_end = track_cpu ? cpu_end : -1;
+  r->elapsed_ns = track_time ? time_ns(time_end - time_start) : 0;
+  r->sequence++;
+}
+
+static int inline_state;
+i32 performance_counters_stop_inline(u64 *values);
+
+/// Like performance_counters_stop(), writing into a result block.
+i32 performance_counters_stop_result(result_block *r);
+i32 performance_counters_stop_result(result_block *r) {
+  i32 status = performance_counters_stop(r->values);
+  if (status)
+    return status;
+  result_publish(r, 0);
+  return 0;
+}
+
+/// Like performance_counters_stop_inline(), writing into a result block.
+i32 performance_counters_stop_inline_result(result_block *r);
+i32 performance_counters_stop_inline_result(result_block *r) {
+  i32 status = performance_counters_stop_inline(r->values);
+  if (status)
+    return status;
+  result_publish(r, inline_state > 0 && te.mapped ? RESULT_INLINE : 0);
+  return 0;
+}
+
+/// Like performance_counters_stop(), appending the deltas to the batch.
+i32 performance_counters_batch_stop();
+i32 performance_counters_batch_stop() {
+  // get counters after
+  const char *err = group_read(counters_1);
+  if (err)
+    return status_error(err);
+  u64 now = track_time ? time_now() : 0;
+  if (batch_count == batch_capacity) {
+    return status_error("Batch is full");
+  }
+  batch_cpus[2 * batch_count] = track_cpu ? (i16)cpu_start : -1;
+  batch_cpus[2 * batch_count + 1] = track_cpu ? (i16)sched_getcpu() : -1;
+
+  u64 *row = batch_samples + batch_count * ev_count;
+  for (usize i = 0; i < ev_count; i++) {
+    u64 raw = slot_counted(i) ? counters_1[i] - counters_0[i] : 0;
+    row[i] = !batch_corrected ? raw : raw > overhead[i] ? raw - overhead[i] : 0;
+  }
+  batch_groups[batch_count] = (u8)te.active_group;
+  batch_arms[batch_count] = batch_arm;
+  batch_elapsed[batch_count] = track_time ? time_ns(now - time_start) : 0;
+  batch_count++;
+  return 0;
+}
+
+// -----------------------------------------------------------------------------
+// Inline counter reads
+// The kernel keeps a control page per event, mmap'd at open. While an event
+// is on a counter, `index` names the counter and rdpmc reads it; `offset`
+// holds what the event counted before, and is updated at context switches,
+// so page + rdpmc is the thread's count even across preemption and
+// migration. `lock` changes while the kernel updates the page. Every event,
+// not only cycles and instructions, can be read this way.
+// -----------------------------------------------------------------------------
+
+#if defined(__x86_64__)
+
+static inline u64 rdpmc(u32 counter) {
+  u32 lo, hi;
+  __asm__ __volatile__("rdpmc" : "=a"(lo), "=d"(hi) : "c"(counter));
+  return lo | (u64)hi << 32;
+}
+
+static inline u64 page_read(const volatile struct perf_event_mmap_page *pc) {
+  u32 seq;
+  u64 count;
+  do {
+    seq = pc->lock;
+    __asm__ __volatile__("" ::: "memory");
+    u32 idx = pc->index;
+    count = pc->offset;
+    if (pc->cap_user_rdpmc && idx) {
+      u16 width = pc->pmc_width;
+      i64 pmc = (i64)rdpmc(idx - 1);
+      // sign extend the counter to its width
+      pmc <<= 64 - width;
+      pmc >>= 64 - width;
+      count += (u64)pmc;
+    }
+    __asm__ __volatile__("" ::: "memory");
+  } while (pc->lock != seq);
+  return count;
+}
+
+static inline void inline_counters_read(u64 *buf) {
+  const counter_group *grp = groups + te.active_group;
+  for (usize k = 0; k < grp->event_count; k++) {
+    usize slot = grp->slots[k];
+    buf[slot] = page_read(te.pages[slot]);
+  }
+}
+
+/// Whether the kernel lets this process use rdpmc on the active group.
+static bool inline_probe(void) {
+  if (!te.mapped)
+    return false;
+  const counter_group *grp = groups + te.active_group;
+  for (usize k = 0; k < grp->event_count; k++) {
+    if (!te.pages[grp->slots[k]]->cap_user_rdpmc)
+      return false;
+  }
+  return true;
+}
+
+#else
+
+static inline void inline_counters_read(u64 *buf) { (void)buf; }
+
+static bool inline_probe(void) { return false; }
+
+#endif
+
+/// 0: not probed yet, 1: available, -1: unavailable.
+static int inline_state = 0;
+
+/// Whether the counters can be read without a syscall.
+/// Enables counting if needed, since the probe requires running counters.
+u32 performance_counters_inline_available();
+u32 performance_counters_inline_available() {
+  if (inline_state == 0) {
+    if (!te.counting && performance_counters_open()) {
+      return 0;
+    }
+    inline_state = inline_probe() ? 1 : -1;
+  }
+  return inline_state > 0;
+}
+
+/// Bitmask of the values buffer slots performance_counters_stop_inline()
+/// fills, every event of the active group.
+u32 performance_counters_inline_mask();
+u32 performance_counters_inline_mask() {
+  u32 mask = 0;
+  for (usize i = 0; i < ev_count; i++) {
+    if (slot_counted(i))
+      mask |= 1u << i;
+  }
+  return mask;
+}
+
+/// Like performance_counters_start(), reading the counters with rdpmc if
+/// performance_counters_inline_available() says so.
+i32 performance_counters_start_inline();
+i32 performance_counters_start_inline() {
+  if (inline_state <= 0 || !te.mapped || !te.counting) {
+    return performance_counters_start();
+  }
+  if (group_count > 1) {
+    const char *err = group_rotate();
+    if (err)
+      return status_error(err);
+  }
+  if (track_time)
+    time_start = time_now();
+  inline_counters_read(counters_0);
+  return 0;
+}
+
+/// Like performance_counters_stop(), reading the counters with rdpmc if
+/// performance_counters_inline_available() says so.
+/// `values` has the same layout as for performance_counters_stop().
+i32 performance_counters_stop_inline(u64 *values);
+i32 performance_counters_stop_inline(u64 *values) {
+  if (inline_state <= 0 || !te.mapped) {
+    return performance_counters_stop(values);
+  }
+  inline_counters_read(counters_1);
+  if (track_time)
+    time_end = time_now();
+
+  for (usize i = 0; i < ev_count; i++) {
+    values[i] = slot_counted(i) ? counters_1[i] - counters_0[i] : 0;
+  }
+  subtract_overhead(values, inline_overhead);
+  return 0;
+}
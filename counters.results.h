@@ -0,0 +1,469 @@
+// =============================================================================
+// Result blocks and batches
+// Shared by counters.c and counters.linux.c, which include it once, after
+// the definitions it uses:
+//
+// - the u8 to f64 typedefs, KPC_MAX_COUNTERS and the headers it calls into
+// - `ev_count`, and `ev_req`/`ev_req_count` with the `slot` of each event
+// - `group_count`, and slot_in_group() to tell whether an event is counted
+//   while a group is
+// - performance_counters_cpu_perflevel()
+//
+// What reads the counters, result_publish() and the stop entry points,
+// stays in each backend.
+// =============================================================================
+
+// -----------------------------------------------------------------------------
+// Results
+// A result block is one buffer that JavaScript maps once and reads in place:
+// a header, then the values as u64 for exact counts and again as f64 so they
+// can be read as plain numbers. The stop entry points write straight into
+// it, so reading a result allocates nothing. Batches use the same header in
+// front of their rows.
+// -----------------------------------------------------------------------------
+
+/// Bits of `result_block.flags`.
+typedef enum {
+  RESULT_VALID = 1,       ///< A stop has written the values.
+  RESULT_INLINE = 2,      ///< The counters were read inline.
+  RESULT_MULTIPLEXED = 4, ///< Only the events of `group` were counted.
+  RESULT_RAW = 8,         ///< Batch rows without the overhead subtracted.
+} result_flag;
+
+typedef struct {
+  u64 event_count; ///< `n`, the number of values per row.
+  u64 flags;       ///< See `result_flag`.
+  u64 sequence;    ///< Incremented by every write.
+  u64 group;       ///< Group that was counted.
+  u64 rows;        ///< Rows of `n` values, 2 for a stop: raw, corrected.
+  u64 mirror;      ///< Offset of the f64 copy of the rows in `values`.
+  i64 cpu_start;   ///< CPU start() ran on, -1 if not tracked.
+  i64 cpu_end;     ///< CPU stop() ran on, -1 if not tracked.
+  u64 elapsed_ns;  ///< Wall time from start() to stop(), 0 if not tracked.
+  /// Index of each value's event in the list passed to init().
+  u64 event_ids[KPC_MAX_COUNTERS];
+  /// u64 rows, then at `mirror` the same rows as f64.
+  u64 values[];
+} result_block;
+
+#define RESULT_HEADER_SLOTS (sizeof(result_block) / sizeof(u64))
+
+/// Size of a result block for the current configuration, in 8 byte slots.
+u32 performance_counters_result_slots();
+u32 performance_counters_result_slots() {
+  return (u32)(RESULT_HEADER_SLOTS + 4 * ev_count);
+}
+
+/// Offset of `values` in a result block, in 8 byte slots.
+u32 performance_counters_result_header_slots();
+u32 performance_counters_result_header_slots() {
+  return (u32)RESULT_HEADER_SLOTS;
+}
+
+static void result_header(result_block *r, u64 rows, u64 mirror) {
+  memset(r, 0, sizeof(result_block));
+  r->event_count = ev_count;
+  r->rows = rows;
+  r->mirror = mirror;
+  r->cpu_start = r->cpu_end = -1;
+  for (usize i = 0; i < ev_req_count; i++) {
+    if (ev_req[i].slot >= 0)
+      r->event_ids[ev_req[i].slot] = i;
+  }
+}
+
+/// Write the header of `r` for the current configuration and clear it.
+/// @param r performance_counters_result_slots() slots.
+void performance_counters_result_init(result_block *r);
+void performance_counters_result_init(result_block *r) {
+  result_header(r, 2, 2 * ev_count);
+  memset(r->values, 0, 4 * ev_count * sizeof(u64));
+}
+
+/// Mirror the first `rows` rows of `r` as f64.
+static inline void result_mirror(result_block *r, usize rows) {
+  usize n = rows * r->event_count;
+  f64 *mirror = (f64 *)(r->values + r->mirror);
+  for (usize i = 0; i < n; i++) {
+    mirror[i] = (f64)r->values[i];
+  }
+}
+
+// -----------------------------------------------------------------------------
+// Batched runs
+// Every performance_counters_batch_stop() appends one row of deltas to a
+// native buffer, so repeated runs cost no allocation and no conversion on
+// the JavaScript side. Statistics are computed here once the batch is done.
+// -----------------------------------------------------------------------------
+
+/// Statistics written per event by performance_counters_batch_stats().
+typedef enum {
+  BATCH_STAT_MIN = 0,
+  BATCH_STAT_MEDIAN = 1,
+  BATCH_STAT_MEAN = 2,
+  BATCH_STAT_P99 = 3,
+  BATCH_STAT_STDDEV = 4,
+  BATCH_STAT_MAX = 5,
+  BATCH_STAT_TOTAL = 6,   ///< Sum of all rows, scaled by 1 / enabled.
+  BATCH_STAT_ENABLED = 7, ///< Fraction of the rows the event was counted in.
+  BATCH_STAT_COUNT
+} batch_stat;
+
+/// Rows of `ev_count` deltas, `batch_capacity` rows, after a result header.
+/// Per thread, like the start() baselines.
+static _Thread_local result_block *batch_block = NULL;
+static _Thread_local u64 *batch_samples = NULL;
+static _Thread_local usize batch_capacity = 0;
+static _Thread_local usize batch_count = 0;
+static _Thread_local bool batch_corrected = true;
+
+/// Group that was counted for each row.
+static _Thread_local u8 *batch_groups = NULL;
+
+/// Arm of each row for performance_counters_batch_compare(), and the arm
+/// the next row is recorded for.
+static _Thread_local u8 *batch_arms = NULL;
+static _Thread_local u8 batch_arm = 0;
+
+/// Wall time of each row in nanoseconds, 0 unless time is tracked.
+static _Thread_local u64 *batch_elapsed = NULL;
+
+/// CPU each row started and ended on, 2 per row, -1 if not tracked.
+static _Thread_local i16 *batch_cpus = NULL;
+
+/// Scratch column for sorting, `batch_capacity` values.
+static _Thread_local u64 *batch_column = NULL;
+
+/// Prepare a batch of `iterations` rows, reusing the previous buffer if it
+/// is big enough.
+/// @param corrected 1 to record deltas minus the calibrated overhead.
+const char *performance_counters_batch_begin(u32 iterations, u32 corrected);
+const char *performance_counters_batch_begin(u32 iterations, u32 corrected) {
+  if (!ev_count)
+    return "Counters are not configured";
+  if (!iterations)
+    return "No iterations";
+
+  // leave room for KPC_MAX_COUNTERS values per row, so a later init()
+  // with more events can still reuse the buffer
+  // the f64 copy of the rows follows them
+  if (iterations > batch_capacity) {
+    usize slots = (usize)iterations * KPC_MAX_COUNTERS;
+    result_block *block =
+        malloc(sizeof(result_block) + 2 * slots * sizeof(u64));
+    u64 *column = malloc((usize)iterations * sizeof(u64));
+    u8 *row_groups = malloc(iterations);
+    u8 *row_arms = malloc(iterations);
+    u64 *row_elapsed = malloc((usize)iterations * sizeof(u64));
+    i16 *row_cpus = malloc((usize)iterations * 2 * sizeof(i16));
+    if (!block || !column || !row_groups || !row_arms || !row_elapsed ||
+        !row_cpus) {
+      free(block);
+      free(column);
+      free(row_groups);
+      free(row_arms);
+      free(row_elapsed);
+      free(row_cpus);
+      return "Failed to allocate memory for batch";
+    }
+    free(batch_block);
+    free(batch_column);
+    free(batch_groups);
+    free(batch_arms);
+    free(batch_elapsed);
+    free(batch_cpus);
+    batch_cpus = row_cpus;
+    batch_arms = row_arms;
+    batch_elapsed = row_elapsed;
+    batch_block = block;
+    batch_samples = block->values;
+    batch_column = column;
+    batch_groups = row_groups;
+    batch_capacity = iterations;
+  }
+
+  batch_count = 0;
+  batch_arm = 0;
+  batch_corrected = corrected;
+  result_header(batch_block, 0, batch_capacity * KPC_MAX_COUNTERS);
+  return 0;
+}
+
+/// Number of rows recorded since performance_counters_batch_begin().
+u32 performance_counters_batch_count();
+u32 performance_counters_batch_count() { return (u32)batch_count; }
+
+/// The recorded rows, `batch_count * ev_count` values.
+u64 *performance_counters_batch_samples();
+u64 *performance_counters_batch_samples() { return batch_samples; }
+
+/// The batch as a result block, with an f64 copy of the rows, updated by
+/// performance_counters_batch_stats().
+result_block *performance_counters_batch_result();
+result_block *performance_counters_batch_result() { return batch_block; }
+
+static int batch_compare(const void *a, const void *b) {
+  u64 x = *(const u64 *)a, y = *(const u64 *)b;
+  return x < y ? -1 : x > y;
+}
+
+/// Wall time of the recorded rows together, in nanoseconds, 0 unless
+/// performance_counters_track_time() is on.
+u64 performance_counters_batch_elapsed_ns();
+u64 performance_counters_batch_elapsed_ns() {
+  u64 sum = 0;
+  for (usize r = 0; r < batch_count; r++)
+    sum += batch_elapsed[r];
+  return sum;
+}
+
+/// Record the next rows for arm `arm` of a comparison, 0 for A or 1 for B.
+void performance_counters_batch_arm(u32 arm);
+void performance_counters_batch_arm(u32 arm) { batch_arm = arm ? 1 : 0; }
+
+/// Group that was counted for the r-th row.
+u32 performance_counters_batch_row_group(u32 r);
+u32 performance_counters_batch_row_group(u32 r) {
+  return r < batch_count ? batch_groups[r] : 0;
+}
+
+/// CPU the r-th row started on, or ended on if `end` is 1. -1 if not
+/// tracked.
+i32 performance_counters_batch_row_cpu(u32 r, u32 end);
+i32 performance_counters_batch_row_cpu(u32 r, u32 end) {
+  return r < batch_count ? batch_cpus[2 * r + (end ? 1 : 0)] : -1;
+}
+
+/// Rows to drop with performance_counters_batch_discard().
+typedef enum {
+  DISCARD_CLUSTER = 1, ///< Rows that ended on another kind of core.
+  DISCARD_CPU = 2,     ///< Rows that ended on another CPU.
+} discard_kind;
+
+/// Drop the rows that migrated while they were measured, keeping the
+/// order of the others. Rows whose CPU was not tracked are kept.
+/// @param kind See `discard_kind`.
+/// @return Number of rows dropped.
+u32 performance_counters_batch_discard(u32 kind);
+u32 performance_counters_batch_discard(u32 kind) {
+  usize kept = 0;
+  for (usize r = 0; r < batch_count; r++) {
+    i32 from = batch_cpus[2 * r], to = batch_cpus[2 * r + 1];
+    if (from >= 0 && to >= 0) {
+      if (kind == DISCARD_CPU && from != to)
+        continue;
+      if (kind == DISCARD_CLUSTER && performance_counters_cpu_perflevel(from) !=
+                                         performance_counters_cpu_perflevel(to))
+        continue;
+    }
+    if (kept != r) {
+      memmove(batch_samples + kept * ev_count, batch_samples + r * ev_count,
+              ev_count * sizeof(u64));
+      batch_groups[kept] = batch_groups[r];
+      batch_arms[kept] = batch_arms[r];
+      batch_elapsed[kept] = batch_elapsed[r];
+      batch_cpus[2 * kept] = batch_cpus[2 * r];
+      batch_cpus[2 * kept + 1] = batch_cpus[2 * r + 1];
+    }
+    kept++;
+  }
+  u32 dropped = (u32)(batch_count - kept);
+  batch_count = kept;
+  return dropped;
+}
+
+/// Compute the statistics of the recorded rows.
+/// When the events are multiplexed, the statistics of an event only use
+/// the rows its group was counted for.
+/// @param out Receives `ev_count * BATCH_STAT_COUNT` values, see `batch_stat`.
+const char *performance_counters_batch_stats(f64 *out);
+const char *performance_counters_batch_stats(f64 *out) {
+  usize rows = batch_count;
+  if (!rows)
+    return "No samples";
+
+  batch_block->rows = rows;
+  batch_block->flags = RESULT_VALID | (batch_corrected ? 0 : RESULT_RAW) |
+                       (group_count > 1 ? RESULT_MULTIPLEXED : 0);
+  batch_block->sequence++;
+  result_mirror(batch_block, rows);
+
+  for (usize e = 0; e < ev_count; e++) {
+    f64 sum = 0;
+    usize n = 0;
+    for (usize r = 0; r < rows; r++) {
+      if (!slot_in_group(e, batch_groups[r]))
+        continue;
+      u64 val = batch_samples[r * ev_count + e];
+      batch_column[n++] = val;
+      sum += (f64)val;
+    }
+    f64 *stats = out + e * BATCH_STAT_COUNT;
+    if (!n) {
+      for (usize k = 0; k < BATCH_STAT_COUNT; k++)
+        stats[k] = NAN;
+      stats[BATCH_STAT_ENABLED] = 0;
+      continue;
+    }
+    qsort(batch_column, n, sizeof(u64), batch_compare);
+
+    f64 mean = sum / (f64)n;
+    f64 var = 0;
+    for (usize r = 0; r < n; r++) {
+      f64 d = (f64)batch_column[r] - mean;
+      var += d * d;
+    }
+    var = n > 1 ? var / (f64)(n - 1) : 0;
+
+    // nearest-rank percentile
+    usize p99 = (n * 99 + 99) / 100;
+    stats[BATCH_STAT_MIN] = (f64)batch_column[0];
+    stats[BATCH_STAT_MEDIAN] =
+        n % 2 ? (f64)batch_column[n / 2]
+              : ((f64)batch_column[n / 2 - 1] + (f64)batch_column[n / 2]) / 2;
+    stats[BATCH_STAT_MEAN] = mean;
+    stats[BATCH_STAT_P99] = (f64)batch_column[p99 - 1];
+    stats[BATCH_STAT_STDDEV] = sqrt(var);
+    stats[BATCH_STAT_MAX] = (f64)batch_column[n - 1];
+    stats[BATCH_STAT_TOTAL] = sum * (f64)rows / (f64)n;
+    stats[BATCH_STAT_ENABLED] = (f64)n / (f64)rows;
+  }
+  return 0;
+}
+
+/// Statistics written per event by performance_counters_batch_compare().
+typedef enum {
+  COMPARE_STAT_ROWS_A = 0,
+  COMPARE_STAT_ROWS_B = 1,
+  COMPARE_STAT_MEAN_A = 2,
+  COMPARE_STAT_MEAN_B = 3,
+  COMPARE_STAT_MEDIAN_A = 4,
+  COMPARE_STAT_MEDIAN_B = 5,
+  COMPARE_STAT_STDDEV_A = 6,
+  COMPARE_STAT_STDDEV_B = 7,
+  COMPARE_STAT_T = 8,  ///< Welch's t of mean B - mean A.
+  COMPARE_STAT_DF = 9, ///< Welch-Satterthwaite degrees of freedom.
+  COMPARE_STAT_P = 10, ///< Two-sided p-value of t.
+  COMPARE_STAT_COUNT
+} compare_stat;
+
+/// Continued fraction of the incomplete beta function, by the modified
+/// Lentz method.
+static f64 beta_fraction(f64 a, f64 b, f64 x) {
+  const f64 tiny = 1e-300;
+  f64 c = 1, d = 1 - (a + b) * x / (a + 1);
+  d = 1 / (fabs(d) < tiny ? tiny : d);
+  f64 h = d;
+  for (int m = 1; m <= 300; m++) {
+    for (int odd = 0; odd < 2; odd++) {
+      f64 num = odd ? -(a + m) * (a + b + m) * x /
+                          ((a + 2 * m) * (a + 2 * m + 1))
+                    : m * (b - m) * x / ((a + 2 * m - 1) * (a + 2 * m));
+      d = 1 + num * d;
+      d = 1 / (fabs(d) < tiny ? tiny : d);
+      c = 1 + num / c;
+      c = fabs(c) < tiny ? tiny : c;
+      h *= d * c;
+      if (odd && fabs(d * c - 1) < 1e-15)
+        return h;
+    }
+  }
+  return h;
+}
+
+/// Regularized incomplete beta function I_x(a, b).
+static f64 beta_regularized(f64 a, f64 b, f64 x) {
+  if (x <= 0)
+    return 0;
+  if (x >= 1)
+    return 1;
+  f64 front = exp(lgamma(a + b) - lgamma(a) - lgamma(b) + a * log(x) +
+                  b * log(1 - x));
+  // the fraction converges quickly on this side of the mean
+  if (x < (a + 1) / (a + b + 2))
+    return front * beta_fraction(a, b, x) / a;
+  return 1 - front * beta_fraction(b, a, 1 - x) / b;
+}
+
+/// Mean, median and sample variance of the rows of arm `arm` that count
+/// event `e`. Sorts them into `batch_column`.
+static usize compare_arm(usize e, u8 arm, f64 *mean, f64 *median, f64 *var) {
+  usize n = 0;
+  f64 sum = 0;
+  for (usize r = 0; r < batch_count; r++) {
+    if (batch_arms[r] != arm || !slot_in_group(e, batch_groups[r]))
+      continue;
+    u64 val = batch_samples[r * ev_count + e];
+    batch_column[n++] = val;
+    sum += (f64)val;
+  }
+  if (!n)
+    return 0;
+  qsort(batch_column, n, sizeof(u64), batch_compare);
+  *mean = sum / (f64)n;
+  *median = n % 2 ? (f64)batch_column[n / 2]
+                  : ((f64)batch_column[n / 2 - 1] + (f64)batch_column[n / 2]) /
+                        2;
+  f64 sq = 0;
+  for (usize r = 0; r < n; r++) {
+    f64 d = (f64)batch_column[r] - *mean;
+    sq += d * d;
+  }
+  *var = n > 1 ? sq / (f64)(n - 1) : 0;
+  return n;
+}
+
+/// Compare the rows recorded for arm A with those for arm B, see
+/// performance_counters_batch_arm(), with Welch's t-test, which doesn't
+/// assume the two have the same variance. When the events are multiplexed,
+/// an event is compared on the rows its group was counted for.
+/// @param out Receives `ev_count * COMPARE_STAT_COUNT` values, see
+///            `compare_stat`. t, df and p are NaN with fewer than 2 rows in
+///            an arm.
+const char *performance_counters_batch_compare(f64 *out);
+const char *performance_counters_batch_compare(f64 *out) {
+  if (!batch_count)
+    return "No samples";
+
+  for (usize e = 0; e < ev_count; e++) {
+    f64 *stats = out + e * COMPARE_STAT_COUNT;
+    for (usize k = 0; k < COMPARE_STAT_COUNT; k++)
+      stats[k] = NAN;
+    f64 mean_a = 0, median_a = 0, var_a = 0;
+    f64 mean_b = 0, median_b = 0, var_b = 0;
+    usize n_a = compare_arm(e, 0, &mean_a, &median_a, &var_a);
+    usize n_b = compare_arm(e, 1, &mean_b, &median_b, &var_b);
+    stats[COMPARE_STAT_ROWS_A] = (f64)n_a;
+    stats[COMPARE_STAT_ROWS_B] = (f64)n_b;
+    if (n_a) {
+      stats[COMPARE_STAT_MEAN_A] = mean_a;
+      stats[COMPARE_STAT_MEDIAN_A] = median_a;
+      stats[COMPARE_STAT_STDDEV_A] = sqrt(var_a);
+    }
+    if (n_b) {
+      stats[COMPARE_STAT_MEAN_B] = mean_b;
+      stats[COMPARE_STAT_MEDIAN_B] = median_b;
+      stats[COMPARE_STAT_STDDEV_B] = sqrt(var_b);
+    }
+    if (n_a < 2 || n_b < 2)
+      continue;
+
+    f64 se_a = var_a / (f64)n_a, se_b = var_b / (f64)n_b;
+    f64 se = se_a + se_b;
+    f64 diff = mean_b - mean_a;
+    if (se == 0) {
+      // both arms counted the same value every time
+      stats[COMPARE_STAT_T] = diff == 0 ? 0 : diff > 0 ? INFINITY : -INFINITY;
+      stats[COMPARE_STAT_DF] = (f64)(n_a + n_b - 2);
+      stats[COMPARE_STAT_P] = diff == 0 ? 1 : 0;
+      continue;
+    }
+    f64 t = diff / sqrt(se);
+    f64 df = se * se / (se_a * se_a / (f64)(n_a - 1) +
+                        se_b * se_b / (f64)(n_b - 1));
+    stats[COMPARE_STAT_T] = t;
+    stats[COMPARE_STAT_DF] = df;
+    stats[COMPARE_STAT_P] = beta_regularized(df / 2, 0.5, df / (df + t * t));
+  }
+  return 0;
+}
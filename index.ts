@@ -1,111 +1,2440 @@
-import { dlopen, ptr, suffix } from "bun:ffi";
+import { dlopen, ptr, suffix, toArrayBuffer } from "bun:ffi";
+import {
+  cpuInfo,
+  deriveMetrics,
+  metricEventNames,
+  type CountLookup,
+  type CpuInfo,
+} from "./metrics";
+
+export {
+  metricDefinitions,
+  type CpuInfo,
+  type MetricDefinition,
+} from "./metrics";
+export {
+  openTrace,
+  type Trace,
+  type TraceBlock,
+  type TraceEvent,
+} from "./trace";
 
 var countersBuffer: BigUint64Array;
-var countersBufferPtr;
 var lib;
 
+/**
+ * The result block `stop()` writes into: a header, the raw then the
+ * corrected counts as u64, and the same values as f64.
+ */
+var results: BigUint64Array | null = null;
+var resultsPtr = 0;
+/** The header as 32 bit words, its slots are at even indices. */
+var resultsHeader: Uint32Array | null = null;
+/** `countersBuffer` as numbers. */
+var countersNumbers: Float64Array | null = null;
+
 var performance_counters_init;
 var performance_counters_start;
-var performance_counters_stop;
+var performance_counters_open;
+var performance_counters_sample;
+var performance_counters_close;
+var performance_counters_start_inline;
+var performance_counters_batch_stop;
+var performance_counters_stop_result;
+var performance_counters_stop_inline_result;
+var performance_counters_region_enter;
+var performance_counters_region_exit;
+
+/** Whether this context holds a reference on the shared session. */
+var retained = false;
+
+/** Number of scheduled events; `countersBuffer` holds twice as many values. */
+var eventCount = 0;
+/** 0 to read raw values, `eventCount` to read overhead-corrected values. */
+var valueOffset = 0;
+var overheadBuffer: BigUint64Array | null = null;
+var inlineOverheadBuffer: BigUint64Array | null = null;
+
+var cyclesIndex = -1;
+var instructionsIndex = -1;
+var branchesIndex = -1;
+var missedBranchesIndex = -1;
+
+const symbols = {
+  performance_counters_init: {
+    returns: "cstring",
+    args: ["ptr"],
+  },
+  performance_counters_start: {
+    returns: "i32",
+    args: [],
+  },
+  performance_counters_last_error: {
+    returns: "cstring",
+    args: [],
+  },
+  performance_counters_stop: {
+    args: ["ptr"],
+    returns: "i32",
+  },
+  performance_counters_open: {
+    returns: "cstring",
+    args: [],
+  },
+  performance_counters_sample: {
+    args: ["ptr"],
+    returns: "cstring",
+  },
+  performance_counters_close: {
+    returns: "cstring",
+    args: [],
+  },
+  performance_counters_counter_count: {
+    returns: "u32",
+    args: [],
+  },
+  performance_counters_event_count: {
+    returns: "u32",
+    args: [],
+  },
+  performance_counters_event_name: {
+    returns: "cstring",
+    args: ["u32"],
+  },
+  performance_counters_event_db_name: {
+    returns: "cstring",
+    args: ["u32"],
+  },
+  performance_counters_event_alias: {
+    returns: "cstring",
+    args: ["u32"],
+  },
+  performance_counters_event_mode: {
+    returns: "u32",
+    args: ["u32"],
+  },
+  performance_counters_event_slot: {
+    returns: "i32",
+    args: ["u32"],
+  },
+  performance_counters_event_status: {
+    returns: "i32",
+    args: ["u32"],
+  },
+  performance_counters_error_desc: {
+    returns: "cstring",
+    args: ["i32"],
+  },
+  performance_counters_db_open: {
+    returns: "cstring",
+    args: [],
+  },
+  performance_counters_db_name: {
+    returns: "cstring",
+    args: [],
+  },
+  performance_counters_db_marketing_name: {
+    returns: "cstring",
+    args: [],
+  },
+  performance_counters_db_cpu_id: {
+    returns: "cstring",
+    args: [],
+  },
+  performance_counters_db_fixed_counter_count: {
+    returns: "u32",
+    args: [],
+  },
+  performance_counters_db_config_counter_count: {
+    returns: "u32",
+    args: [],
+  },
+  performance_counters_db_power_counter_count: {
+    returns: "u32",
+    args: [],
+  },
+  performance_counters_db_event_count: {
+    returns: "u32",
+    args: [],
+  },
+  performance_counters_db_event_name: {
+    returns: "cstring",
+    args: ["u32"],
+  },
+  performance_counters_db_event_alias: {
+    returns: "cstring",
+    args: ["u32"],
+  },
+  performance_counters_db_event_description: {
+    returns: "cstring",
+    args: ["u32"],
+  },
+  performance_counters_db_event_fallback: {
+    returns: "cstring",
+    args: ["u32"],
+  },
+  performance_counters_db_event_mask: {
+    returns: "u32",
+    args: ["u32"],
+  },
+  performance_counters_db_event_is_fixed: {
+    returns: "u32",
+    args: ["u32"],
+  },
+  performance_counters_inline_available: {
+    returns: "u32",
+    args: [],
+  },
+  performance_counters_inline_mask: {
+    returns: "u32",
+    args: [],
+  },
+  performance_counters_start_inline: {
+    returns: "i32",
+    args: [],
+  },
+  performance_counters_stop_inline: {
+    args: ["ptr"],
+    returns: "i32",
+  },
+  performance_counters_set_overhead: {
+    args: ["ptr", "u32"],
+    returns: "void",
+  },
+  performance_counters_batch_begin: {
+    args: ["u32", "u32"],
+    returns: "cstring",
+  },
+  performance_counters_batch_stop: {
+    args: [],
+    returns: "i32",
+  },
+  performance_counters_batch_count: {
+    args: [],
+    returns: "u32",
+  },
+  performance_counters_batch_samples: {
+    args: [],
+    returns: "ptr",
+  },
+  performance_counters_batch_stats: {
+    args: ["ptr"],
+    returns: "cstring",
+  },
+  performance_counters_batch_arm: {
+    args: ["u32"],
+    returns: "void",
+  },
+  performance_counters_batch_compare: {
+    args: ["ptr"],
+    returns: "cstring",
+  },
+  performance_counters_retain: {
+    args: [],
+    returns: "u32",
+  },
+  performance_counters_release: {
+    args: [],
+    returns: "cstring",
+  },
+  performance_counters_thread_id: {
+    args: [],
+    returns: "u64",
+  },
+  performance_counters_cpu_count: {
+    args: [],
+    returns: "u32",
+  },
+  performance_counters_set_max_groups: {
+    args: ["u32"],
+    returns: "void",
+  },
+  performance_counters_group_count: {
+    args: [],
+    returns: "u32",
+  },
+  performance_counters_active_group: {
+    args: [],
+    returns: "u32",
+  },
+  performance_counters_slot_group: {
+    args: ["u32"],
+    returns: "i32",
+  },
+  performance_counters_rotate: {
+    args: [],
+    returns: "cstring",
+  },
+  performance_counters_batch_row_group: {
+    args: ["u32"],
+    returns: "u32",
+  },
+  performance_counters_pmu_version: {
+    args: [],
+    returns: "u32",
+  },
+  performance_counters_result_slots: {
+    args: [],
+    returns: "u32",
+  },
+  performance_counters_result_header_slots: {
+    args: [],
+    returns: "u32",
+  },
+  performance_counters_result_init: {
+    args: ["ptr"],
+    returns: "void",
+  },
+  performance_counters_stop_result: {
+    args: ["ptr"],
+    returns: "i32",
+  },
+  performance_counters_stop_inline_result: {
+    args: ["ptr"],
+    returns: "i32",
+  },
+  performance_counters_batch_result: {
+    args: [],
+    returns: "ptr",
+  },
+  performance_counters_prefer_cores: {
+    args: ["u32"],
+    returns: "cstring",
+  },
+  performance_counters_track_cpu: {
+    args: ["u32"],
+    returns: "void",
+  },
+  performance_counters_track_time: {
+    args: ["u32"],
+    returns: "void",
+  },
+  performance_counters_elapsed_ns: {
+    args: [],
+    returns: "u64",
+  },
+  performance_counters_batch_elapsed_ns: {
+    args: [],
+    returns: "u64",
+  },
+  performance_counters_energy_nj: {
+    args: [],
+    returns: "u64",
+  },
+  performance_counters_cpu_start: {
+    args: [],
+    returns: "i32",
+  },
+  performance_counters_cpu_end: {
+    args: [],
+    returns: "i32",
+  },
+  performance_counters_cpu_perflevel: {
+    args: ["i32"],
+    returns: "i32",
+  },
+  performance_counters_batch_row_cpu: {
+    args: ["u32", "u32"],
+    returns: "i32",
+  },
+  performance_counters_batch_discard: {
+    args: ["u32"],
+    returns: "u32",
+  },
+} as const;
+
+/** Symbols only the macOS library exports, see `load()`. */
+const darwinSymbols = {
+  performance_counters_set_cache_dir: {
+    args: ["ptr"],
+    returns: "void",
+  },
+  performance_counters_config_cached: {
+    args: [],
+    returns: "u32",
+  },
+  performance_counters_profile_process: {
+    args: ["i32", "f64", "f64"],
+    returns: "cstring",
+  },
+  performance_counters_profile_thread_count: {
+    args: [],
+    returns: "u32",
+  },
+  performance_counters_profile_thread_tid: {
+    args: ["u32"],
+    returns: "u32",
+  },
+  performance_counters_profile_thread_time: {
+    args: ["u32"],
+    returns: "u64",
+  },
+  performance_counters_profile_thread_values: {
+    args: ["u32", "ptr"],
+    returns: "void",
+  },
+  performance_counters_profile_total: {
+    args: ["ptr"],
+    returns: "void",
+  },
+  performance_counters_profile_dropped: {
+    args: [],
+    returns: "u64",
+  },
+  performance_counters_profile_record: {
+    args: ["i32", "f64", "f64", "ptr"],
+    returns: "cstring",
+  },
+  performance_counters_profile_overflows: {
+    args: [],
+    returns: "u32",
+  },
+  performance_counters_profile_stacks: {
+    args: ["i32", "f64", "f64", "u32", "u32", "ptr"],
+    returns: "cstring",
+  },
+  performance_counters_profile_overflow: {
+    args: ["i32", "u64", "f64", "u32", "u32", "ptr"],
+    returns: "cstring",
+  },
+  performance_counters_profile_stack_count: {
+    args: [],
+    returns: "u32",
+  },
+  performance_counters_profile_stack_samples: {
+    args: [],
+    returns: "u64",
+  },
+  performance_counters_profile_stack_folded: {
+    args: [],
+    returns: "cstring",
+  },
+  performance_counters_read_thread: {
+    args: ["u32", "ptr"],
+    returns: "cstring",
+  },
+  performance_counters_handle_create: {
+    args: [],
+    returns: "ptr",
+  },
+  performance_counters_handle_free: {
+    args: ["ptr"],
+    returns: "void",
+  },
+  performance_counters_handle_count: {
+    args: [],
+    returns: "u32",
+  },
+  performance_counters_handle_start: {
+    args: ["ptr"],
+    returns: "i32",
+  },
+  performance_counters_handle_stop: {
+    args: ["ptr", "ptr"],
+    returns: "i32",
+  },
+  performance_counters_handle_update: {
+    args: ["ptr"],
+    returns: "i32",
+  },
+  performance_counters_handle_read: {
+    args: ["ptr", "ptr"],
+    returns: "void",
+  },
+  performance_counters_handle_tid: {
+    args: ["ptr"],
+    returns: "u64",
+  },
+  performance_counters_sample_cpus: {
+    args: ["ptr", "u32"],
+    returns: "cstring",
+  },
+  performance_counters_cpu_current: {
+    args: [],
+    returns: "i32",
+  },
+  performance_counters_perflevel_count: {
+    args: [],
+    returns: "u32",
+  },
+  performance_counters_perflevel_cpus: {
+    args: ["u32"],
+    returns: "u32",
+  },
+  performance_counters_perflevel_name: {
+    args: ["u32"],
+    returns: "cstring",
+  },
+  performance_counters_telemetry_start: {
+    args: ["f64", "u32"],
+    returns: "cstring",
+  },
+  performance_counters_telemetry_stop: {
+    args: [],
+    returns: "cstring",
+  },
+  performance_counters_telemetry_stride: {
+    args: [],
+    returns: "u32",
+  },
+  performance_counters_telemetry_drain: {
+    args: ["ptr", "u32"],
+    returns: "u32",
+  },
+  performance_counters_telemetry_dropped: {
+    args: [],
+    returns: "u64",
+  },
+  performance_counters_region_intern: {
+    args: ["ptr"],
+    returns: "u32",
+  },
+  performance_counters_region_name: {
+    args: ["u32"],
+    returns: "cstring",
+  },
+  performance_counters_region_enter: {
+    args: ["u32"],
+    returns: "i32",
+  },
+  performance_counters_region_exit: {
+    args: [],
+    returns: "i32",
+  },
+  performance_counters_region_reset: {
+    args: [],
+    returns: "void",
+  },
+  performance_counters_region_depth: {
+    args: [],
+    returns: "u32",
+  },
+  performance_counters_region_node_count: {
+    args: [],
+    returns: "u32",
+  },
+  performance_counters_region_node_region: {
+    args: ["u32"],
+    returns: "u32",
+  },
+  performance_counters_region_node_parent: {
+    args: ["u32"],
+    returns: "u32",
+  },
+  performance_counters_region_node_calls: {
+    args: ["u32"],
+    returns: "u64",
+  },
+  performance_counters_region_node_values: {
+    args: ["u32", "ptr"],
+    returns: "void",
+  },
+} as const;
 
-export function init() {
+function load() {
   if (lib) return;
-  if (process.platform === "linux") {
-    throw new Error("This package is not supported on Linux yet");
+  const path = import.meta.dir + `/counters.${process.arch}.${suffix}`;
+  if (process.platform === "darwin") {
+    lib = dlopen(path, { ...symbols, ...darwinSymbols });
+  } else if (process.platform === "linux") {
+    // counters.linux.c only has the core entry points, the macOS-only
+    // features throw when they are used
+    const linux = dlopen(path, symbols);
+    const unsupported = {};
+    for (const name in darwinSymbols) {
+      unsupported[name] = () => {
+        throw new Error(`${name} is not supported on Linux`);
+      };
+    }
+    lib = {
+      symbols: { ...unsupported, ...linux.symbols },
+      close: () => linux.close(),
+    };
+  } else {
+    throw new Error(`This package is not supported on ${process.platform}`);
   }
 
-  lib = dlopen(import.meta.dir + `/counters.${process.arch}.${suffix}`, {
-    performance_counters_init: {
-      returns: "cstring",
-      args: [],
-    },
-    performance_counters_start: {
-      returns: "cstring",
-      args: [],
-    },
-    performance_counters_stop: {
-      args: ["ptr"],
-      returns: "cstring",
-    },
-  });
-
   performance_counters_init = lib.symbols.performance_counters_init;
   performance_counters_start = lib.symbols.performance_counters_start;
-  performance_counters_stop = lib.symbols.performance_counters_stop;
+  performance_counters_open = lib.symbols.performance_counters_open;
+  performance_counters_sample = lib.symbols.performance_counters_sample;
+  performance_counters_close = lib.symbols.performance_counters_close;
+  performance_counters_start_inline =
+    lib.symbols.performance_counters_start_inline;
+  performance_counters_batch_stop = lib.symbols.performance_counters_batch_stop;
+  performance_counters_stop_result =
+    lib.symbols.performance_counters_stop_result;
+  performance_counters_stop_inline_result =
+    lib.symbols.performance_counters_stop_inline_result;
+  performance_counters_region_enter =
+    lib.symbols.performance_counters_region_enter;
+  performance_counters_region_exit =
+    lib.symbols.performance_counters_region_exit;
+}
+
+/** Layout of a result block, in 8 byte slots. */
+export const ResultLayout = {
+  EVENT_COUNT: 0,
+  FLAGS: 1,
+  SEQUENCE: 2,
+  GROUP: 3,
+  ROWS: 4,
+  MIRROR: 5,
+  /** CPU `start()` and `stop()` ran on, -1 unless `trackCpu()` is on. */
+  CPU_START: 6,
+  CPU_END: 7,
+  /** Wall time from `start()` to `stop()`, 0 unless `trackTime()` is on. */
+  ELAPSED_NS: 8,
+  EVENT_IDS: 9,
+  /** Bits of `FLAGS`. */
+  VALID: 1,
+  INLINE: 2,
+  MULTIPLEXED: 4,
+  RAW: 8,
+} as const;
+
+/**
+ * `"user"` for an event named like `"cycles:u"`, `"kernel"` for
+ * `"cycles:k"`, `"all"` without a suffix. On Linux, an event without a
+ * suffix is `"user"` when the process may not count the kernel.
+ */
+export type EventMode = "all" | "user" | "kernel";
+
+const EVENT_MODES: EventMode[] = ["all", "user", "kernel"];
+
+/** `"cycles:uk"` is `"cycles:u"` and `"cycles:k"`, counted side by side. */
+function expandModes(names: string[]): string[] {
+  return names.flatMap((name) =>
+    /:uk$/i.test(name)
+      ? [name.slice(0, -1), name.slice(0, -2) + name.slice(-1)]
+      : [name]
+  );
+}
+
+export interface EventInfo {
+  /** The name as it was passed to `init()`. */
+  name: string;
+  /** The name of the event in the CPU's PMC database, if it was found. */
+  event: string | null;
+  /** "cycles", "instructions", "branches" or "branch-misses", if it is one of those. */
+  alias: string | null;
+  /** Where the event counts, see `EventMode`. */
+  mode: EventMode;
+  /** Whether the event could be scheduled on the available counters. */
+  scheduled: boolean;
+  /** Index in `countersBuffer`, or -1 if the event is not counted. */
+  index: number;
+  /**
+   * Counter group of a multiplexed event, or -1 if it is counted all the
+   * time. Only the values of the group programmed for a run are updated.
+   */
+  group: number;
+  /** Why the event is not counted. */
+  error?: string;
+}
+
+export interface InitResult {
+  /** All requested events, in the order they were passed. */
+  events: EventInfo[];
+  /**
+   * Receives two values per scheduled event when you call `stop()`: the raw
+   * counts at `index`, then the overhead-corrected counts at
+   * `events.length + index`.
+   */
+  countersBuffer: BigUint64Array;
+  /** Median count of an empty `run()`, per scheduled event. */
+  overhead: BigUint64Array | null;
+  /**
+   * The counters were programmed from the config cache, without loading
+   * the pmc database. Always false on Linux.
+   */
+  cached: boolean;
+}
+
+export interface InitOptions {
+  /**
+   * Measure the cost of an empty `run()` and subtract it from every
+   * result. Defaults to true.
+   */
+  calibrate?: boolean;
+  /** How many empty runs to take the median of. Defaults to 1000. */
+  calibrationRuns?: number;
+  /**
+   * Split events that don't fit on the counters together into groups that
+   * take turns, one per `start()`, instead of skipping them. `true` allows
+   * up to 8 groups, or pass the maximum. Defaults to false.
+   * On macOS the groups are programmed for the whole process, so `init()`
+   * and `start()` throw while another worker has the counters open.
+   */
+  multiplex?: boolean | number;
+  /**
+   * Directory of the config cache, or false to resolve the events from
+   * the pmc database every time. Defaults to `$HW_PERF_COUNTERS_CACHE`,
+   * else `hw-perf-counters-<uid>` in the temporary directory, which is
+   * created private to the user. macOS only.
+   */
+  cache?: string | false;
+}
+
+var events: EventInfo[] = [];
+/** The last `init()` was programmed from the config cache. */
+var cached = false;
+
+/**
+ * Load the counters library and configure the counters.
+ *
+ * @param eventNames Event names from `/usr/share/kpep/<name>.plist` (e.g.
+ * `"L1D_CACHE_MISS_LD"`), their aliases (e.g. `"Instructions"`), or one of
+ * `"cycles"`, `"instructions"`, `"branches"` and `"branch-misses"`. Defaults
+ * to those four. Events that don't exist or don't fit on the available
+ * counters are skipped; check `scheduled` on the returned events.
+ * Append `:u` to count an event in user space only, `:k` for the kernel
+ * only, or `:uk` for both as two events, see `count.split()`.
+ */
+export function init(
+  eventNames?: string[],
+  options?: InitOptions
+): InitResult {
+  if (countersBuffer && !eventNames)
+    return { events, countersBuffer, overhead: overheadBuffer, cached };
+  load();
 
-  const out = performance_counters_init();
+  const spec = eventNames?.length
+    ? Buffer.from(expandModes(eventNames).join(",") + "\0")
+    : null;
+  const multiplex = options?.multiplex;
+  lib.symbols.performance_counters_set_max_groups(
+    multiplex === true ? 8 : multiplex ? multiplex : 1
+  );
+  const darwin = process.platform === "darwin";
+  if (darwin) {
+    const dir = options?.cache;
+    const path = typeof dir === "string" ? Buffer.from(dir + "\0") : null;
+    lib.symbols.performance_counters_set_cache_dir(
+      dir === false ? ptr(Buffer.from("\0")) : path ? ptr(path) : null
+    );
+  }
+  // retain first: init() refuses to reconfigure under other contexts
+  if (!retained) {
+    lib.symbols.performance_counters_retain();
+    retained = true;
+  }
+  const out = performance_counters_init(spec ? ptr(spec) : null);
   if (out && out.length) {
     throw new Error(out);
   }
 
-  count.countersBuffer = countersBuffer = new BigUint64Array(4);
-  countersBufferPtr = ptr(countersBuffer);
+  cached = darwin && lib.symbols.performance_counters_config_cached() !== 0;
+  events = readEvents();
+  eventCount = valueOffset = lib.symbols.performance_counters_counter_count();
+  const header = lib.symbols.performance_counters_result_header_slots();
+  results = new BigUint64Array(lib.symbols.performance_counters_result_slots());
+  resultsPtr = ptr(results);
+  lib.symbols.performance_counters_result_init(resultsPtr);
+  resultsHeader = new Uint32Array(results.buffer, 0, header * 2);
+  countersBuffer = results.subarray(header, header + eventCount * 2);
+  countersNumbers = new Float64Array(
+    results.buffer,
+    (header + eventCount * 2) * 8,
+    eventCount * 2
+  );
+  count.countersBuffer = countersBuffer;
+  count.values = countersNumbers;
+  count.results = results;
+
+  cyclesIndex = count.cyclesOffset = indexOf("cycles");
+  instructionsIndex = count.instructionsOffset = indexOf("instructions");
+  branchesIndex = count.branchesOffset = indexOf("branches");
+  missedBranchesIndex = count.missedBranchesOffset = indexOf("branch-misses");
+
+  overheadBuffer = inlineOverheadBuffer = null;
+  if (options?.calibrate ?? true) {
+    const runs = options?.calibrationRuns ?? 1000;
+    overheadBuffer = calibrate(runs, start, stop, 0);
+    if (inlineAvailable()) {
+      inlineOverheadBuffer = calibrate(runs, startInline, stopInline, 1);
+    }
+  }
+
+  return { events, countersBuffer, overhead: overheadBuffer, cached };
 }
 
-export function start() {
-  const str = performance_counters_start();
+function noop() {}
+
+/**
+ * Take the median of what `runs` empty measurements count, per event, and
+ * make the native side subtract it from later results.
+ */
+function calibrate(
+  runs: number,
+  begin: () => void,
+  end: () => void,
+  inlineReads: number
+) {
+  const n = eventCount;
+  const samples = new BigUint64Array(runs * n);
+  const groups = new Uint32Array(runs);
+  const column = new BigUint64Array(runs);
+  const median = new BigUint64Array(n);
+  const multiplexed = lib.symbols.performance_counters_group_count() > 1;
+
+  lib.symbols.performance_counters_set_overhead(null, inlineReads);
+  // make sure the measured path is as warm as it will be later
+  for (let i = 0; i < 100; i++) {
+    begin();
+    noop();
+    end();
+  }
+  for (let r = 0; r < runs; r++) {
+    begin();
+    noop();
+    end();
+    samples.set(countersBuffer.subarray(0, n), r * n);
+    if (multiplexed)
+      groups[r] = lib.symbols.performance_counters_active_group();
+  }
+
+  // a multiplexed event only counts in the runs of its group
+  for (let e = 0; e < n; e++) {
+    const group = multiplexed
+      ? lib.symbols.performance_counters_slot_group(e)
+      : -1;
+    let count = 0;
+    for (let r = 0; r < runs; r++) {
+      if (group < 0 || groups[r] === group) {
+        column[count++] = samples[r * n + e];
+      }
+    }
+    median[e] = count ? column.subarray(0, count).sort()[count >> 1] : 0n;
+  }
+  lib.symbols.performance_counters_set_overhead(ptr(median), inlineReads);
+  return median;
+}
+
+function readEvents(): EventInfo[] {
+  const {
+    performance_counters_event_count,
+    performance_counters_event_name,
+    performance_counters_event_db_name,
+    performance_counters_event_alias,
+    performance_counters_event_slot,
+    performance_counters_event_status,
+    performance_counters_error_desc,
+  } = lib.symbols;
+
+  const list: EventInfo[] = [];
+  for (let i = 0, n = performance_counters_event_count(); i < n; i++) {
+    const index = performance_counters_event_slot(i);
+    const status = performance_counters_event_status(i);
+    const info: EventInfo = {
+      name: String(performance_counters_event_name(i)),
+      event: performance_counters_event_db_name(i)?.toString() || null,
+      alias: performance_counters_event_alias(i)?.toString() || null,
+      mode: EVENT_MODES[lib.symbols.performance_counters_event_mode(i)],
+      scheduled: index >= 0,
+      index,
+      group:
+        index >= 0 ? lib.symbols.performance_counters_slot_group(index) : -1,
+    };
+    if (index < 0) info.error = String(performance_counters_error_desc(status));
+    list.push(info);
+  }
+  return list;
+}
+
+function indexOf(alias: string) {
+  for (const event of events) {
+    if (event.alias === alias && event.index >= 0) return event.index;
+  }
+  return -1;
+}
+
+/** Events passed to the last `init()` call. */
+export function configuredEvents(): EventInfo[] {
+  return events;
+}
+
+export interface CatalogEvent {
+  /** Unique name, such as "INST_RETIRED.ANY". */
+  name: string;
+  /** Alias, such as "Instructions". */
+  alias: string | null;
+  description: string | null;
+  /** Whether the event is counted by a fixed counter. */
+  fixed: boolean;
+  /** Configurable event that can count the same thing as this fixed one. */
+  fallback: string | null;
+  /** Bitmask of the counters this event can be scheduled on. */
+  counterMask: number;
+  /** Indices of the counters this event can be scheduled on. */
+  counters: number[];
+}
+
+export interface Catalog {
+  /** Database name, such as "a14" or "haswell". */
+  name: string;
+  /** Marketing name, such as "Apple A14/M1". */
+  marketingName: string;
+  /** Plist name in /usr/share/kpep. */
+  cpuId: string;
+  fixedCounters: number;
+  configurableCounters: number;
+  powerCounters: number;
+  events: CatalogEvent[];
+}
+
+/**
+ * List every event in the PMC database of the current CPU.
+ *
+ * This does not require root privileges and does not need `init()`.
+ */
+export function listEvents(): Catalog {
+  load();
+  const str = lib.symbols.performance_counters_db_open();
   if (str?.length) {
     throw new Error(str);
   }
+
+  const {
+    performance_counters_db_event_count,
+    performance_counters_db_event_name,
+    performance_counters_db_event_alias,
+    performance_counters_db_event_description,
+    performance_counters_db_event_fallback,
+    performance_counters_db_event_mask,
+    performance_counters_db_event_is_fixed,
+  } = lib.symbols;
+
+  const list: CatalogEvent[] = [];
+  for (let i = 0, n = performance_counters_db_event_count(); i < n; i++) {
+    const counterMask = performance_counters_db_event_mask(i);
+    const counters: number[] = [];
+    for (let bit = 0; bit < 32; bit++) {
+      if (counterMask & (1 << bit)) counters.push(bit);
+    }
+    list.push({
+      name: String(performance_counters_db_event_name(i)),
+      alias: performance_counters_db_event_alias(i)?.toString() || null,
+      description:
+        performance_counters_db_event_description(i)?.toString() || null,
+      fixed: !!performance_counters_db_event_is_fixed(i),
+      fallback: performance_counters_db_event_fallback(i)?.toString() || null,
+      counterMask,
+      counters,
+    });
+  }
+
+  return {
+    name: String(lib.symbols.performance_counters_db_name()),
+    marketingName: String(lib.symbols.performance_counters_db_marketing_name()),
+    cpuId: String(lib.symbols.performance_counters_db_cpu_id()),
+    fixedCounters: lib.symbols.performance_counters_db_fixed_counter_count(),
+    configurableCounters:
+      lib.symbols.performance_counters_db_config_counter_count(),
+    powerCounters: lib.symbols.performance_counters_db_power_counter_count(),
+    events: list,
+  };
+}
+
+/**
+ * Message of the last failure on the calling thread. The hot calls return
+ * an integer status so they don't pass a string to JavaScript each time,
+ * this is only read when one of them failed.
+ */
+export function lastError(): string {
+  return lib.symbols.performance_counters_last_error() || "unknown error";
+}
+
+export function start() {
+  if (performance_counters_start() !== 0) {
+    throw new Error(lastError());
+  }
 }
 
-export function run(func: CallableFunction) {
+export interface RunOptions {
+  /**
+   * Subtract the overhead measured by `init()` from the counts in `count`.
+   * Defaults to true. The raw counts are always available in `count.raw`.
+   */
+  correct?: boolean;
+}
+
+export function run(func: CallableFunction, options?: RunOptions) {
   start();
   func();
   stop();
 
+  if (options?.correct === false) valueOffset = 0;
+  return count;
+}
+
+/** Waits for a promise without counting, see `runAsync()`. */
+export type Track = <T>(promise: T | PromiseLike<T>) => Promise<Awaited<T>>;
+
+/** Counts accumulated over the segments of one `runAsync()`. */
+interface AsyncMeasure {
+  values: Float64Array;
+  counters: BigUint64Array;
+}
+
+/** The `runAsync()` whose segment is being counted on this thread. */
+var asyncCurrent: AsyncMeasure | null = null;
+
+function asyncResume(measure: AsyncMeasure) {
+  if (asyncCurrent === measure) return;
+  // another measured context kept counting over an await it didn't track
+  if (asyncCurrent) asyncPause(asyncCurrent);
+  start();
+  asyncCurrent = measure;
+}
+
+function asyncPause(measure: AsyncMeasure) {
+  if (asyncCurrent !== measure) return;
+  stop();
+  asyncCurrent = null;
+  const { values, counters } = measure;
+  for (let i = 0, n = eventCount * 2; i < n; i++) {
+    values[i] += countersNumbers[i];
+    counters[i] += countersBuffer[i];
+  }
+}
+
+/**
+ * Measure an async function, counting only while it runs on this thread.
+ *
+ * The counters are per thread, so a plain `run()` of an async function
+ * stops at its first `await`, and counting across the awaits would include
+ * every other task the event loop ran meanwhile. Await through `track()`
+ * instead: counting pauses until the promise settles and resumes for the
+ * continuation. The segments are added up into `count`.
+ *
+ * Bun has no hook for where an await suspends the function, so each
+ * resumed segment ends with a pause queued behind its continuation. Code
+ * that resumes after an await that was not tracked is therefore not
+ * counted, and neither is anything else that runs meanwhile. In Node,
+ * node.mjs pauses and resumes from async_hooks, which counts those
+ * segments too. Multiplexed events are not supported, every segment would
+ * count another group.
+ *
+ * ```js
+ * const { instructions } = await runAsync(async (track) => {
+ *   const body = await track(request.json());
+ *   return handle(body);
+ * });
+ * ```
+ */
+export async function runAsync(
+  func: (track: Track) => unknown,
+  options?: RunOptions
+) {
+  if (!countersBuffer) init();
+  if (lib.symbols.performance_counters_group_count() > 1) {
+    throw new Error("runAsync() can't measure multiplexed events");
+  }
+
+  const measure: AsyncMeasure = {
+    values: new Float64Array(eventCount * 2),
+    counters: new BigUint64Array(eventCount * 2),
+  };
+  const pause = () => asyncPause(measure);
+  // the reaction runs right before the continuation of the await; the pause
+  // it queues runs right after, once the continuation suspends again
+  const resume = () => {
+    asyncResume(measure);
+    queueMicrotask(pause);
+  };
+  const track: Track = (promise) => {
+    pause();
+    const settled = Promise.resolve(promise);
+    settled.then(resume, resume);
+    return settled;
+  };
+
+  asyncResume(measure);
+  try {
+    const result = Promise.resolve(func(track));
+    // func returned at its first await, or is done
+    pause();
+    result.then(pause, pause);
+    await result;
+  } finally {
+    pause();
+  }
+
+  countersNumbers.set(measure.values);
+  countersBuffer.set(measure.counters);
+  valueOffset = options?.correct === false ? 0 : eventCount;
   return count;
 }
 
+export interface RunManyOptions {
+  /** Runs before measuring, which are not recorded. Defaults to 10. */
+  warmup?: number;
+  /** Subtract the overhead measured by `init()`. Defaults to true. */
+  correct?: boolean;
+  /** Kind of cores to run on, see `preferCores()`. */
+  cores?: Cores;
+  /**
+   * Drop the iterations that moved to another kind of core ("cluster") or
+   * to another CPU ("cpu") before computing the statistics. Turns on
+   * `trackCpu()` for the run.
+   */
+  discardMigrated?: "cluster" | "cpu";
+  /** Time every iteration, for `elapsedNs` and `ghz`, see `trackTime()`. */
+  trackTime?: boolean;
+  /** Clock to normalize to, in GHz, for `normalizedNs`. */
+  referenceGhz?: number;
+}
+
+export interface EventStats {
+  min: number;
+  median: number;
+  mean: number;
+  /** 99th percentile (nearest rank). */
+  p99: number;
+  /** Sample standard deviation. */
+  stddev: number;
+  max: number;
+  /** Sum of every iteration, scaled by 1 / `enabled` when multiplexed. */
+  total: number;
+  /** Fraction of the iterations the event was counted in. */
+  enabled: number;
+  /** Whether `total` is estimated from part of the iterations. */
+  extrapolated: boolean;
+}
+
+export interface RunManyResult {
+  /** Iterations kept, see `discarded`. */
+  iterations: number;
+  /** Iterations dropped by `discardMigrated`. */
+  discarded: number;
+  /**
+   * CPU each kept iteration started and ended on, when `trackCpu()` or
+   * `discardMigrated` is on.
+   */
+  cpus: { start: Int32Array; end: Int32Array } | null;
+  /** Statistics per scheduled event, by the name passed to `init()`. */
+  stats: Record<string, EventStats>;
+  /** Derived metrics of the totals, see `metrics()`. */
+  metrics: Record<string, number>;
+  /** Wall time of the kept iterations, 0 unless time is tracked. */
+  elapsedNs: number;
+  /**
+   * Effective clock in GHz, raw cycles per nanosecond like `count.ghz`:
+   * `elapsedNs` includes the cost of measuring, so the calibrated overhead
+   * is added back to corrected cycles. NaN without time.
+   */
+  ghz: number;
+  /**
+   * Mean time per iteration at `referenceGhz`, from the raw cycles like
+   * `count.nsAt()`. Unlike measured time it doesn't change with the clock.
+   * NaN without it.
+   */
+  normalizedNs: number;
+  /**
+   * Energy the process used during the batch in nanojoules, warmup
+   * excluded, 0 where `energy()` isn't reported.
+   */
+  energyNj: number;
+  /** `energyNj` per iteration. */
+  energyPerRunNj: number;
+  /**
+   * Every run's counts, one row of `events.length` values per iteration.
+   * Multiplexed events not counted in an iteration are 0. This is a view
+   * of native memory and is overwritten by the next `runMany()`.
+   */
+  samples: BigUint64Array;
+  /** `samples` as numbers, also a view of native memory. */
+  sampleValues: Float64Array;
+}
+
+/** Views of the native batch block, remapped when it is reallocated. */
+var batchMapping: {
+  address: number;
+  header: number;
+  u64: BigUint64Array;
+  f64: Float64Array;
+} | null = null;
+
+function mapBatch() {
+  const address = lib.symbols.performance_counters_batch_result();
+  if (batchMapping?.address !== address) {
+    const header = lib.symbols.performance_counters_result_header_slots();
+    const words = new Uint32Array(toArrayBuffer(address, 0, header * 8));
+    const mirror = words[ResultLayout.MIRROR * 2];
+    const buffer = toArrayBuffer(address, 0, (header + mirror * 2) * 8);
+    batchMapping = {
+      address,
+      header,
+      u64: new BigUint64Array(buffer),
+      f64: new Float64Array(buffer, (header + mirror) * 8, mirror),
+    };
+  }
+  return batchMapping;
+}
+
+const STAT_COUNT = 8;
+var statsBuffer: Float64Array | null = null;
+
+/**
+ * Call `func` `iterations` times, recording every run's counts in native
+ * memory, and return statistics computed in native code.
+ */
+export function runMany(
+  func: CallableFunction,
+  iterations: number,
+  options?: RunManyOptions
+): RunManyResult {
+  const cores = options?.cores;
+  const discard = options?.discardMigrated;
+  const time = options?.trackTime;
+  if (cores && cores !== "any") preferCores(cores);
+  const tracking = cpuTracking;
+  const timing = timeTracking;
+  if (discard) trackCpu(true);
+  if (time) trackTime(true);
+  try {
+    return recordMany(func, iterations, options);
+  } finally {
+    if (time && !timing) trackTime(false);
+    if (discard && !tracking) trackCpu(false);
+    if (cores && cores !== "any") preferCores("any");
+  }
+}
+
+function recordMany(
+  func: CallableFunction,
+  iterations: number,
+  options?: RunManyOptions
+): RunManyResult {
+  const warmup = options?.warmup ?? 10;
+  for (let i = 0; i < warmup; i++) {
+    start();
+    func();
+    stop();
+  }
+
+  let str = lib.symbols.performance_counters_batch_begin(
+    iterations,
+    options?.correct === false ? 0 : 1
+  );
+  if (str?.length) {
+    throw new Error(str);
+  }
+
+  const energyStart = Number(lib.symbols.performance_counters_energy_nj());
+  for (let i = 0; i < iterations; i++) {
+    if (performance_counters_start() !== 0) {
+      throw new Error(lastError());
+    }
+    func();
+    if (performance_counters_batch_stop() !== 0) {
+      throw new Error(lastError());
+    }
+  }
+  const energyNj =
+    Number(lib.symbols.performance_counters_energy_nj()) - energyStart;
+
+  let discarded = 0;
+  const discard = options?.discardMigrated;
+  if (discard) {
+    discarded = lib.symbols.performance_counters_batch_discard(
+      discard === "cpu" ? 2 : 1
+    );
+    if (discarded === iterations) {
+      throw new Error("Every iteration migrated to another core");
+    }
+  }
+  const kept = iterations - discarded;
+
+  if (!statsBuffer || statsBuffer.length < eventCount * STAT_COUNT) {
+    statsBuffer = new Float64Array(eventCount * STAT_COUNT);
+  }
+  str = lib.symbols.performance_counters_batch_stats(ptr(statsBuffer));
+  if (str?.length) {
+    throw new Error(str);
+  }
+
+  const stats: Record<string, EventStats> = {};
+  for (const event of events) {
+    if (event.index < 0) continue;
+    const i = event.index * STAT_COUNT;
+    stats[event.name] = {
+      min: statsBuffer[i],
+      median: statsBuffer[i + 1],
+      mean: statsBuffer[i + 2],
+      p99: statsBuffer[i + 3],
+      stddev: statsBuffer[i + 4],
+      max: statsBuffer[i + 5],
+      total: statsBuffer[i + 6],
+      enabled: statsBuffer[i + 7],
+      extrapolated: statsBuffer[i + 7] < 1,
+    };
+  }
+
+  const batch = mapBatch();
+  const rows = kept * eventCount;
+  const samples = batch.u64.subarray(batch.header, batch.header + rows);
+  const sampleValues = batch.f64.subarray(0, rows);
+
+  let cpus: RunManyResult["cpus"] = null;
+  if (cpuTracking) {
+    const { performance_counters_batch_row_cpu } = lib.symbols;
+    cpus = { start: new Int32Array(kept), end: new Int32Array(kept) };
+    for (let r = 0; r < kept; r++) {
+      cpus.start[r] = performance_counters_batch_row_cpu(r, 0);
+      cpus.end[r] = performance_counters_batch_row_cpu(r, 1);
+    }
+  }
+
+  const totals = metrics((name) => {
+    const event = findEvent(name);
+    return event ? stats[event.name].total : undefined;
+  });
+
+  const elapsedNs = timeTracking
+    ? Number(lib.symbols.performance_counters_batch_elapsed_ns())
+    : 0;
+  const cyclesEvent = events.find((event) => event.index === cyclesIndex);
+  const cycles = cyclesEvent ? stats[cyclesEvent.name] : null;
+  const referenceGhz = options?.referenceGhz;
+  // the raw cycles, on the same basis as the wall time
+  const cyclesOverhead =
+    cycles && overheadBuffer && options?.correct !== false
+      ? Number(overheadBuffer[cyclesIndex])
+      : 0;
+
+  return {
+    iterations: kept,
+    discarded,
+    cpus,
+    stats,
+    metrics: totals,
+    elapsedNs,
+    ghz:
+      cycles && elapsedNs
+        ? (cycles.total + cyclesOverhead * kept) / elapsedNs
+        : NaN,
+    normalizedNs:
+      cycles && referenceGhz
+        ? (cycles.mean + cyclesOverhead) / referenceGhz
+        : NaN,
+    energyNj,
+    energyPerRunNj: energyNj / iterations,
+    samples,
+    sampleValues,
+  };
+}
+
+export interface CompareOptions {
+  /** Rounds to run, each runs both functions once. Defaults to 1000. */
+  rounds?: number;
+  /** Rounds to run before recording. Defaults to 10. */
+  warmup?: number;
+  /** Subtract the calibrated overhead from every run. Defaults to true. */
+  correct?: boolean;
+  /** p-value below which a difference is `significant`. Defaults to 0.05. */
+  alpha?: number;
+}
+
+export interface ArmStats {
+  /** Runs the event was counted in. */
+  runs: number;
+  mean: number;
+  median: number;
+  /** Sample standard deviation. */
+  stddev: number;
+}
+
+export interface EventComparison {
+  a: ArmStats;
+  b: ArmStats;
+  /** Mean of B minus mean of A, negative when B counts less. */
+  delta: number;
+  /**
+   * `delta` relative to the mean of A. 0 when both means are 0, NaN when
+   * only A's is, since no ratio describes that change.
+   */
+  relative: number;
+  /** Welch's t statistic of `delta`. */
+  t: number;
+  /** Degrees of freedom of `t`. */
+  df: number;
+  /** Two-sided p-value, the chance of a `delta` this large by noise alone. */
+  p: number;
+  /** Whether `p` is below `alpha`. */
+  significant: boolean;
+}
+
+export interface CompareResult {
+  rounds: number;
+  /** Comparison per scheduled event, by the name passed to `init()`. */
+  events: Record<string, EventComparison>;
+}
+
+const COMPARE_STAT_COUNT = 11;
+var compareBuffer: Float64Array | null = null;
+
+/**
+ * Measure `a` and `b` alternately, in random order each round, so that
+ * frequency changes and other slow drift affect both alike. Both are
+ * recorded in one batch, and native code compares the counts of each
+ * event with Welch's t-test.
+ */
+export function compare(
+  a: CallableFunction,
+  b: CallableFunction,
+  options?: CompareOptions
+): CompareResult {
+  if (!countersBuffer) init();
+  const rounds = options?.rounds ?? 1000;
+  const warmup = options?.warmup ?? 10;
+  for (let i = 0; i < warmup; i++) {
+    run(a);
+    run(b);
+  }
+
+  const symbols = lib.symbols;
+  let str = symbols.performance_counters_batch_begin(
+    rounds * 2,
+    options?.correct === false ? 0 : 1
+  );
+  if (str?.length) {
+    throw new Error(str);
+  }
+  for (let round = 0; round < rounds; round++) {
+    const first = Math.random() < 0.5 ? 0 : 1;
+    for (let k = 0; k < 2; k++) {
+      const arm = first ^ k;
+      const func = arm ? b : a;
+      symbols.performance_counters_batch_arm(arm);
+      if (performance_counters_start() !== 0) {
+        throw new Error(lastError());
+      }
+      func();
+      if (performance_counters_batch_stop() !== 0) {
+        throw new Error(lastError());
+      }
+    }
+  }
+
+  const size = eventCount * COMPARE_STAT_COUNT;
+  if (!compareBuffer || compareBuffer.length < size) {
+    compareBuffer = new Float64Array(size);
+  }
+  str = symbols.performance_counters_batch_compare(ptr(compareBuffer));
+  if (str?.length) {
+    throw new Error(str);
+  }
+
+  const alpha = options?.alpha ?? 0.05;
+  const stats = compareBuffer;
+  const comparisons: Record<string, EventComparison> = {};
+  for (const event of events) {
+    if (event.index < 0) continue;
+    const i = event.index * COMPARE_STAT_COUNT;
+    const delta = stats[i + 3] - stats[i + 2];
+    const meanA = stats[i + 2];
+    comparisons[event.name] = {
+      a: {
+        runs: stats[i],
+        mean: stats[i + 2],
+        median: stats[i + 4],
+        stddev: stats[i + 6],
+      },
+      b: {
+        runs: stats[i + 1],
+        mean: stats[i + 3],
+        median: stats[i + 5],
+        stddev: stats[i + 7],
+      },
+      delta,
+      relative: meanA !== 0 ? delta / meanA : delta === 0 ? 0 : NaN,
+      t: stats[i + 8],
+      df: stats[i + 9],
+      p: stats[i + 10],
+      significant: stats[i + 10] < alpha,
+    };
+  }
+  return { rounds, events: comparisons };
+}
+
+export interface ProfileOptions {
+  /** Sampling period in milliseconds. Defaults to 1. */
+  periodMs?: number;
+  /** How long to profile for, in milliseconds. Defaults to 100. */
+  durationMs?: number;
+  /**
+   * Events to count, as for `init()`. This reconfigures the counters for
+   * `run()` too. Defaults to the events of the last `init()`.
+   */
+  events?: string[];
+}
+
+export interface ProcessProfileOptions extends ProfileOptions {
+  /**
+   * Also write every sample to this file as it is captured, to analyze it
+   * later with `openTrace()`. Memory use does not grow with `durationMs`.
+   */
+  trace?: string;
+}
+
+export interface ThreadProfile {
+  tid: number;
+  /** Time between the first and last sample of this thread. */
+  timeNs: number;
+  /** Counts per scheduled event, by the name passed to `init()`. */
+  counts: Record<string, number | BigInt>;
+}
+
+export interface ProcessProfile {
+  threads: ThreadProfile[];
+  /** Counts of all threads together. */
+  total: Record<string, number | BigInt>;
+  /** Samples that were cut off and had to be dropped. */
+  dropped: number;
+  /**
+   * Times the kernel trace buffer filled up before it could be read. Records
+   * lost that way are not included in `dropped`.
+   */
+  overflows: number;
+}
+
+function toCounts(values: BigUint64Array) {
+  const counts: Record<string, number | BigInt> = {};
+  for (const event of events) {
+    if (event.index < 0) continue;
+    const value = values[event.index];
+    counts[event.name] =
+      BigInt(Number(value)) === value ? Number(value) : value;
+  }
+  return counts;
+}
+
+/**
+ * Sample the counters of every thread of another process, without
+ * instrumenting it. Blocks for `durationMs`.
+ *
+ * @param pid The process to profile, or -1 for all processes.
+ */
+export function profileProcess(
+  pid: number,
+  options?: ProcessProfileOptions
+): ProcessProfile {
+  if (options?.events || !countersBuffer) init(options?.events);
+
+  const str = options?.trace
+    ? lib.symbols.performance_counters_profile_record(
+        pid,
+        options?.periodMs ?? 1,
+        options?.durationMs ?? 100,
+        ptr(Buffer.from(options.trace + "\0"))
+      )
+    : lib.symbols.performance_counters_profile_process(
+        pid,
+        options?.periodMs ?? 1,
+        options?.durationMs ?? 100
+      );
+  if (str?.length) {
+    throw new Error(str);
+  }
+
+  const values = new BigUint64Array(eventCount);
+  const valuesPtr = ptr(values);
+  const threads: ThreadProfile[] = [];
+  for (
+    let i = 0, n = lib.symbols.performance_counters_profile_thread_count();
+    i < n;
+    i++
+  ) {
+    lib.symbols.performance_counters_profile_thread_values(i, valuesPtr);
+    threads.push({
+      tid: lib.symbols.performance_counters_profile_thread_tid(i),
+      timeNs: Number(lib.symbols.performance_counters_profile_thread_time(i)),
+      counts: toCounts(values),
+    });
+  }
+
+  lib.symbols.performance_counters_profile_total(valuesPtr);
+  return {
+    threads,
+    total: toCounts(values),
+    dropped: Number(lib.symbols.performance_counters_profile_dropped()),
+    overflows: lib.symbols.performance_counters_profile_overflows(),
+  };
+}
+
+export interface StackProfileOptions extends ProfileOptions {
+  /** Event to weight the stacks by. Defaults to the first scheduled event. */
+  weight?: string;
+  /** Sample kernel stacks too. Kernel frames end in `_[k]`. */
+  kernel?: boolean;
+  /** Write the folded stacks to this file instead of returning them. */
+  output?: string;
+  /**
+   * Take a sample every `every` occurrences of the weight event, from the
+   * overflow interrupt of its counter, instead of every `periodMs`. Stacks
+   * are then charged `every` per sample and end at the exact instruction
+   * (`symbol+0x1c`), which attributes cache misses or mispredicts to the
+   * code that caused them.
+   */
+  every?: number;
+}
+
+export interface StackProfile {
+  /**
+   * One `root;...;leaf weight` line per unique stack, as read by
+   * flamegraph.pl, speedscope and inferno. Empty when `output` was given.
+   */
+  folded: string;
+  /** Number of unique stacks. */
+  stacks: number;
+  /** Number of samples charged to the stacks. */
+  samples: number;
+}
+
+/**
+ * Sample every thread of a process with its callstacks, weighting each stack
+ * by how much of an event (cycles, cache misses, ...) happened since the
+ * thread's previous sample, or sampling every `every` events of it.
+ * Blocks for `durationMs`.
+ *
+ * Frames of the current process are symbolized; frames of other processes
+ * are addresses, to be symbolized with `atos`.
+ *
+ * @param pid The process to profile, or -1 for all processes.
+ */
+export function profileStacks(
+  pid: number,
+  options?: StackProfileOptions
+): StackProfile {
+  if (options?.events || !countersBuffer) init(options?.events);
+
+  const weight = options?.weight ? find(options.weight) : 0;
+  if (weight < 0) {
+    throw new Error(`Event ${options.weight} is not counted`);
+  }
+
+  // opened as given, without it the stacks are returned from memory
+  const path = options?.output ? Buffer.from(options.output + "\0") : null;
+
+  const str = options?.every
+    ? lib.symbols.performance_counters_profile_overflow(
+        pid,
+        options.every,
+        options?.durationMs ?? 100,
+        weight,
+        options?.kernel ? 1 : 0,
+        path ? ptr(path) : null
+      )
+    : lib.symbols.performance_counters_profile_stacks(
+        pid,
+        options?.periodMs ?? 1,
+        options?.durationMs ?? 100,
+        weight,
+        options?.kernel ? 1 : 0,
+        path ? ptr(path) : null
+      );
+  if (str?.length) {
+    throw new Error(str);
+  }
+
+  return {
+    folded: path
+      ? ""
+      : lib.symbols.performance_counters_profile_stack_folded().toString(),
+    stacks: lib.symbols.performance_counters_profile_stack_count(),
+    samples: Number(lib.symbols.performance_counters_profile_stack_samples()),
+  };
+}
+
 export function stop() {
-  const str = performance_counters_stop(countersBufferPtr);
+  if (performance_counters_stop_result(resultsPtr) !== 0) {
+    throw new Error(lastError());
+  }
+  valueOffset = eventCount;
+}
+
+/**
+ * Whether `startInline()` / `stopInline()` read the fixed counters (cycles
+ * and instructions) straight from the PMU registers, without a syscall.
+ * Only possible on Apple Silicon when the kernel allows user space access.
+ */
+export function inlineAvailable(): boolean {
+  return !!lib.symbols.performance_counters_inline_available();
+}
+
+/**
+ * Like `start()`, but reads the counters in user space when
+ * `inlineAvailable()` is true. Otherwise this is the same as `start()`.
+ */
+export function startInline() {
+  if (performance_counters_start_inline() !== 0) {
+    throw new Error(lastError());
+  }
+}
+
+/**
+ * Like `stop()`, but reads the counters in user space when `inlineAvailable()`
+ * is true. Only events on fixed counters (cycles and instructions) are
+ * updated then; the other values are 0.
+ *
+ * The registers count per core, so keep inline regions short enough that
+ * the thread is not preempted or moved to another core in between.
+ */
+export function stopInline() {
+  if (performance_counters_stop_inline_result(resultsPtr) !== 0) {
+    throw new Error(lastError());
+  }
+  valueOffset = eventCount;
+}
+
+export interface Session {
+  /**
+   * Read the current value of every counter into `out`, which needs a
+   * slot per counted event; a shorter one throws a `RangeError`.
+   * Costs a single `kpc_get_thread_counters` call.
+   */
+  sample(out?: BigUint64Array): BigUint64Array;
+  /**
+   * End the session. The counters are shared with the other contexts that
+   * retain them, so counting stays enabled until the module's `close()`
+   * gives them back.
+   */
+  close(): void;
+  /** Buffer `sample()` writes into when no `out` is passed. */
+  readonly countersBuffer: BigUint64Array;
+}
+
+/**
+ * Enable counting once and keep it enabled until `close()`.
+ *
+ * Samples are absolute counter values; subtract two of them to get the
+ * count for the region in between.
+ */
+export function open(): Session {
+  const str = performance_counters_open();
   if (str?.length) {
     throw new Error(str);
   }
+
+  const buffer = new BigUint64Array(eventCount);
+  const bufferPtr = ptr(buffer);
+
+  return {
+    countersBuffer: buffer,
+    sample(out?: BigUint64Array) {
+      // the native side writes one value per event of the current init()
+      const target = out || buffer;
+      if (target.length < eventCount) {
+        throw new RangeError(
+          `sample() needs room for ${eventCount} counters, got ${target.length}`
+        );
+      }
+      const str = performance_counters_sample(out ? ptr(out) : bufferPtr);
+      if (str?.length) {
+        throw new Error(str);
+      }
+      return out || buffer;
+    },
+    close() {
+      // closing would turn counting off under every other context
+      if (performance_counters_close && !retained) performance_counters_close();
+    },
+  };
+}
+
+export interface ThreadHandle {
+  /**
+   * Native address of the handle. Post it to another worker to read this
+   * thread's counters there with `readHandle()`.
+   */
+  readonly id: number;
+  /** Id of the owning thread, 0 until the first `start()`. */
+  readonly tid: number;
+  /** Raw deltas, then overhead-corrected deltas, like `count.countersBuffer`. */
+  readonly countersBuffer: BigUint64Array;
+  /** Take the baseline. The calling thread becomes the owner. */
+  start(): void;
+  /** Count since `start()` into `countersBuffer` and publish the raw deltas. */
+  stop(): BigUint64Array;
+  /** Publish the raw deltas since `start()` without stopping. */
+  update(): void;
+  /** Counts of the last `stop()` by event name. */
+  counts(corrected?: boolean): Record<string, number | BigInt>;
+  /** Release the handle. Readers must not use its `id` afterwards. */
+  free(): void;
+}
+
+/**
+ * Create a start/stop baseline for the calling thread.
+ *
+ * `start()` and `stop()` already keep their baseline per thread, so each
+ * worker can use them on its own; a handle is for measuring overlapping
+ * regions on one thread, or for letting a supervisor read a worker's
+ * counts while it runs.
+ */
+export function createHandle(): ThreadHandle {
+  if (!countersBuffer) init();
+  const id = lib.symbols.performance_counters_handle_create();
+  if (!id) {
+    throw new Error("Failed to allocate a counters handle");
+  }
+  const buffer = new BigUint64Array(eventCount * 2);
+  const bufferPtr = ptr(buffer);
+  const { performance_counters_handle_start, performance_counters_handle_stop } =
+    lib.symbols;
+  var freed = false;
+
+  return {
+    id,
+    get tid() {
+      return freed ? 0 : Number(lib.symbols.performance_counters_handle_tid(id));
+    },
+    countersBuffer: buffer,
+    start() {
+      if (performance_counters_handle_start(id) !== 0) {
+        throw new Error(lastError());
+      }
+    },
+    stop() {
+      if (performance_counters_handle_stop(id, bufferPtr) !== 0) {
+        throw new Error(lastError());
+      }
+      return buffer;
+    },
+    update() {
+      if (lib.symbols.performance_counters_handle_update(id) !== 0) {
+        throw new Error(lastError());
+      }
+    },
+    counts(corrected = true) {
+      return toCounts(corrected ? buffer.subarray(eventCount) : buffer);
+    },
+    free() {
+      if (freed || !lib) return;
+      freed = true;
+      lib.symbols.performance_counters_handle_free(id);
+    },
+  };
+}
+
+/**
+ * Read the raw deltas another thread last published on its handle, from
+ * any thread, without stopping it.
+ *
+ * @param id `ThreadHandle.id`, usually received from a worker.
+ */
+export function readHandle(id: number, out?: BigUint64Array): BigUint64Array {
+  if (!countersBuffer) init();
+  const buffer = out || new BigUint64Array(eventCount);
+  lib.symbols.performance_counters_handle_read(id, ptr(buffer));
+  return buffer;
+}
+
+/** Id of the calling thread, as `profileProcess()` reports it. */
+export function threadId(): number {
+  load();
+  return Number(lib.symbols.performance_counters_thread_id());
+}
+
+/**
+ * Read the absolute counters of a thread of this process.
+ *
+ * macOS only implements this for the calling thread (`tid` 0); for other
+ * threads it throws, read their handle with `readHandle()` instead.
+ */
+export function readThread(tid = 0, out?: BigUint64Array): BigUint64Array {
+  if (!countersBuffer) init();
+  const buffer = out || new BigUint64Array(eventCount);
+  const str = lib.symbols.performance_counters_read_thread(tid, ptr(buffer));
+  if (str?.length) {
+    throw new Error(str);
+  }
+  return buffer;
+}
+
+export interface CpuSample {
+  /** Number of CPUs, i.e. rows in `values`. */
+  cpus: number;
+  /** `cpus` rows of one value per scheduled event, like `count.countersBuffer`. */
+  values: BigUint64Array;
+  /**
+   * Performance level of each CPU, such as "Performance" or "Efficiency".
+   * Apple Silicon numbers the efficiency cores first.
+   */
+  levels: string[];
+  /** CPU the calling thread was on when the sample was taken. */
+  current: number;
+  /** Value of an event on a CPU. */
+  get(cpu: number, name: string): number;
+  /** Instructions per cycle of a CPU, NaN if it did not run. */
+  ipc(cpu: number): number;
+}
+
+var cpuSample: CpuSample | null = null;
+var cpuBufferPtr = 0;
+
+/**
+ * Read the counters of every CPU of the machine, whatever runs on them.
+ *
+ * The returned object and its buffer are allocated on the first call and
+ * reused by the next ones, so copy what you want to keep.
+ *
+ * @param deltas Return the counts since the previous call instead of the
+ * absolute values. The first call returns zeros. Defaults to true.
+ */
+export function sampleCpus(deltas = true): CpuSample {
+  if (!countersBuffer) init();
+  if (!cpuSample || cpuSample.values.length !== cpuSample.cpus * eventCount) {
+    const {
+      performance_counters_cpu_count,
+      performance_counters_perflevel_count,
+      performance_counters_perflevel_cpus,
+      performance_counters_perflevel_name,
+    } = lib.symbols;
+    const cpus = performance_counters_cpu_count();
+
+    // perflevel0 is the fastest, and has the highest CPU numbers
+    const levels: string[] = [];
+    const levelCount = performance_counters_perflevel_count();
+    for (let level = levelCount - 1; level >= 0; level--) {
+      const name = String(performance_counters_perflevel_name(level) || "");
+      for (let i = performance_counters_perflevel_cpus(level); i > 0; i--) {
+        levels.push(name);
+      }
+    }
+    while (levels.length < cpus) levels.push("");
+
+    const values = new BigUint64Array(cpus * eventCount);
+    cpuBufferPtr = ptr(values);
+    cpuSample = {
+      cpus,
+      values,
+      levels,
+      current: -1,
+      get(cpu, name) {
+        const index = find(name);
+        return index < 0 ? 0 : Number(values[cpu * eventCount + index]);
+      },
+      ipc(cpu) {
+        if (cyclesIndex < 0 || instructionsIndex < 0) return NaN;
+        const row = cpu * eventCount;
+        const cycles = Number(values[row + cyclesIndex]);
+        return cycles ? Number(values[row + instructionsIndex]) / cycles : NaN;
+      },
+    };
+  }
+
+  const str = lib.symbols.performance_counters_sample_cpus(
+    cpuBufferPtr,
+    deltas ? 1 : 0
+  );
+  if (str?.length) {
+    throw new Error(str);
+  }
+  cpuSample.current = lib.symbols.performance_counters_cpu_current();
+  return cpuSample;
+}
+
+/**
+ * Kind of cores to run on. "performance" and "efficiency" set the QoS class
+ * of the thread to user interactive and background, "any" restores it.
+ */
+export type Cores = "performance" | "efficiency" | "any";
+
+const CORES = { any: 0, performance: 1, efficiency: 2 } as const;
+
+/**
+ * Ask the scheduler to run the calling thread on one kind of core.
+ *
+ * Apple Silicon can't pin a thread to a CPU, this only makes the cluster
+ * likely. Use `trackCpu()` to check where each measurement ran.
+ */
+export function preferCores(cores: Cores) {
+  if (!countersBuffer) init();
+  const str = lib.symbols.performance_counters_prefer_cores(CORES[cores]);
+  if (str?.length) {
+    throw new Error(str);
+  }
+}
+
+var cpuTracking = false;
+var timeTracking = false;
+
+/**
+ * Record the CPU every `start()`, `stop()` and `runMany()` iteration ran
+ * on, in `count.cpuStart` and `count.cpuEnd`. Costs one per-CPU counter
+ * read at each end, outside of the measured region.
+ */
+export function trackCpu(enabled = true) {
+  if (!countersBuffer) init();
+  lib.symbols.performance_counters_track_cpu(enabled ? 1 : 0);
+  cpuTracking = enabled;
+}
+
+/**
+ * Record the wall time of every `start()`/`stop()` pair and `runMany()`
+ * iteration, in `count.elapsedNs`, so cycles can be turned into an
+ * effective clock with `count.ghz`. Costs one clock read at each end,
+ * outside of the measured region.
+ */
+export function trackTime(enabled = true) {
+  if (!countersBuffer) init();
+  lib.symbols.performance_counters_track_time(enabled ? 1 : 0);
+  timeTracking = enabled;
+}
+
+/**
+ * Energy the process has used so far, in nanojoules. Subtract two
+ * readings for a region; every thread of the process counts. macOS 13 and
+ * later on Apple Silicon, 0 elsewhere.
+ */
+export function energy(): number {
+  if (!countersBuffer) init();
+  return Number(lib.symbols.performance_counters_energy_nj());
+}
+
+/** Performance level of a CPU, 0 for the fastest cores, -1 if unknown. */
+export function cpuPerflevel(cpu: number): number {
+  if (!countersBuffer) init();
+  return lib.symbols.performance_counters_cpu_perflevel(cpu);
+}
+
+export interface TelemetryOptions {
+  /** Time between two samples. Defaults to 1000. */
+  intervalMs?: number;
+  /**
+   * Samples kept until drained, rounded up to a power of 2. When the ring
+   * is full new samples are dropped. Defaults to 1024.
+   */
+  capacity?: number;
+}
+
+export interface TelemetrySample {
+  /** End of the sampled interval, in nanoseconds of `mach_absolute_time`. */
+  timeNs: number;
+  /** Counts of every CPU during the interval, summed, by event name. */
+  counts: Record<string, number | BigInt>;
+}
+
+var telemetryBuffer: BigUint64Array | null = null;
+
+/**
+ * Sample the counters of the whole machine in a background native thread.
+ *
+ * Draining only copies the samples out of a lock-free ring, it never waits
+ * on the sampler.
+ */
+export const telemetry = {
+  start(options?: TelemetryOptions) {
+    if (!countersBuffer) init();
+    const str = lib.symbols.performance_counters_telemetry_start(
+      options?.intervalMs ?? 1000,
+      options?.capacity ?? 1024
+    );
+    if (str?.length) {
+      throw new Error(str);
+    }
+  },
+
+  /** Stop sampling. Samples that were not drained are lost. */
+  stop() {
+    if (lib) lib.symbols.performance_counters_telemetry_stop();
+  },
+
+  /** Number of values per sample in `drainInto()`: the time, then one per event. */
+  get stride(): number {
+    return lib ? lib.symbols.performance_counters_telemetry_stride() : 0;
+  },
+
+  /** Samples dropped because the ring was full. */
+  get dropped(): number {
+    return lib
+      ? Number(lib.symbols.performance_counters_telemetry_dropped())
+      : 0;
+  },
+
+  /**
+   * Move samples into `out`, `stride` values each, without allocating.
+   * @returns The number of samples written.
+   */
+  drainInto(out: BigUint64Array): number {
+    if (!lib) return 0;
+    const max = Math.floor(out.length / this.stride);
+    return max
+      ? lib.symbols.performance_counters_telemetry_drain(ptr(out), max)
+      : 0;
+  },
+
+  /** All the samples taken since the last drain, oldest first. */
+  drain(): TelemetrySample[] {
+    const stride = this.stride;
+    if (!stride) return [];
+    if (!telemetryBuffer || telemetryBuffer.length < stride * 256) {
+      telemetryBuffer = new BigUint64Array(stride * 256);
+    }
+    const samples: TelemetrySample[] = [];
+    for (;;) {
+      const n = this.drainInto(telemetryBuffer);
+      for (let i = 0; i < n; i++) {
+        const entry = telemetryBuffer.subarray(i * stride, (i + 1) * stride);
+        samples.push({
+          timeNs: Number(entry[0]),
+          counts: toCounts(entry.subarray(1)),
+        });
+      }
+      if (n * stride < telemetryBuffer.length) return samples;
+    }
+  },
+};
+
+/**
+ * Program the next group of multiplexed events now. `start()` does this
+ * on its own; call it when sampling with `open()`. Samples taken before and
+ * after a rotation can't be subtracted from each other.
+ */
+export function rotate() {
+  const str = lib.symbols.performance_counters_rotate();
+  if (str?.length) {
+    throw new Error(str);
+  }
+  return lib.symbols.performance_counters_active_group();
+}
+
+var cpu: CpuInfo | null = null;
+
+/** Family, PMC database name and issue width of the current CPU. */
+export function currentCpu(): CpuInfo {
+  if (!cpu) {
+    load();
+    const str = lib.symbols.performance_counters_db_open();
+    if (str?.length) {
+      throw new Error(str);
+    }
+    cpu = cpuInfo(
+      String(lib.symbols.performance_counters_db_name()),
+      lib.symbols.performance_counters_pmu_version()
+    );
+  }
+  return cpu;
+}
+
+/**
+ * Event names to pass to `init()` to compute `metrics()` on this CPU.
+ *
+ * @param names Metrics to compute, such as `["ipc", "l1dMpki"]`. Defaults
+ * to every metric of the CPU's family.
+ */
+export function metricEvents(names?: string[]): string[] {
+  const known = new Set([
+    "cycles",
+    "instructions",
+    "branches",
+    "branch-misses",
+  ]);
+  for (const event of listEvents().events) known.add(event.name);
+  return metricEventNames(currentCpu(), (name) => known.has(name), names);
+}
+
+/**
+ * Compute IPC, miss rates, MPKI and the top-down breakdown from counts.
+ *
+ * Metrics whose events were not configured are left out; use
+ * `metricEvents()` to get the events they need. The formulas depend on the
+ * CPU family, see `metricDefinitions`.
+ *
+ * @param counts Values in `countersBuffer` order, such as a row of
+ * `runMany()` samples, or a function returning the count of an event name.
+ * Defaults to the overhead-corrected counts of the last `stop()`.
+ */
+export function metrics(
+  counts?: BigUint64Array | CountLookup
+): Record<string, number> {
+  if (typeof counts === "function") return deriveMetrics(currentCpu(), counts);
+
+  const values = counts || countersBuffer?.subarray(eventCount);
+  if (!values || !lib) return {};
+  const multiplexed = lib.symbols.performance_counters_group_count() > 1;
+  const group = multiplexed
+    ? lib.symbols.performance_counters_active_group()
+    : -1;
+  return deriveMetrics(currentCpu(), (name) => {
+    const event = findEvent(name);
+    // the groups that were not programmed read 0
+    if (!event || (!counts && event.group >= 0 && event.group !== group))
+      return undefined;
+    return Number(values[event.index]);
+  });
+}
+
+var regionIds = new Map<string, number>();
+
+/**
+ * Id of a region name, for `enter()`. Interning the names up front keeps
+ * strings off the measured path.
+ */
+export function region(name: string): number {
+  let id = regionIds.get(name);
+  if (id === undefined) {
+    if (!countersBuffer) init();
+    id = lib.symbols.performance_counters_region_intern(
+      ptr(Buffer.from(name + "\0"))
+    );
+    if (id === 0xffffffff) {
+      throw new Error("Failed to allocate memory for regions");
+    }
+    regionIds.set(name, id);
+  }
+  return id;
+}
+
+/**
+ * Open a region inside the innermost open region of the calling thread.
+ * Close it with `exit()`.
+ */
+export function enter(name: string | number) {
+  const id = typeof name === "number" ? name : region(name);
+  if (performance_counters_region_enter(id) !== 0) {
+    throw new Error(lastError());
+  }
+}
+
+/** Close the innermost open region of the calling thread. */
+export function exit() {
+  if (performance_counters_region_exit() !== 0) {
+    throw new Error(lastError());
+  }
+}
+
+export interface RegionReport {
+  name: string;
+  /** Number of times the region was exited on this path. */
+  calls: number;
+  /** Counts of the region, including its children. */
+  inclusive: Record<string, number | BigInt>;
+  /** Counts of the region itself, excluding its children. */
+  exclusive: Record<string, number | BigInt>;
+  children: RegionReport[];
+}
+
+/**
+ * The calling thread's regions as a tree, one root per top level region.
+ * The same region entered from two different parents gets two nodes.
+ */
+export function regionReport(): RegionReport[] {
+  if (!lib) return [];
+  const {
+    performance_counters_region_node_count,
+    performance_counters_region_node_region,
+    performance_counters_region_node_parent,
+    performance_counters_region_node_calls,
+    performance_counters_region_node_values,
+    performance_counters_region_name,
+  } = lib.symbols;
+
+  const values = new BigUint64Array(eventCount * 2);
+  const valuesPtr = ptr(values);
+  const nodes: RegionReport[] = [];
+  const roots: RegionReport[] = [];
+  for (let i = 1, n = performance_counters_region_node_count(); i < n; i++) {
+    performance_counters_region_node_values(i, valuesPtr);
+    const node: RegionReport = {
+      name: String(
+        performance_counters_region_name(
+          performance_counters_region_node_region(i)
+        )
+      ),
+      calls: Number(performance_counters_region_node_calls(i)),
+      inclusive: toCounts(values),
+      exclusive: toCounts(values.subarray(eventCount)),
+      children: [],
+    };
+    nodes[i] = node;
+    // parents are always created before their children
+    const parent = performance_counters_region_node_parent(i);
+    (parent ? nodes[parent].children : roots).push(node);
+  }
+  return roots;
+}
+
+/** Forget the calling thread's region tree. */
+export function resetRegions() {
+  if (lib) lib.symbols.performance_counters_region_reset();
+}
+
+function read(index: number, offset = valueOffset): number {
+  if (index < 0) return 0;
+  return countersNumbers[offset + index];
+}
+
+function findEvent(name: string): EventInfo | undefined {
+  for (const event of events) {
+    if (event.index < 0) continue;
+    if (event.name === name || event.event === name || event.alias === name)
+      return event;
+  }
+  return undefined;
+}
+
+function find(name: string) {
+  for (const event of events) {
+    if (event.name === name || event.event === name || event.alias === name)
+      return event.index;
+  }
+  return -1;
 }
 
 export const count = {
-  get cycles(): number | BigInt {
-    // @ts-ignore
-    return BigInt(Number(countersBuffer[0])) === Number(countersBuffer[0])
-      ? Number(countersBuffer[0])
-      : countersBuffer[0];
-  },
-  get branches(): number | BigInt {
-    // @ts-ignore
-    return BigInt(Number(countersBuffer[3])) === Number(countersBuffer[3])
-      ? Number(countersBuffer[3])
-      : countersBuffer[3];
-  },
-  get instructions(): number | BigInt {
-    // @ts-ignore
-    return BigInt(Number(countersBuffer[2])) === Number(countersBuffer[2])
-      ? Number(countersBuffer[2])
-      : countersBuffer[2];
-  },
-  get missedBranches(): number | BigInt {
-    // @ts-ignore
-    return BigInt(Number(countersBuffer[3])) === Number(countersBuffer[3])
-      ? Number(countersBuffer[3])
-      : countersBuffer[3];
-  },
-
-  countersBuffer: null,
-  cyclesOffset: 1,
-  branchesOffset: 2,
-  instructionsOffset: 3,
-  missedBranchesOffset: 4,
+  get cycles(): number {
+    return read(cyclesIndex);
+  },
+  get branches(): number {
+    return read(branchesIndex);
+  },
+  get instructions(): number {
+    return read(instructionsIndex);
+  },
+  get missedBranches(): number {
+    return read(missedBranchesIndex);
+  },
+
+  /** Value of any configured event, by the name passed to `init()`. */
+  get(name: string): number {
+    return read(find(name));
+  },
+
+  /**
+   * User space and kernel counts of an event configured as `name:uk`, or as
+   * `name:u` and `name:k`. Tells apart time in your code from time in
+   * syscalls.
+   */
+  split(name: string): { user: number; kernel: number } {
+    return { user: read(find(name + ":u")), kernel: read(find(name + ":k")) };
+  },
+
+  /** Derived metrics of the last run, see `metrics()`. */
+  get metrics(): Record<string, number> {
+    return metrics();
+  },
+
+  /** The same counts, without the calibrated overhead subtracted. */
+  raw: {
+    get cycles(): number {
+      return read(cyclesIndex, 0);
+    },
+    get branches(): number {
+      return read(branchesIndex, 0);
+    },
+    get instructions(): number {
+      return read(instructionsIndex, 0);
+    },
+    get missedBranches(): number {
+      return read(missedBranchesIndex, 0);
+    },
+    get(name: string): number {
+      return read(find(name), 0);
+    },
+  },
+
+  /** Raw then corrected counts of the last `stop()`, as u64. */
+  countersBuffer: null as BigUint64Array | null,
+  /** The same values as numbers, read without allocating. */
+  values: null as Float64Array | null,
+  /** The whole result block, see `ResultLayout`. */
+  results: null as BigUint64Array | null,
+
+  /** Incremented by every `stop()`. */
+  get sequence(): number {
+    return resultsHeader ? resultsHeader[ResultLayout.SEQUENCE * 2] : 0;
+  },
+  /** `ResultLayout` flags of the last `stop()`. */
+  get flags(): number {
+    return resultsHeader ? resultsHeader[ResultLayout.FLAGS * 2] : 0;
+  },
+  /** CPU the last `start()` ran on, -1 unless `trackCpu()` is on. */
+  get cpuStart(): number {
+    return resultsHeader ? resultsHeader[ResultLayout.CPU_START * 2] | 0 : -1;
+  },
+  /** CPU the last `stop()` ran on, -1 unless `trackCpu()` is on. */
+  get cpuEnd(): number {
+    return resultsHeader ? resultsHeader[ResultLayout.CPU_END * 2] | 0 : -1;
+  },
+  /** Wall time of the last run, 0 unless `trackTime()` is on. */
+  get elapsedNs(): number {
+    if (!resultsHeader) return 0;
+    const slot = ResultLayout.ELAPSED_NS * 2;
+    return resultsHeader[slot] + resultsHeader[slot + 1] * 2 ** 32;
+  },
+  /**
+   * Effective clock of the last run in GHz, its raw cycles per nanosecond.
+   * Raw like `elapsedNs`, which includes the cost of measuring. NaN unless
+   * `trackTime()` is on and cycles are counted.
+   */
+  get ghz(): number {
+    const ns = count.elapsedNs;
+    return ns && cyclesIndex >= 0 ? read(cyclesIndex, 0) / ns : NaN;
+  },
+  /**
+   * How long the last run would have taken at a clock of `ghz`, from its
+   * raw cycles like `count.ghz`, so `nsAt(count.ghz)` is `elapsedNs`.
+   * Compares runs at different frequencies, or machines.
+   */
+  nsAt(ghz: number): number {
+    return cyclesIndex >= 0 ? read(cyclesIndex, 0) / ghz : NaN;
+  },
+  /** The last `start()` and `stop()` ran on different kinds of core. */
+  get migrated(): boolean {
+    const from = count.cpuStart;
+    const to = count.cpuEnd;
+    return from >= 0 && to >= 0 && cpuPerflevel(from) !== cpuPerflevel(to);
+  },
+
+  cyclesOffset: -1,
+  branchesOffset: -1,
+  instructionsOffset: -1,
+  missedBranchesOffset: -1,
 };
 
 export function close() {
   if (!lib) {
     return;
   }
+  // workers share the counters, only the last context to leave stops them
+  if (retained) lib.symbols.performance_counters_release();
+  else performance_counters_close();
+  retained = false;
   lib.close();
   count.countersBuffer = countersBuffer = null;
+  count.values = countersNumbers = null;
+  count.results = results = null;
+  resultsHeader = null;
+  resultsPtr = 0;
   lib = null;
   performance_counters_init = null;
   performance_counters_start = null;
-  performance_counters_stop = null;
-  countersBufferPtr = 0;
+  performance_counters_stop_result = null;
+  performance_counters_open = null;
+  performance_counters_sample = null;
+  performance_counters_close = null;
+  performance_counters_start_inline = null;
+  performance_counters_stop_inline_result = null;
+  performance_counters_batch_stop = null;
+  statsBuffer = null;
+  compareBuffer = null;
+  cpuSample = null;
+  cpuTracking = false;
+  timeTracking = false;
+  cpu = null;
+  batchMapping = null;
+  regionIds = new Map();
+  performance_counters_region_enter = null;
+  performance_counters_region_exit = null;
+  cpuBufferPtr = 0;
+  telemetryBuffer = null;
+  events = [];
+  cached = false;
+  eventCount = valueOffset = 0;
+  overheadBuffer = inlineOverheadBuffer = null;
+  cyclesIndex = instructionsIndex = branchesIndex = missedBranchesIndex = -1;
 }
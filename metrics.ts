@@ -0,0 +1,290 @@
+// Derived metrics, computed from the counts of the events `init()` was given.
+//
+// Each metric names the events it needs by role. A role lists the event
+// names that count it on the different CPUs of a family, the first one that
+// was configured is used. A metric whose events were not all configured is
+// left out of the result.
+
+export type CpuFamily = "apple" | "intel" | "unknown";
+
+export interface MetricDefinition {
+  name: string;
+  description: string;
+  /** Event names per role, in order of preference. */
+  events: Record<string, string[]>;
+  /** Whether the metric is a fraction of the top-down slots. */
+  topDown?: boolean;
+  /** Compute the metric from one count per role. */
+  compute(counts: Record<string, number>, cpu: CpuInfo): number;
+}
+
+export interface CpuInfo {
+  family: CpuFamily;
+  /** PMC database name, such as "a14" or "skylake". */
+  name: string;
+  /**
+   * Micro-ops the core can issue per cycle, the width of the top-down
+   * slots. 0 if unknown.
+   */
+  width: number;
+}
+
+/** Resolves an event name to its count, or undefined if it is not counted. */
+export type CountLookup = (name: string) => number | undefined;
+
+const cycles = ["cycles"];
+const instructions = ["instructions"];
+
+const common: MetricDefinition[] = [
+  {
+    name: "ipc",
+    description: "Instructions per cycle",
+    events: { cycles, instructions },
+    compute: ({ cycles, instructions }) => instructions / cycles,
+  },
+  {
+    name: "cpi",
+    description: "Cycles per instruction",
+    events: { cycles, instructions },
+    compute: ({ cycles, instructions }) => cycles / instructions,
+  },
+  {
+    name: "branchMissRate",
+    description: "Mispredicted branches per branch",
+    events: { branches: ["branches"], misses: ["branch-misses"] },
+    compute: ({ branches, misses }) => misses / branches,
+  },
+  {
+    name: "branchMpki",
+    description: "Mispredicted branches per 1000 instructions",
+    events: { instructions, misses: ["branch-misses"] },
+    compute: ({ instructions, misses }) => (misses * 1000) / instructions,
+  },
+];
+
+const apple: MetricDefinition[] = [
+  ...common,
+  {
+    name: "l1dMpki",
+    description: "L1 data cache misses per 1000 instructions",
+    events: {
+      instructions,
+      loads: ["L1D_CACHE_MISS_LD_NONSPEC", "L1D_CACHE_MISS_LD"],
+      stores: ["L1D_CACHE_MISS_ST_NONSPEC", "L1D_CACHE_MISS_ST"],
+    },
+    compute: ({ instructions, loads, stores }) =>
+      ((loads + stores) * 1000) / instructions,
+  },
+  {
+    name: "l1iMpki",
+    description: "L1 instruction cache misses per 1000 instructions",
+    events: { instructions, misses: ["L1I_CACHE_MISS_DEMAND"] },
+    compute: ({ instructions, misses }) => (misses * 1000) / instructions,
+  },
+  {
+    name: "dtlbMpki",
+    description: "L1 data TLB misses per 1000 instructions",
+    events: { instructions, misses: ["L1D_TLB_MISS"] },
+    compute: ({ instructions, misses }) => (misses * 1000) / instructions,
+  },
+  // The cores don't count the top-down slots directly. Slots are taken as
+  // `width` per cycle, retired and dispatched micro-ops bound retiring and
+  // bad speculation, and dispatch bubbles stand for the frontend.
+  {
+    name: "retiring",
+    description: "Top-down: fraction of the slots that retired a micro-op",
+    topDown: true,
+    events: { cycles, retired: ["RETIRE_UOP"] },
+    compute: ({ cycles, retired }, { width }) => retired / (cycles * width),
+  },
+  {
+    name: "badSpeculation",
+    description: "Top-down: fraction of the slots spent on discarded work",
+    topDown: true,
+    events: { cycles, retired: ["RETIRE_UOP"], issued: ["SCHEDULE_UOP"] },
+    compute: ({ cycles, retired, issued }, { width }) =>
+      Math.max(0, issued - retired) / (cycles * width),
+  },
+  {
+    name: "frontendBound",
+    description: "Top-down: fraction of the slots the frontend left empty",
+    topDown: true,
+    events: { cycles, bubbles: ["MAP_DISPATCH_BUBBLE"] },
+    compute: ({ cycles, bubbles }, { width }) => bubbles / (cycles * width),
+  },
+  {
+    name: "backendBound",
+    description: "Top-down: the slots left, stalled on execution or memory",
+    topDown: true,
+    events: {
+      cycles,
+      retired: ["RETIRE_UOP"],
+      issued: ["SCHEDULE_UOP"],
+      bubbles: ["MAP_DISPATCH_BUBBLE"],
+    },
+    compute: ({ cycles, retired, issued, bubbles }, { width }) => {
+      const used = Math.max(retired, issued) + bubbles;
+      return Math.max(0, 1 - used / (cycles * width));
+    },
+  },
+];
+
+const intel: MetricDefinition[] = [
+  ...common,
+  {
+    name: "l1dMpki",
+    description: "L1 data cache lines replaced per 1000 instructions",
+    events: { instructions, misses: ["L1D.REPLACEMENT"] },
+    compute: ({ instructions, misses }) => (misses * 1000) / instructions,
+  },
+  {
+    name: "l2Mpki",
+    description: "L2 cache misses per 1000 instructions",
+    events: {
+      instructions,
+      misses: ["L2_RQSTS.MISS", "LONGEST_LAT_CACHE.REFERENCE"],
+    },
+    compute: ({ instructions, misses }) => (misses * 1000) / instructions,
+  },
+  {
+    name: "dtlbMpki",
+    description: "Page walks for data TLB misses per 1000 instructions",
+    events: {
+      instructions,
+      misses: [
+        "DTLB_LOAD_MISSES.MISS_CAUSES_A_WALK",
+        "DTLB_LOAD_MISSES.WALK_COMPLETED",
+      ],
+    },
+    compute: ({ instructions, misses }) => (misses * 1000) / instructions,
+  },
+  // Level 1 of the Top-down Microarchitecture Analysis method
+  {
+    name: "retiring",
+    description: "Top-down: fraction of the slots that retired a micro-op",
+    topDown: true,
+    events: {
+      cycles,
+      retired: ["UOPS_RETIRED.RETIRE_SLOTS", "UOPS_RETIRED.SLOTS"],
+    },
+    compute: ({ cycles, retired }, { width }) => retired / (cycles * width),
+  },
+  {
+    name: "badSpeculation",
+    description: "Top-down: fraction of the slots spent on discarded work",
+    topDown: true,
+    events: {
+      cycles,
+      issued: ["UOPS_ISSUED.ANY"],
+      retired: ["UOPS_RETIRED.RETIRE_SLOTS", "UOPS_RETIRED.SLOTS"],
+      recovery: ["INT_MISC.RECOVERY_CYCLES"],
+    },
+    compute: ({ cycles, issued, retired, recovery }, { width }) =>
+      (issued - retired + width * recovery) / (cycles * width),
+  },
+  {
+    name: "frontendBound",
+    description: "Top-down: fraction of the slots the frontend left empty",
+    topDown: true,
+    events: { cycles, undelivered: ["IDQ_UOPS_NOT_DELIVERED.CORE"] },
+    compute: ({ cycles, undelivered }, { width }) =>
+      undelivered / (cycles * width),
+  },
+  {
+    name: "backendBound",
+    description: "Top-down: the slots left, stalled on execution or memory",
+    topDown: true,
+    events: {
+      cycles,
+      issued: ["UOPS_ISSUED.ANY"],
+      recovery: ["INT_MISC.RECOVERY_CYCLES"],
+      undelivered: ["IDQ_UOPS_NOT_DELIVERED.CORE"],
+    },
+    compute: ({ cycles, issued, recovery, undelivered }, { width }) =>
+      1 - (issued + width * recovery + undelivered) / (cycles * width),
+  },
+];
+
+export const metricDefinitions: Record<CpuFamily, MetricDefinition[]> = {
+  apple,
+  intel,
+  unknown: common,
+};
+
+// kpc_pmu_version()
+const KPC_PMU_INTEL_V3 = 1;
+const KPC_PMU_ARM_APPLE = 2;
+const KPC_PMU_INTEL_V2 = 3;
+
+/**
+ * Identify the CPU from its PMC database name and PMU version.
+ */
+export function cpuInfo(name: string, pmuVersion: number): CpuInfo {
+  if (pmuVersion === KPC_PMU_ARM_APPLE || /^as?\d+/.test(name)) {
+    // "a7".."a17", "as1".. for the M series, which are all 8 wide
+    const [, m, generation] = name.match(/^a(s?)(\d+)/) || [];
+    const gen = Number(generation) || 0;
+    const width = m || gen >= 14 ? 8 : gen >= 11 ? 7 : 6;
+    return { family: "apple", name, width };
+  }
+  if (pmuVersion === KPC_PMU_INTEL_V3 || pmuVersion === KPC_PMU_INTEL_V2) {
+    // Sandy Bridge through Comet Lake issue 4 micro-ops per cycle, Ice Lake
+    // and later 5
+    const width = /icelake|tigerlake|alderlake|sapphire/.test(name) ? 5 : 4;
+    return { family: "intel", name, width };
+  }
+  return { family: "unknown", name, width: 0 };
+}
+
+function resolve(
+  definition: MetricDefinition,
+  lookup: CountLookup
+): Record<string, number> | null {
+  const counts: Record<string, number> = {};
+  for (const role in definition.events) {
+    let value: number | undefined;
+    for (const name of definition.events[role]) {
+      if ((value = lookup(name)) !== undefined) break;
+    }
+    if (value === undefined) return null;
+    counts[role] = value;
+  }
+  return counts;
+}
+
+/**
+ * Compute every metric of the CPU's family whose events are counted.
+ */
+export function deriveMetrics(
+  cpu: CpuInfo,
+  lookup: CountLookup
+): Record<string, number> {
+  const out: Record<string, number> = {};
+  for (const definition of metricDefinitions[cpu.family]) {
+    const counts = resolve(definition, lookup);
+    if (!counts) continue;
+    if (definition.topDown && !cpu.width) continue;
+    out[definition.name] = definition.compute(counts, cpu);
+  }
+  return out;
+}
+
+/**
+ * Event names to pass to `init()` to compute the given metrics, or all of
+ * the family's metrics. Each role's first name found by `exists` is used.
+ */
+export function metricEventNames(
+  cpu: CpuInfo,
+  exists: (name: string) => boolean,
+  names?: string[]
+): string[] {
+  const out: string[] = [];
+  for (const definition of metricDefinitions[cpu.family]) {
+    if (names && !names.includes(definition.name)) continue;
+    for (const role in definition.events) {
+      const name = definition.events[role].find(exists);
+      if (name && !out.includes(name)) out.push(name);
+    }
+  }
+  return out;
+}
@@ -0,0 +1,385 @@
+// The core of index.ts for Node, on the Node-API binding in binding.c
+// instead of bun:ffi. Build it with `npx node-gyp rebuild`.
+//
+// The binding returns integer statuses, the hot paths only compare them to
+// 0 and ask for the message with lastError() when something failed. Counts
+// are read in place from the result block stop() writes into.
+
+import { AsyncResource, createHook, executionAsyncResource } from "async_hooks";
+import { createRequire } from "module";
+
+const require = createRequire(import.meta.url);
+const binding = require("./build/Release/counters.node");
+
+/** What the binding's calls return. */
+export const Status = {
+  OK: 0,
+  FAILED: 1,
+  NO_RESULTS: 2,
+  INVALID_ARGUMENT: 3,
+};
+
+/** Message of the last failed call, null if none failed. */
+export function lastError() {
+  return binding.lastError();
+}
+
+function check(status) {
+  if (status !== 0) throw new Error(binding.lastError());
+}
+
+const EVENT_MODES = ["all", "user", "kernel"];
+
+/** `"cycles:uk"` is `"cycles:u"` and `"cycles:k"`, as in index.ts. */
+function expandModes(names) {
+  return names.flatMap((name) =>
+    /:uk$/i.test(name)
+      ? [name.slice(0, -1), name.slice(0, -2) + name.slice(-1)]
+      : [name]
+  );
+}
+
+var events = [];
+var eventCount = 0;
+var valueOffset = 0;
+var results = null;
+var countersBuffer = null;
+var countersNumbers = null;
+var overheadBuffer = null;
+var retained = false;
+
+var cyclesIndex = -1;
+var instructionsIndex = -1;
+var branchesIndex = -1;
+var missedBranchesIndex = -1;
+
+/**
+ * Configure the counters, as `init()` of index.ts. Multiplexing is not
+ * available in Node yet, events that don't fit are skipped.
+ *
+ * @param {string[]} [eventNames]
+ * @param {{ calibrate?: boolean, calibrationRuns?: number }} [options]
+ */
+export function init(eventNames, options) {
+  if (countersBuffer && !eventNames)
+    return { events, countersBuffer, overhead: overheadBuffer };
+  const spec = eventNames?.length ? expandModes(eventNames).join(",") : null;
+  // retain first: init() refuses to reconfigure under other contexts
+  if (!retained) {
+    binding.retain();
+    retained = true;
+  }
+  check(binding.init(spec ?? undefined, 1));
+
+  events = [];
+  for (let i = 0, n = binding.eventCount(); i < n; i++) {
+    const { name, event, alias, mode, slot, status } = binding.event(i);
+    const info = { name, event, alias, scheduled: slot >= 0, index: slot };
+    info.mode = EVENT_MODES[mode];
+    info.group = -1;
+    if (slot < 0) info.error = binding.errorDesc(status);
+    events.push(info);
+  }
+  eventCount = valueOffset = binding.counterCount();
+
+  const header = binding.resultHeaderSlots();
+  const buffer = new ArrayBuffer(binding.resultSlots() * 8);
+  check(binding.results(buffer));
+  results = new BigUint64Array(buffer);
+  countersBuffer = results.subarray(header, header + eventCount * 2);
+  countersNumbers = new Float64Array(
+    buffer,
+    (header + eventCount * 2) * 8,
+    eventCount * 2
+  );
+  count.countersBuffer = countersBuffer;
+  count.values = countersNumbers;
+  count.results = results;
+
+  cyclesIndex = count.cyclesOffset = indexOf("cycles");
+  instructionsIndex = count.instructionsOffset = indexOf("instructions");
+  branchesIndex = count.branchesOffset = indexOf("branches");
+  missedBranchesIndex = count.missedBranchesOffset = indexOf("branch-misses");
+
+  overheadBuffer = null;
+  if (options?.calibrate ?? true) {
+    overheadBuffer = calibrate(options?.calibrationRuns ?? 1000);
+  }
+  return { events, countersBuffer, overhead: overheadBuffer };
+}
+
+function noop() {}
+
+/** The median of what `runs` empty measurements count, per event. */
+function calibrate(runs) {
+  const n = eventCount;
+  const samples = new BigUint64Array(runs * n);
+  const column = new BigUint64Array(runs);
+  const median = new BigUint64Array(n);
+  check(binding.setOverhead(null, false));
+  for (let i = 0; i < 100; i++) {
+    start();
+    noop();
+    stop();
+  }
+  for (let r = 0; r < runs; r++) {
+    start();
+    noop();
+    stop();
+    samples.set(countersBuffer.subarray(0, n), r * n);
+  }
+  for (let e = 0; e < n; e++) {
+    for (let r = 0; r < runs; r++) column[r] = samples[r * n + e];
+    median[e] = column.sort()[runs >> 1];
+  }
+  check(binding.setOverhead(median, false));
+  return median;
+}
+
+function indexOf(alias) {
+  for (const event of events) {
+    if (event.alias === alias && event.index >= 0) return event.index;
+  }
+  return -1;
+}
+
+export function configuredEvents() {
+  return events;
+}
+
+export function start() {
+  if (binding.start() !== 0) throw new Error(binding.lastError());
+}
+
+export function stop() {
+  if (binding.stop() !== 0) throw new Error(binding.lastError());
+  valueOffset = eventCount;
+}
+
+export function startInline() {
+  if (binding.startInline() !== 0) throw new Error(binding.lastError());
+}
+
+export function stopInline() {
+  if (binding.stopInline() !== 0) throw new Error(binding.lastError());
+  valueOffset = eventCount;
+}
+
+export function inlineAvailable() {
+  return binding.inlineAvailable();
+}
+
+/**
+ * @param {() => void} func
+ * @param {{ correct?: boolean }} [options]
+ */
+export function run(func, options) {
+  if (!countersBuffer) init();
+  start();
+  func();
+  stop();
+  if (options?.correct === false) valueOffset = 0;
+  return count;
+}
+
+/** The `runAsync()` whose segment is being counted on this thread. */
+var asyncCurrent = null;
+
+function asyncResume(measure) {
+  if (asyncCurrent === measure) return;
+  if (asyncCurrent) asyncPause(asyncCurrent);
+  start();
+  asyncCurrent = measure;
+}
+
+function asyncPause(measure) {
+  if (asyncCurrent !== measure) return;
+  stop();
+  asyncCurrent = null;
+  const { values, counters } = measure;
+  for (let i = 0, n = eventCount * 2; i < n; i++) {
+    values[i] += countersNumbers[i];
+    counters[i] += countersBuffer[i];
+  }
+}
+
+/** Resource property holding the `runAsync()` measure it belongs to. */
+const asyncMeasure = Symbol("runAsync");
+/** Number of `runAsync()` in progress, the hook is only enabled meanwhile. */
+var asyncActive = 0;
+/** First error of `start()`/`stop()` in a hook, which must not throw. */
+var asyncError = null;
+
+function hookCall(fn, measure) {
+  try {
+    fn(measure);
+  } catch (err) {
+    asyncError ??= err;
+  }
+}
+
+// Every callback and promise reaction created while a measure runs carries
+// it, so its segments resume counting and all others pause it, tracked or
+// not, including the continuation of each plain await.
+const asyncHook = createHook({
+  init(asyncId, type, triggerAsyncId, resource) {
+    const measure = executionAsyncResource()?.[asyncMeasure];
+    if (measure) resource[asyncMeasure] = measure;
+  },
+  before() {
+    const measure = executionAsyncResource()?.[asyncMeasure];
+    if (measure) hookCall(asyncResume, measure);
+    else if (asyncCurrent) hookCall(asyncPause, asyncCurrent);
+  },
+  after() {
+    if (asyncCurrent) hookCall(asyncPause, asyncCurrent);
+  },
+});
+
+/**
+ * Measure an async function while it runs on this thread, see `runAsync()`
+ * of index.ts. Unlike Bun, Node reports where every segment of `func` ends
+ * through async_hooks, so plain awaits pause counting as well and `track()`
+ * is optional.
+ *
+ * @param {(track: <T>(promise: T) => Promise<Awaited<T>>) => unknown} func
+ * @param {{ correct?: boolean }} [options]
+ */
+export async function runAsync(func, options) {
+  if (!countersBuffer) init();
+  const measure = {
+    values: new Float64Array(eventCount * 2),
+    counters: new BigUint64Array(eventCount * 2),
+  };
+  const resume = () => asyncResume(measure);
+  const pause = () => asyncPause(measure);
+  const track = (promise) => {
+    pause();
+    const settled = Promise.resolve(promise);
+    settled.then(resume, resume);
+    return settled;
+  };
+
+  const scope = new AsyncResource("runAsync");
+  scope[asyncMeasure] = measure;
+  if (asyncActive++ === 0) asyncHook.enable();
+  try {
+    const result = scope.runInAsyncScope(() => {
+      asyncResume(measure);
+      return Promise.resolve(func(track));
+    });
+    // func returned at its first await, or is done
+    pause();
+    await result;
+  } finally {
+    pause();
+    if (--asyncActive === 0) asyncHook.disable();
+  }
+  if (asyncError) {
+    const err = asyncError;
+    asyncError = null;
+    throw err;
+  }
+
+  countersNumbers.set(measure.values);
+  countersBuffer.set(measure.counters);
+  valueOffset = options?.correct === false ? 0 : eventCount;
+  return count;
+}
+
+/** Enable counting until `close()`, see `open()` of index.ts. */
+export function open() {
+  check(binding.open());
+  const buffer = new BigUint64Array(eventCount);
+  return {
+    countersBuffer: buffer,
+    sample(out) {
+      check(binding.sample(out || buffer));
+      return out || buffer;
+    },
+    close() {
+      // closing would turn counting off under every other context
+      if (!retained) binding.close();
+    },
+  };
+}
+
+function findEvent(name) {
+  for (const event of events) {
+    if (
+      event.index >= 0 &&
+      (event.name === name || event.event === name || event.alias === name)
+    )
+      return event;
+  }
+  return null;
+}
+
+function find(name) {
+  const event = findEvent(name);
+  return event ? event.index : -1;
+}
+
+function read(index, offset = valueOffset) {
+  if (index < 0) return 0;
+  return countersNumbers[offset + index];
+}
+
+export const count = {
+  get cycles() {
+    return read(cyclesIndex);
+  },
+  get branches() {
+    return read(branchesIndex);
+  },
+  get instructions() {
+    return read(instructionsIndex);
+  },
+  get missedBranches() {
+    return read(missedBranchesIndex);
+  },
+  get(name) {
+    return read(find(name));
+  },
+  split(name) {
+    return { user: read(find(name + ":u")), kernel: read(find(name + ":k")) };
+  },
+  raw: {
+    get cycles() {
+      return read(cyclesIndex, 0);
+    },
+    get branches() {
+      return read(branchesIndex, 0);
+    },
+    get instructions() {
+      return read(instructionsIndex, 0);
+    },
+    get missedBranches() {
+      return read(missedBranchesIndex, 0);
+    },
+    get(name) {
+      return read(find(name), 0);
+    },
+  },
+  /** @type {BigUint64Array | null} */
+  countersBuffer: null,
+  /** @type {Float64Array | null} */
+  values: null,
+  /** @type {BigUint64Array | null} */
+  results: null,
+  cyclesOffset: -1,
+  branchesOffset: -1,
+  instructionsOffset: -1,
+  missedBranchesOffset: -1,
+};
+
+export function close() {
+  if (retained) binding.release();
+  else binding.close();
+  retained = false;
+  count.countersBuffer = countersBuffer = null;
+  count.values = countersNumbers = null;
+  count.results = results = null;
+  events = [];
+  eventCount = valueOffset = 0;
+}
@@ -0,0 +1,119 @@
+// What observing costs: the hot paths of this library, per call, in
+// instructions, cycles and nanoseconds. Save a baseline and compare against
+// it like any other suite to catch changes that make measuring more
+// expensive:
+//
+//   bun bench.ts self.bench.ts --save self.json
+//   bun bench.ts self.bench.ts --compare self.json
+//
+// Every case calls start()/stop() or run() itself, so they are `sampled`.
+// Suites are defined before `init()`, so anything that needs the counters
+// is set up in `setup`.
+
+import { bench, suite, type BenchOptions } from "./bench";
+import {
+  count,
+  enter,
+  exit,
+  open,
+  region,
+  run,
+  runMany,
+  start,
+  startInline,
+  stop,
+  stopInline,
+  telemetry,
+  type Session,
+} from "./index";
+
+const sampled: BenchOptions = { sampled: true };
+const noop = () => {};
+
+// Written by the getter cases so reads can't be optimized away.
+export var sink = 0;
+
+suite("observe", () => {
+  bench(
+    "start/stop",
+    () => {
+      start();
+      stop();
+    },
+    sampled
+  );
+  bench(
+    "startInline/stopInline",
+    () => {
+      startInline();
+      stopInline();
+    },
+    sampled
+  );
+  bench("run(noop)", () => run(noop), sampled);
+  // Per call of 100 iterations, divide by 100 for one iteration.
+  bench("runMany(noop, 100)", () => runMany(noop, 100), sampled);
+
+  let session: Session;
+  let out = new BigUint64Array(0);
+  bench("session.sample", () => session.sample(out), {
+    ...sampled,
+    setup: () => {
+      session = open();
+      out = new BigUint64Array(session.countersBuffer.length);
+    },
+  });
+});
+
+suite("results", () => {
+  bench("count.cycles", () => (sink += count.cycles), {
+    ...sampled,
+    setup: () => run(noop),
+  });
+  bench("count.get", () => (sink += count.get("instructions")), {
+    ...sampled,
+    setup: () => run(noop),
+  });
+  bench("count.values", () => (sink += count.values![0]), {
+    ...sampled,
+    setup: () => run(noop),
+  });
+});
+
+if (process.platform === "darwin") {
+  suite("modes", () => {
+    let id = 0;
+    bench(
+      "enter/exit",
+      () => {
+        enter(id);
+        exit();
+      },
+      { ...sampled, setup: () => (id = region("self")) }
+    );
+
+    // The same round trip with the telemetry thread sampling every 1 ms.
+    bench(
+      "start/stop with telemetry",
+      () => {
+        start();
+        stop();
+      },
+      {
+        ...sampled,
+        setup: () => telemetry.start({ intervalMs: 1 }),
+        teardown: () => telemetry.stop(),
+      }
+    );
+
+    let ring = new BigUint64Array(0);
+    bench("telemetry.drainInto", () => (sink += telemetry.drainInto(ring)), {
+      ...sampled,
+      setup: () => {
+        telemetry.start({ intervalMs: 1 });
+        ring = new BigUint64Array(telemetry.stride * 1024);
+      },
+      teardown: () => telemetry.stop(),
+    });
+  });
+}
@@ -0,0 +1,139 @@
+// Reader for the trace files `profileProcess()` writes with `trace`, see
+// "Trace files" in counters.c for the layout.
+//
+// The file is mapped and every column is a typed array view into the
+// mapping, so millions of samples are read without copying or parsing them
+// into objects.
+
+const MAGIC = "KPCTRACE";
+const VERSION = 1;
+const HEADER_SIZE = 64;
+const EVENT_SIZE = 16;
+const BLOCK_HEADER_SIZE = 8;
+
+export interface TraceEvent {
+  name: string;
+  /** Event number, and umask << 8. */
+  id: number;
+  /** Whether the event is on a fixed counter. */
+  fixed: boolean;
+  /** Counter column of the event in each block. */
+  column: number;
+}
+
+export interface TraceBlock {
+  rows: number;
+  /** When each sample was taken, in ticks of `tickFrequency`. */
+  timestamps: BigUint64Array;
+  /** Thread of each sample. */
+  tids: Uint32Array;
+  /**
+   * One column per event, in `events` order. The counts are the thread's
+   * totals at the sample, subtract the previous sample of the same thread
+   * for a delta.
+   */
+  counters: BigUint64Array[];
+}
+
+export interface Trace {
+  /** Profiled process, -1 for all. */
+  pid: number;
+  /** Timestamp ticks per second. */
+  tickFrequency: number;
+  /** Sampling period, in ticks. */
+  periodTicks: number;
+  events: TraceEvent[];
+  /** Number of samples in all blocks. */
+  rows: number;
+  /** Blocks of up to a few thousand samples, in capture order. */
+  blocks: TraceBlock[];
+  /** The counter column of an event in `block`, by name. */
+  column(block: TraceBlock, name: string): BigUint64Array | undefined;
+  /** Convert a timestamp or a duration in ticks to nanoseconds. */
+  ticksToNs(ticks: bigint | number): number;
+}
+
+/**
+ * Map a trace file. A file that was cut off, e.g. by a crash during
+ * capture, is read up to its last complete block.
+ */
+export function openTrace(path: string): Trace {
+  const bytes = Bun.mmap(path);
+  const view = new DataView(bytes.buffer, bytes.byteOffset, bytes.byteLength);
+  const text = new TextDecoder();
+
+  if (
+    bytes.byteLength < HEADER_SIZE ||
+    text.decode(bytes.subarray(0, 8)) !== MAGIC
+  ) {
+    throw new Error(`${path} is not a trace file`);
+  }
+  const version = view.getUint32(8, true);
+  if (version !== VERSION) {
+    throw new Error(`Unsupported trace version ${version}`);
+  }
+  const headerSize = view.getUint32(12, true);
+  const eventCount = view.getUint32(16, true);
+  const counterCount = view.getUint32(20, true);
+  const pid = view.getInt32(28, true);
+  const tickFrequency = Number(view.getBigUint64(32, true));
+  const periodTicks = Number(view.getBigUint64(40, true));
+
+  const events: TraceEvent[] = [];
+  for (let e = 0; e < eventCount; e++) {
+    const offset = HEADER_SIZE + e * EVENT_SIZE;
+    const name = view.getUint32(offset + 12, true);
+    events.push({
+      name: text.decode(bytes.subarray(name, bytes.indexOf(0, name))),
+      id: view.getUint32(offset + 4, true),
+      fixed: (view.getUint32(offset + 8, true) & 1) !== 0,
+      column: view.getUint32(offset, true),
+    });
+  }
+
+  const blocks: TraceBlock[] = [];
+  let rows = 0;
+  let offset = headerSize;
+  while (offset + BLOCK_HEADER_SIZE <= bytes.length) {
+    const count = view.getUint32(offset, true);
+    const size = view.getUint32(offset + 4, true);
+    if (!size || offset + size > bytes.length) break;
+
+    const base = bytes.byteOffset + offset + BLOCK_HEADER_SIZE;
+    const columns: BigUint64Array[] = [];
+    for (let c = 0; c < counterCount; c++) {
+      columns.push(
+        new BigUint64Array(bytes.buffer, base + (1 + c) * count * 8, count)
+      );
+    }
+    blocks.push({
+      rows: count,
+      timestamps: new BigUint64Array(bytes.buffer, base, count),
+      tids: new Uint32Array(
+        bytes.buffer,
+        base + (1 + counterCount) * count * 8,
+        count
+      ),
+      counters: events.map((event) => columns[event.column]),
+    });
+    rows += count;
+    offset += size;
+  }
+
+  const nsPerTick = 1e9 / tickFrequency;
+  return {
+    pid,
+    tickFrequency,
+    periodTicks,
+    events,
+    rows,
+    blocks,
+    column(block, name) {
+      const index = events.findIndex((event) => event.name === name);
+      return index < 0 ? undefined : block.counters[index];
+    },
+    ticksToNs(ticks) {
+      return Number(ticks) * nsPerTick;
+    },
+  };
+}